@@ -0,0 +1,342 @@
+/*
+ * aio.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "fsmock.h"
+
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+/*
+ * The eventfd is ours, so it's driven with raw system calls rather than
+ * through our own read() and write().
+ */
+static inline void
+aio_signal(struct fsmock_bio_ctx *ctx)
+{
+        uint64_t one = 1;
+
+        syscall(SYS_write, ctx->efd, &one, sizeof(one));
+}
+
+static inline void
+aio_unsignal(struct fsmock_bio_ctx *ctx)
+{
+        uint64_t count;
+
+        syscall(SYS_read, ctx->efd, &count, sizeof(count));
+}
+
+/*
+ * Put a finished request on the done list.  Call with ctx->lock held.
+ */
+static void
+aio_complete(struct fsmock_bio_ctx *ctx, struct aio_req *req)
+{
+        if (list_empty(&ctx->done))
+                aio_signal(ctx);
+        list_add_tail(&req->list, &ctx->done);
+        ctx->nr_done += 1;
+        pthread_cond_broadcast(&ctx->completed);
+}
+
+static int64_t
+aio_execute(struct aio_req *req)
+{
+        const struct fsmock_bio_sqe *sqe = &req->sqe;
+        ssize_t ret;
+
+        switch (sqe->opcode) {
+        case FSMOCK_BIO_READ:
+                ret = bio_file_pread(req->file, sqe->addr, sqe->len,
+                                     sqe->offset);
+                break;
+        case FSMOCK_BIO_WRITE:
+                ret = bio_file_pwrite(req->file, sqe->addr, sqe->len,
+                                      sqe->offset);
+                break;
+        case FSMOCK_BIO_READV:
+                ret = bio_file_preadv(req->file, sqe->addr, sqe->len,
+                                      sqe->offset);
+                break;
+        case FSMOCK_BIO_WRITEV:
+                ret = bio_file_writev(req->file, sqe->addr, sqe->len,
+                                      sqe->offset);
+                break;
+        default:
+                errno = EINVAL;
+                ret = -1;
+                break;
+        }
+        return ret < 0 ? -errno : ret;
+}
+
+/*
+ * Workers take requests in the order they were submitted.  When the
+ * context is being destroyed, they finish whatever's pending first.
+ */
+static void *
+aio_worker(void *data)
+{
+        struct fsmock_bio_ctx *ctx = data;
+
+        pthread_mutex_lock(&ctx->lock);
+        for (;;) {
+                struct aio_req *req;
+
+                while (list_empty(&ctx->pending) && !ctx->stopping)
+                        pthread_cond_wait(&ctx->submitted, &ctx->lock);
+                if (list_empty(&ctx->pending))
+                        break;
+
+                req = list_entry(ctx->pending.next, struct aio_req, list);
+                list_del(&req->list);
+                pthread_mutex_unlock(&ctx->lock);
+
+                req->res = aio_execute(req);
+                bio_file_put(req->file);
+                req->file = NULL;
+                probe(bio_complete, ctx, req->sqe.user_data, req->res);
+
+                pthread_mutex_lock(&ctx->lock);
+                aio_complete(ctx, req);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+
+        return NULL;
+}
+
+static void
+aio_stop(struct fsmock_bio_ctx *ctx)
+{
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stopping = true;
+        pthread_cond_broadcast(&ctx->submitted);
+        pthread_mutex_unlock(&ctx->lock);
+
+        for (unsigned int i = 0; i < ctx->nr_workers; i++)
+                pthread_join(ctx->workers[i], NULL);
+        ctx->nr_workers = 0;
+}
+
+static void
+aio_free(struct fsmock_bio_ctx *ctx)
+{
+        if (ctx->efd >= 0)
+                syscall(SYS_close, ctx->efd);
+        pthread_cond_destroy(&ctx->completed);
+        pthread_cond_destroy(&ctx->submitted);
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx->workers);
+        free(ctx->reqs);
+        free(ctx);
+}
+
+struct fsmock_bio_ctx PUBLIC *
+fsmock_bio_setup(unsigned int entries, unsigned int workers)
+{
+        struct fsmock_bio_ctx *ctx;
+        sigset_t all, old;
+        int error;
+
+        config_load();
+
+        if (!entries || entries > AIO_MAX_ENTRIES) {
+                errno = EINVAL;
+                return NULL;
+        }
+        if (!workers) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+                workers = cpus > 0 ? cpus : 1;
+        }
+        if (workers > entries)
+                workers = entries;
+
+        ctx = calloc(1, sizeof(*ctx));
+        if (!ctx)
+                return NULL;
+        pthread_mutex_init(&ctx->lock, NULL);
+        pthread_cond_init(&ctx->submitted, NULL);
+        pthread_cond_init(&ctx->completed, NULL);
+        INIT_LIST_HEAD(&ctx->free);
+        INIT_LIST_HEAD(&ctx->pending);
+        INIT_LIST_HEAD(&ctx->done);
+        ctx->efd = -1;
+
+        ctx->reqs = calloc(entries, sizeof(*ctx->reqs));
+        ctx->workers = calloc(workers, sizeof(*ctx->workers));
+        if (!ctx->reqs || !ctx->workers)
+                goto err;
+        for (unsigned int i = 0; i < entries; i++)
+                list_add_tail(&ctx->reqs[i].list, &ctx->free);
+        ctx->entries = entries;
+        ctx->nr_free = entries;
+
+        ctx->efd = syscall(SYS_eventfd2, 0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (ctx->efd < 0)
+                goto err;
+
+        /*
+         * Like the trace drainer, workers block every signal, so they
+         * never take one that was meant for the program.
+         */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        for (unsigned int i = 0; i < workers; i++) {
+                error = pthread_create(&ctx->workers[i], NULL, aio_worker,
+                                       ctx);
+                if (error) {
+                        pthread_sigmask(SIG_SETMASK, &old, NULL);
+                        aio_stop(ctx);
+                        errno = error;
+                        goto err;
+                }
+                ctx->nr_workers += 1;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        return ctx;
+err:
+        error = errno;
+        aio_free(ctx);
+        errno = error;
+        return NULL;
+}
+
+int PUBLIC
+fsmock_bio_eventfd(struct fsmock_bio_ctx *ctx)
+{
+        return ctx->efd;
+}
+
+/*
+ * The fd is looked up when the request is submitted, and the request
+ * holds a reference on its bio handle until it's been serviced, so
+ * closing the fd in the meantime doesn't pull the device out from under
+ * it.  A bad fd completes the request straight away with -EBADF.
+ */
+static struct bio_file *
+aio_file_get(int fd)
+{
+        struct fd_state state, again;
+        struct bio_file *file;
+
+        if (!fd_state_get(fd, &state) || state.bfd < 0)
+                return NULL;
+        file = bio_file_get(state.bfd);
+        if (!file)
+                return NULL;
+
+        /*
+         * If the fd was closed while we looked, the bfd may be somebody
+         * else's by now.
+         */
+        if (!fd_state_get(fd, &again) ||
+            again.generation != state.generation) {
+                bio_file_put(file);
+                return NULL;
+        }
+        return file;
+}
+
+int PUBLIC
+fsmock_bio_submit(struct fsmock_bio_ctx *ctx,
+                  const struct fsmock_bio_sqe *sqes, unsigned int n)
+{
+        unsigned int i;
+
+        pthread_mutex_lock(&ctx->lock);
+        for (i = 0; i < n && ctx->nr_free; i++) {
+                const struct fsmock_bio_sqe *sqe = &sqes[i];
+                struct aio_req *req;
+
+                probe(bio_submit, ctx, sqe->fd, sqe->opcode, sqe->user_data);
+                req = list_entry(ctx->free.next, struct aio_req, list);
+                list_del(&req->list);
+                ctx->nr_free -= 1;
+                req->sqe = *sqe;
+
+                req->file = aio_file_get(sqe->fd);
+                if (!req->file) {
+                        req->res = -EBADF;
+                        aio_complete(ctx, req);
+                        continue;
+                }
+                list_add_tail(&req->list, &ctx->pending);
+                pthread_cond_signal(&ctx->submitted);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (n && !i) {
+                errno = EAGAIN;
+                return -1;
+        }
+        return i;
+}
+
+int PUBLIC
+fsmock_bio_reap(struct fsmock_bio_ctx *ctx, struct fsmock_bio_cqe *cqes,
+                unsigned int min, unsigned int max)
+{
+        unsigned int n = 0;
+
+        if (min > max) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (min > ctx->entries - ctx->nr_free)
+                min = ctx->entries - ctx->nr_free;
+        while (ctx->nr_done < min)
+                pthread_cond_wait(&ctx->completed, &ctx->lock);
+
+        while (n < max && !list_empty(&ctx->done)) {
+                struct aio_req *req;
+
+                req = list_entry(ctx->done.next, struct aio_req, list);
+                list_del(&req->list);
+                ctx->nr_done -= 1;
+                cqes[n].user_data = req->sqe.user_data;
+                cqes[n].res = req->res;
+                n++;
+
+                list_add(&req->list, &ctx->free);
+                ctx->nr_free += 1;
+        }
+        if (n && list_empty(&ctx->done))
+                aio_unsignal(ctx);
+        pthread_mutex_unlock(&ctx->lock);
+
+        return n;
+}
+
+void PUBLIC
+fsmock_bio_destroy(struct fsmock_bio_ctx *ctx)
+{
+        if (!ctx)
+                return;
+
+        aio_stop(ctx);
+        aio_free(ctx);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,63 @@
+/*
+ * aio.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_AIO_H_
+#define FSMOCK_AIO_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * An fsmock_bio_setup() context.  Every request it can hold is allocated
+ * up front and moves between three lists: free, pending (submitted but
+ * not picked up by a worker yet) and done (completed but not reaped).
+ * While a worker is servicing one it's on none of them.  Everything is
+ * protected by lock; the eventfd is written when done stops being
+ * empty, and read back when it's empty again, so it's readable exactly
+ * when there's something to reap.
+ */
+#define AIO_MAX_ENTRIES         32768
+
+struct aio_req {
+        struct list_head list;
+        struct fsmock_bio_sqe sqe;
+        struct bio_file *file;
+        int64_t res;
+};
+
+struct fsmock_bio_ctx {
+        pthread_mutex_t lock;
+        pthread_cond_t submitted;
+        pthread_cond_t completed;
+        struct list_head free;
+        struct list_head pending;
+        struct list_head done;
+        unsigned int entries;
+        unsigned int nr_free;
+        unsigned int nr_done;
+        bool stopping;
+        int efd;
+        unsigned int nr_workers;
+        pthread_t *workers;
+        struct aio_req *reqs;
+};
+
+#endif /* !FSMOCK_AIO_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -28,98 +28,115 @@
 /*
  * Our constructor will set these up as the calls to libc's functions.
  */
-int PRIVATE (*libc_access)(const char *pathname, int mode);
-int PRIVATE (*libc_close)(int fd);
-int PRIVATE (*libc_closedir)(DIR *dirp);
-int PRIVATE (*libc_dirfd)(DIR *dirp);
-int PRIVATE (*libc_faccessat)(int dirfd, const char *pathname, int mode, int flags);
-int PRIVATE (*libc_fcntl)(int fd, int cmd, ...);
-FILE PRIVATE *(*libc_fdopen)(int fd, const char *mode);
-DIR PRIVATE *(*libc_fdopendir)(int fd);
-int PRIVATE (*libc_fileno)(FILE *stream);
-FILE PRIVATE *(*libc_fopen)(const char *pathname, const char *mode);
-FILE PRIVATE *(*libc_freopen)(const char *pathname, const char *mode, FILE *stream);
-ssize_t PRIVATE (*libc_getxattr)(const char *path, const char *name, void *value, size_t size);
-int PRIVATE (*libc_ioctl)(int fd, unsigned long request, ...);
-off_t PRIVATE (*libc_lseek)(int fd, off_t offset, int whence);
-int PRIVATE (*libc_open)(const char *pathname, int flags, ...);
-int PRIVATE (*libc_openat)(int dirfd, const char *pathname, int flags, ...);
-DIR PRIVATE *(*libc_opendir)(const char *name);
-struct PRIVATE dirent *(*libc_readdir)(DIR *dirp);
-ssize_t PRIVATE (*libc_readlink)(const char *pathname, char *buf, size_t bufsiz);
-ssize_t PRIVATE (*libc_readlinkat)(int dirfd, const char *pathname, char *buf, size_t bufsiz);
-int PRIVATE (*libc_stat)(const char *pathname, struct stat *statbuf);
+#define FSMOCK_LIBC_POINTER(name, sym, ret_type, rtype, params, ...)    \
+        rtype (*libc_ ## name) params PRIVATE;
+FSMOCK_CALLS(FSMOCK_LIBC_POINTER)
+#undef FSMOCK_LIBC_POINTER
+
+/*
+ * And this is where they come from.
+ */
+struct libc_symbol {
+        const char *name;
+        const char *version;
+        void **ptr;
+        bool optional;
+};
+
+#define FSMOCK_LIBC_SYMBOL_2_2_5(name, sym, ...)                        \
+        { #sym, "GLIBC_2.2.5", (void **)&libc_ ## name },
+#define FSMOCK_LIBC_SYMBOL_2_3(name, sym, ...)                          \
+        { #sym, "GLIBC_2.3", (void **)&libc_ ## name },
+#define FSMOCK_LIBC_SYMBOL_2_4(name, sym, ...)                          \
+        { #sym, "GLIBC_2.4", (void **)&libc_ ## name },
+#define FSMOCK_LIBC_SYMBOL_2_9(name, sym, ...)                          \
+        { #sym, "GLIBC_2.9", (void **)&libc_ ## name },
+#define FSMOCK_LIBC_SYMBOL_2_10(name, sym, ...)                         \
+        { #sym, "GLIBC_2.10", (void **)&libc_ ## name },
+#define FSMOCK_LIBC_SYMBOL_2_26(name, sym, ...)                         \
+        { #sym, "GLIBC_2.26", (void **)&libc_ ## name },
+#define FSMOCK_LIBC_SYMBOL_2_34(name, sym, ...)                         \
+        { #sym, "GLIBC_2.34", (void **)&libc_ ## name, true },
+
+static const struct libc_symbol libc_symbols[] = {
+        FSMOCK_CALLS_GLIBC_2_2_5(FSMOCK_LIBC_SYMBOL_2_2_5)
+        FSMOCK_CALLS_GLIBC_2_3(FSMOCK_LIBC_SYMBOL_2_3)
+        FSMOCK_CALLS_GLIBC_2_4(FSMOCK_LIBC_SYMBOL_2_4)
+        FSMOCK_CALLS_GLIBC_2_9(FSMOCK_LIBC_SYMBOL_2_9)
+        FSMOCK_CALLS_GLIBC_2_10(FSMOCK_LIBC_SYMBOL_2_10)
+        FSMOCK_CALLS_GLIBC_2_26(FSMOCK_LIBC_SYMBOL_2_26)
+        FSMOCK_CALLS_GLIBC_2_34(FSMOCK_LIBC_SYMBOL_2_34)
+};
 
 /*
  * If we need other libc symbols, this is a dlhandle for our private copy of
- * libc
+ * libc, or RTLD_NEXT if we're using the one everybody else is.
  */
 void PRIVATE *libc;
 
-static void log_call(const char *name, ...);
-
 /*
  * a DIR * and a fd for our root filesystem path
  */
 DIR PRIVATE *rootdir = NULL;
 int PRIVATE rootfd = -1;
 
+static pthread_once_t fsmock_once = PTHREAD_ONCE_INIT;
+static bool fsmock_ready;
+
+/*
+ * Everything here happens exactly once, however many threads get here
+ * first.  It mustn't call any of our own wrappers.
+ */
+static enum passthrough_mode
+get_passthrough_mode(void)
+{
+        const char *mode = getenv("LIBFSMOCK_PASSTHROUGH");
+
+        if (!mode || !mode[0] || !strcmp(mode, "dlmopen"))
+                return PASSTHROUGH_DLMOPEN;
+        if (!strcmp(mode, "next"))
+                return PASSTHROUGH_NEXT;
+        if (!strcmp(mode, "syscall"))
+                return PASSTHROUGH_SYSCALL;
+
+        /*
+         * We're preloaded into everything, shells and compilers too, so
+         * a typo here mustn't kill them.
+         */
+        errno = EINVAL;
+        fsmock_error("unknown LIBFSMOCK_PASSTHROUGH \"%s\", using dlmopen",
+                     mode);
+        return PASSTHROUGH_DLMOPEN;
+}
+
 static void
-fsmock_init(void)
+fsmock_init_once(void)
 {
+        enum passthrough_mode mode;
         char *rootpath;
 
-        if (libc)
-                return;
-
         rootpath = getenv("LIBFSMOCK_ROOT");
         assert(rootpath != NULL);
 
-        libc = dlmopen(LM_ID_NEWLM, "libc.so.6",
-                       RTLD_NOW|RTLD_LOCAL|RTLD_NODELETE|RTLD_DEEPBIND);
-        assert_perror(libc == NULL ? errno : 0);
-
-        libc_access = dlvsym(libc, "access", "GLIBC_2.2.5");
-        assert(libc_access != NULL);
-        libc_close = dlvsym(libc, "close", "GLIBC_2.2.5");
-        assert(libc_close != NULL);
-        libc_closedir = dlvsym(libc, "closedir", "GLIBC_2.2.5");
-        assert(libc_closedir != NULL);
-        libc_dirfd = dlvsym(libc, "dirfd", "GLIBC_2.2.5");
-        assert(libc_dirfd != NULL);
-        libc_fcntl = dlvsym(libc, "fcntl", "GLIBC_2.2.5");
-        assert(libc_fcntl != NULL);
-        libc_fdopen = dlvsym(libc, "fdopen", "GLIBC_2.2.5");
-        assert(libc_fdopen != NULL);
-        libc_fdopendir = dlvsym(libc, "fdopendir", "GLIBC_2.4");
-        assert(libc_fdopendir != NULL);
-        libc_fileno = dlvsym(libc, "fileno", "GLIBC_2.2.5");
-        assert(libc_fileno != NULL);
-        libc_fopen = dlvsym(libc, "fopen", "GLIBC_2.2.5");
-        assert(libc_fopen != NULL);
-        libc_freopen = dlvsym(libc, "freopen", "GLIBC_2.2.5");
-        assert(libc_freopen != NULL);
-        libc_ioctl = dlvsym(libc, "ioctl", "GLIBC_2.2.5");
-        assert(libc_ioctl != NULL);
-        libc_lseek = dlvsym(libc, "lseek", "GLIBC_2.2.5");
-        assert(libc_lseek != NULL);
-        libc_open = dlvsym(libc, "open", "GLIBC_2.2.5");
-        assert(libc_open != NULL);
-        libc_opendir = dlvsym(libc, "opendir", "GLIBC_2.2.5");
-        assert(libc_opendir != NULL);
-        libc_readdir = dlvsym(libc, "readdir", "GLIBC_2.2.5");
-        assert(libc_readdir != NULL);
-        libc_readlink = dlvsym(libc, "readlink", "GLIBC_2.2.5");
-        assert(libc_readlink != NULL);
-        libc_getxattr = dlvsym(libc, "getxattr", "GLIBC_2.3");
-        assert(libc_getxattr != NULL);
-        libc_faccessat = dlvsym(libc, "faccessat", "GLIBC_2.4");
-        assert(libc_faccessat != NULL);
-        libc_openat = dlvsym(libc, "openat", "GLIBC_2.4");
-        assert(libc_openat != NULL);
-        libc_readlinkat = dlvsym(libc, "readlinkat", "GLIBC_2.4");
-        assert(libc_readlinkat != NULL);
-        libc_stat = dlvsym(libc, "__xstat", "GLIBC_2.2.5");
+        mode = get_passthrough_mode();
+        if (mode == PASSTHROUGH_DLMOPEN) {
+                libc = dlmopen(LM_ID_NEWLM, "libc.so.6",
+                               RTLD_NOW|RTLD_LOCAL|RTLD_NODELETE|RTLD_DEEPBIND);
+                assert_perror(libc == NULL ? errno : 0);
+        } else {
+                libc = RTLD_NEXT;
+        }
+
+        for (unsigned int i = 0; i < sizeof(libc_symbols) / sizeof(libc_symbols[0]); i++) {
+                const struct libc_symbol *sym = &libc_symbols[i];
+
+                *sym->ptr = dlvsym(libc, sym->name, sym->version);
+                assert(*sym->ptr != NULL || sym->optional);
+        }
+        passthrough_fill_in();
+
+        if (mode == PASSTHROUGH_SYSCALL)
+                passthrough_use_syscalls();
 
         rootdir = libc_opendir(rootpath);
         assert(rootdir != NULL);
@@ -128,13 +145,35 @@ fsmock_init(void)
         assert(rootfd >= 0);
 }
 
-static void DESTRUCTOR
-fsmock_fini(void)
+static void NOINLINE COLD
+fsmock_init_slow(void)
 {
-        if (libc) {
-                dlclose(libc);
-                libc = NULL;
-        }
+        pthread_once(&fsmock_once, fsmock_init_once);
+        config_load();
+        __atomic_store_n(&fsmock_ready, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Once we're set up, this is one load and a branch that's always
+ * predicted right, and every libc_* pointer has already been resolved.
+ */
+static inline void
+fsmock_init(void)
+{
+        if (__builtin_expect(!__atomic_load_n(&fsmock_ready, __ATOMIC_ACQUIRE), 0))
+                fsmock_init_slow();
+}
+
+/*
+ * Normally everything gets set up before main(), but another library's
+ * constructor can still call us first.  There's deliberately no
+ * destructor: libc is loaded RTLD_NODELETE, and other destructors and
+ * atexit() handlers may still call through us after ours would run.
+ */
+static void CONSTRUCTOR
+fsmock_constructor(void)
+{
+        fsmock_init();
 }
 
 static inline UNUSED const char *
@@ -143,64 +182,293 @@ demangle_path(const char *path)
         return path;
 }
 
-#define do_call(rtype, name, ...)                                       \
+/*
+ * Count a finished call as mocked or passed through, and trace it.
+ */
+#define call_done(name, path, start, ret, ...)                          \
         ({                                                              \
+                stats_add(CALL_ ## name, (path), (start),               \
+                          stats_failed(ret));                           \
+                trace_call(name, (start), (ret), __VA_ARGS__);          \
+        })
+
+#define do_call_(path, rtype, name, ...)                                \
+        ({                                                              \
+                uint64_t start_ = trace_start(CALL_ ## name);           \
                 rtype ret_;                                             \
                                                                         \
                 ret_ = libc_ ## name (__VA_ARGS__);                     \
-                log_call(#name, ret_, __VA_ARGS__);                     \
+                call_done(name, (path), start_, ret_, __VA_ARGS__);     \
                 ret_;                                                   \
         })
 
+/*
+ * do_call() passes a call straight on to libc; do_mocked_call() is for
+ * ones we've pointed at something under LIBFSMOCK_ROOT, which count as
+ * mocked.
+ */
+#define do_call(rtype, name, ...) \
+        do_call_(STATS_PASSTHROUGH, rtype, name, __VA_ARGS__)
+#define do_mocked_call(rtype, name, ...) \
+        do_call_(STATS_MOCKED, rtype, name, __VA_ARGS__)
+
+/*
+ * Record that fd, fresh from one of our opens, is ours.  On failure,
+ * close it and anything that was going with it.
+ */
+static int
+install_fd(int fd, int bfd)
+{
+        int error;
+
+        if (fd >= 0 && fd_state_install(fd, bfd) == 0)
+                return fd;
+
+        error = errno;
+        if (fd >= 0)
+                libc_close(fd);
+        if (bfd >= 0)
+                bio_close(bfd);
+        errno = error;
+        return -1;
+}
+
+/*
+ * fd is about to be closed by something other than close(), or was just
+ * made by something other than one of our opens; either way, whatever
+ * record it has is stale, so forget it and close its bio handle.
+ * Returns whether there was one.
+ */
+static bool
+forget_fd(int fd)
+{
+        struct fd_state state;
+        int error;
+
+        if (!fd_state_clear(fd, &state))
+                return false;
+
+        error = errno;
+        if (state.bfd >= 0)
+                bio_close(state.bfd);
+        errno = error;
+        return true;
+}
+
+/*
+ * newfd was just made as a copy of oldfd.  If oldfd is ours, so is
+ * newfd, and they share a bio handle the way dup()ed fds share an open
+ * file.
+ */
+static int
+copy_fd(int oldfd, int newfd)
+{
+        struct fd_state state, again;
+
+        if (newfd < 0)
+                return newfd;
+        if (!fd_state_get(oldfd, &state)) {
+                forget_fd(newfd);
+                return newfd;
+        }
+        if (state.bfd >= 0) {
+                if (bio_dup(state.bfd) < 0)
+                        goto err;
+                /*
+                 * If oldfd got closed meanwhile, the bfd may belong to
+                 * somebody else's open by now.
+                 */
+                if (!fd_state_get(oldfd, &again) ||
+                    again.generation != state.generation) {
+                        bio_close(state.bfd);
+                        goto err;
+                }
+        }
+        return install_fd(newfd, state.bfd);
+err:
+        libc_close(newfd);
+        errno = EBADF;
+        return -1;
+}
+
 int PUBLIC
 access(const char *pathname, int mode)
 {
+        enum stats_path path = STATS_PASSTHROUGH;
+        uint64_t start;
         int ret;
 
         fsmock_init();
+        probe(access_entry, pathname, mode);
+        start = trace_start(CALL_access);
 
-        if (is_our_path(pathname))
+        if (is_our_path(pathname)) {
                 ret = libc_faccessat(rootfd, pathname, mode, 0);
-        else
+                path = STATS_MOCKED;
+        } else {
                 ret = libc_access(pathname, mode);
-        log_call("access", ret, pathname, mode);
+        }
+        call_done(access, path, start, ret, pathname, mode);
 
-        return ret;
+        return probe_return(access_return, ret);
 }
 
 int PUBLIC
 close(int fd)
 {
+        struct fd_state state;
+
         fsmock_init();
+        probe(close_entry, fd);
 
-        fd = demangle_fd(fd);
-        return do_call(int, close, fd);
+        if (fd_state_clear(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_close);
+                int ret;
+
+                bio_close(state.bfd);
+                ret = libc_close(fd);
+                call_done(close, STATS_MOCKED, start, ret, fd);
+                return probe_return(close_return, ret);
+        }
+        return probe_return(close_return, do_call(int, close, fd));
+}
+
+int PUBLIC
+close_range(unsigned int first, unsigned int last, int flags)
+{
+        enum stats_path path = STATS_PASSTHROUGH;
+        uint64_t start;
+        int ret;
+
+        fsmock_init();
+        probe(close_range_entry, first, last, flags);
+        start = trace_start(CALL_close_range);
+
+        if (!(flags & CLOSE_RANGE_CLOEXEC)) {
+                for (unsigned int fd = first;
+                     fd <= last && fd < FD_MAX_STATES; fd++)
+                        if (forget_fd(fd))
+                                path = STATS_MOCKED;
+        }
+        ret = libc_close_range(first, last, flags);
+        call_done(close_range, path, start, ret, first, last, flags);
+
+        return probe_return(close_range_return, ret);
 }
 
 int PUBLIC
 closedir(DIR *dirp)
 {
         fsmock_init();
+        probe(closedir_entry, dirp);
 
-        return do_call(int, closedir, dirp);
+        return probe_return(closedir_return, do_call(int, closedir, dirp));
 }
 
 int PUBLIC
 dirfd(DIR *dirp)
 {
         fsmock_init();
+        probe(dirfd_entry, dirp);
+
+        return probe_return(dirfd_return, do_call(int, dirfd, dirp));
+}
+
+int PUBLIC
+dup(int oldfd)
+{
+        enum stats_path path;
+        uint64_t start;
+        int ret;
+
+        fsmock_init();
+        probe(dup_entry, oldfd);
+        start = trace_start(CALL_dup);
+
+        path = is_our_fd(oldfd) ? STATS_MOCKED : STATS_PASSTHROUGH;
+        ret = copy_fd(oldfd, libc_dup(oldfd));
+        call_done(dup, path, start, ret, oldfd);
+
+        return probe_return(dup_return, ret);
+}
+
+/*
+ * dup2() and dup3() close newfd first if it's open, which takes care of
+ * its record too; see fd_state_install().
+ */
+int PUBLIC
+dup2(int oldfd, int newfd)
+{
+        enum stats_path path;
+        uint64_t start;
+        int ret;
+
+        fsmock_init();
+        probe(dup2_entry, oldfd, newfd);
+        start = trace_start(CALL_dup2);
+
+        path = is_our_fd(oldfd) ? STATS_MOCKED : STATS_PASSTHROUGH;
+        ret = libc_dup2(oldfd, newfd);
+        if (oldfd != newfd)
+                ret = copy_fd(oldfd, ret);
+        call_done(dup2, path, start, ret, oldfd, newfd);
 
-        return do_call(int, dirfd, dirp);
+        return probe_return(dup2_return, ret);
+}
+
+int PUBLIC
+dup3(int oldfd, int newfd, int flags)
+{
+        enum stats_path path;
+        uint64_t start;
+        int ret;
+
+        fsmock_init();
+        probe(dup3_entry, oldfd, newfd, flags);
+        start = trace_start(CALL_dup3);
+
+        path = is_our_fd(oldfd) ? STATS_MOCKED : STATS_PASSTHROUGH;
+        ret = copy_fd(oldfd, libc_dup3(oldfd, newfd, flags));
+        call_done(dup3, path, start, ret, oldfd, newfd, flags);
+
+        return probe_return(dup3_return, ret);
 }
 
 int PUBLIC
 faccessat(int dirfd, const char *pathname, int mode, int flags UNUSED)
 {
+        uint64_t start;
+
         fsmock_init();
+        probe(faccessat_entry, dirfd, pathname, mode, flags);
+        start = trace_start(CALL_faccessat);
 
         errno = ENOSYS;
-        log_call("faccessat", -1, dirfd, pathname, mode, flags);
-        return -1;
+        call_done(faccessat, STATS_MOCKED, start, -1, dirfd, pathname, mode,
+                  flags);
+        return probe_return(faccessat_return, -1);
+}
+
+/*
+ * libc closes the stream's fd without going through close().
+ */
+int PUBLIC
+fclose(FILE *stream)
+{
+        enum stats_path path = STATS_PASSTHROUGH;
+        uint64_t start;
+        int ret;
+
+        fsmock_init();
+        probe(fclose_entry, stream);
+        start = trace_start(CALL_fclose);
+
+        if (forget_fd(libc_fileno(stream)))
+                path = STATS_MOCKED;
+        ret = libc_fclose(stream);
+        call_done(fclose, path, start, ret, stream);
+
+        return probe_return(fclose_return, ret);
 }
 
 int PUBLIC
@@ -210,34 +478,47 @@ fcntl(int fd, int cmd, ...)
         int ret = -1;
         const char *cmdstr = "";
         void *val = NULL;
+        enum stats_path path = STATS_MOCKED;
+        uint64_t start;
 
         fsmock_init();
+        probe(fcntl_entry, fd, cmd);
+        start = trace_start(CALL_fcntl);
 
-        fd = demangle_fd(fd);
         errno = ENOSYS;
         switch(cmd) {
         case F_DUPFD:
                 d = get_arg(cmd, int);
                 val = &d;
                 cmdstr = "F_DUPFD";
-                ret = libc_fcntl(fd, cmd, d);
+                if (!is_our_fd(fd))
+                        path = STATS_PASSTHROUGH;
+                ret = copy_fd(fd, libc_fcntl(fd, cmd, d));
                 break;
         case F_DUPFD_CLOEXEC:
+                d = get_arg(cmd, int);
+                val = &d;
                 cmdstr = "F_DUPFD_CLOEXEC";
+                if (!is_our_fd(fd))
+                        path = STATS_PASSTHROUGH;
+                ret = copy_fd(fd, libc_fcntl(fd, cmd, d));
                 break;
         case F_GETFD:
                 cmdstr = "F_GETFD";
                 ret = libc_fcntl(fd, cmd);
+                path = STATS_PASSTHROUGH;
                 break;
         case F_SETFD:
                 cmdstr = "F_SETFD";
                 d = get_arg(cmd, int);
                 val = &d;
                 ret = libc_fcntl(fd, cmd, d);
+                path = STATS_PASSTHROUGH;
                 break;
         case F_GETFL:
                 cmdstr = "F_GETFL";
                 ret = libc_fcntl(fd, cmd);
+                path = STATS_PASSTHROUGH;
                 break;
         case F_SETFL:
                 cmdstr = "F_SETFL";
@@ -307,60 +588,83 @@ fcntl(int fd, int cmd, ...)
                 break;
         }
         if (val == &d)
-                log_call("fcntl", ret, fd, cmdstr, d);
+                call_done(fcntl, path, start, ret, fd, cmdstr, d);
         else
-                log_call("fcntl", ret, fd, cmdstr, NULL);
-        return ret;
+                call_done(fcntl, path, start, ret, fd, cmdstr, 0L);
+        return probe_return(fcntl_return, ret);
 }
 
 FILE PUBLIC *
 fdopen(int fd, const char *mode)
 {
         fsmock_init();
+        probe(fdopen_entry, fd, mode);
 
-        return do_call(FILE *, fdopen, fd, mode);
+        return probe_return(fdopen_return, do_call(FILE *, fdopen, fd, mode));
 }
 
 DIR PUBLIC *
 fdopendir(int fd)
 {
+        uint64_t start;
+        DIR *ret = NULL;
+
         fsmock_init();
+        probe(fdopendir_entry, fd);
+        start = trace_start(CALL_fdopendir);
 
         errno = ENOSYS;
-        log_call("fdopendir", NULL, fd);
-        return NULL;
+        call_done(fdopendir, STATS_MOCKED, start, ret, fd);
+        return probe_return(fdopendir_return, ret);
 }
 
 int PUBLIC
 fileno(FILE *stream)
 {
         fsmock_init();
+        probe(fileno_entry, stream);
 
-        return do_call(int, fileno, stream);
+        return probe_return(fileno_return, do_call(int, fileno, stream));
 }
 
 FILE PUBLIC *
 fopen(const char *pathname, const char *mode)
 {
+        FILE *ret;
+
         fsmock_init();
+        probe(fopen_entry, pathname, mode);
 
-        return do_call(FILE *, fopen, pathname, mode);
+        ret = do_call(FILE *, fopen, pathname, mode);
+        if (ret)
+                forget_fd(libc_fileno(ret));
+        return probe_return(fopen_return, ret);
 }
 
 FILE PUBLIC *
 freopen(const char *pathname, const char *mode, FILE *stream)
 {
+        FILE *ret;
+
         fsmock_init();
+        probe(freopen_entry, pathname, mode, stream);
 
-        return do_call(FILE *, freopen, pathname, mode, stream);
+        forget_fd(libc_fileno(stream));
+        ret = do_call(FILE *, freopen, pathname, mode, stream);
+        if (ret)
+                forget_fd(libc_fileno(ret));
+        return probe_return(freopen_return, ret);
 }
 
 ssize_t PUBLIC
 getxattr(const char *path, const char *name, void *value, size_t size)
 {
         fsmock_init();
+        probe(getxattr_entry, path, name, value, size);
 
-        return do_call(ssize_t, getxattr, path, name, value, size);
+        return probe_return(getxattr_return,
+                            do_call(ssize_t, getxattr, path, name, value,
+                                    size));
 }
 
 int PUBLIC
@@ -368,270 +672,480 @@ ioctl(int fd, unsigned long request, ...)
 {
 	uintptr_t arg = get_arg(request, uintptr_t);
 	int ret = -1;
+        enum stats_path path = STATS_MOCKED;
+        uint64_t start;
+
+        fsmock_init();
+        probe(ioctl_entry, fd, request);
+        start = trace_start(CALL_ioctl);
 
 	errno = ENOSYS;
-	if (!is_blkdev_fd(fd))
+	if (!is_our_fd(fd)) {
 		ret = libc_ioctl(fd, request, arg);
-        log_call("ioctl", ret, fd, request, arg);
-        return ret;
+                path = STATS_PASSTHROUGH;
+        }
+        call_done(ioctl, path, start, ret, fd, request, arg);
+        return probe_return(ioctl_return, ret);
 }
 
 off_t PUBLIC
 lseek(int fd, off_t offset, int whence)
 {
+        struct fd_state state;
+        off_t ret;
+
         fsmock_init();
+        probe(lseek_entry, fd, offset, whence);
+
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_lseek);
 
-        fd = demangle_fd(fd);
-        return do_call(off_t, lseek, fd, offset, whence);
+                ret = bio_lseek(state.bfd, offset, whence);
+                call_done(lseek, STATS_MOCKED, start, ret, fd, offset, whence);
+                return probe_return(lseek_return, ret);
+        }
+        return probe_return(lseek_return,
+                            do_call(off_t, lseek, fd, offset, whence));
 }
 
 int PUBLIC
 open(const char *pathname, int flags, ...)
 {
         fsmock_init();
+        probe(open_entry, pathname, flags);
 
+        struct path_class pc;
         mode_t mode = 0;
+        int bfd;
+        int ret;
 
         if (flags & O_CREAT)
                 mode = get_arg(flags, mode_t);
 
-        if (is_our_path(pathname)) {
-                int ret;
+        classify_path(pathname, &pc);
+        if (pc.mocked) {
+                uint64_t start = trace_start(CALL_open);
+
+                /*
+                 * The data all comes from the bio handle, but the caller
+                 * still needs a real fd to select() on and to key our
+                 * record by, and it mustn't be the host's device.
+                 */
+                bfd = bio_open(pc.mount, flags);
+                if (bfd < 0) {
+                        call_done(open, STATS_MOCKED, start, -1, pathname,
+                                  flags, mode);
+                        return probe_return(open_return, -1);
+                }
+                ret = install_fd(libc_open("/dev/null",
+                                           O_RDWR | (flags & O_CLOEXEC)),
+                                 bfd);
+                call_done(open, STATS_MOCKED, start, ret, pathname, flags,
+                          mode);
+                return probe_return(open_return, ret);
+        } else if (pc.ours) {
                 if (mode)
-                        ret = do_call(int, openat, rootfd, pathname, flags, mode);
+                        ret = do_mocked_call(int, openat, rootfd, pathname,
+                                             flags, mode);
                 else
-                        ret = do_call(int, openat, rootfd, pathname, flags);
-                ret = mangle_fd(ret);
-                return ret;
+                        ret = do_mocked_call(int, openat, rootfd, pathname,
+                                             flags);
+                return probe_return(open_return, install_fd(ret, -1));
         } else {
                 if (mode)
-                        return do_call(int, open, pathname, flags, mode);
+                        ret = do_call(int, open, pathname, flags, mode);
                 else
-                        return do_call(int, open, pathname, flags);
+                        ret = do_call(int, open, pathname, flags);
+                forget_fd(ret);
+                return probe_return(open_return, ret);
         }
 
         errno = ENOSYS;
-        return -1;
+        return probe_return(open_return, -1);
 }
 
 int PUBLIC
 openat(int dirfd, const char *pathname, int flags, ...)
 {
+        uint64_t start;
+        int ret;
+
         fsmock_init();
+        probe(openat_entry, dirfd, pathname, flags);
 
         errno = ENOSYS;
         if (flags & O_CREAT) {
                 mode_t mode = get_arg(flags, mode_t);
-                if (dirfd == AT_FDCWD)
-                        return do_call(int, openat, dirfd, pathname, flags, mode);
-                log_call("openat", -1, dirfd, pathname, flags, mode);
+                if (dirfd == AT_FDCWD) {
+                        ret = do_call(int, openat, dirfd, pathname, flags,
+                                      mode);
+                        forget_fd(ret);
+                        return probe_return(openat_return, ret);
+                }
+                start = trace_start(CALL_openat);
+                call_done(openat, STATS_MOCKED, start, -1, dirfd, pathname,
+                          flags, mode);
         } else {
-                if (dirfd == AT_FDCWD)
-                        return do_call(int, openat, dirfd, pathname, flags);
-                log_call("openat", -1, dirfd, pathname, flags);
+                if (dirfd == AT_FDCWD) {
+                        ret = do_call(int, openat, dirfd, pathname, flags);
+                        forget_fd(ret);
+                        return probe_return(openat_return, ret);
+                }
+                start = trace_start(CALL_openat);
+                call_done(openat, STATS_MOCKED, start, -1, dirfd, pathname,
+                          flags);
         }
-        return -1;
+        return probe_return(openat_return, -1);
 }
 
 DIR PUBLIC *
 opendir(const char *name)
 {
+        DIR *ret;
+
+        fsmock_init();
+        probe(opendir_entry, name);
+
+        ret = do_call(DIR *, opendir, name);
+        if (ret)
+                forget_fd(libc_dirfd(ret));
+        return probe_return(opendir_return, ret);
+}
+
+/*
+ * Reads and writes on one of our devices go to its bio handle, which
+ * copies straight between the device and the caller's buffers.
+ */
+ssize_t PUBLIC
+pread(int fd, void *buf, size_t count, off_t offset)
+{
+        struct fd_state state;
+        ssize_t ret;
+
         fsmock_init();
+        probe(pread_entry, fd, buf, count, offset);
 
-        return do_call(DIR *, opendir, name);
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_pread);
+
+                ret = bio_pread(state.bfd, buf, count, offset);
+                call_done(pread, STATS_MOCKED, start, ret, fd, buf, count,
+                          offset);
+                return probe_return(pread_return, ret);
+        }
+        return probe_return(pread_return,
+                            do_call(ssize_t, pread, fd, buf, count, offset));
+}
+
+ssize_t PUBLIC
+preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+        struct fd_state state;
+        ssize_t ret;
+
+        fsmock_init();
+        probe(preadv_entry, fd, iov, iovcnt, offset);
+
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_preadv);
+
+                ret = bio_preadv(state.bfd, iov, iovcnt, offset);
+                call_done(preadv, STATS_MOCKED, start, ret, fd, iov, iovcnt,
+                          offset);
+                return probe_return(preadv_return, ret);
+        }
+        return probe_return(preadv_return,
+                            do_call(ssize_t, preadv, fd, iov, iovcnt, offset));
+}
+
+ssize_t PUBLIC
+preadv2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)
+{
+        struct fd_state state;
+        ssize_t ret;
+
+        fsmock_init();
+        probe(preadv2_entry, fd, iov, iovcnt, offset);
+
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_preadv2);
+
+                ret = bio_preadv2(state.bfd, iov, iovcnt, offset, flags);
+                call_done(preadv2, STATS_MOCKED, start, ret, fd, iov, iovcnt,
+                          offset, flags);
+                return probe_return(preadv2_return, ret);
+        }
+        return probe_return(preadv2_return,
+                            do_call(ssize_t, preadv2, fd, iov, iovcnt, offset,
+                                    flags));
+}
+
+ssize_t PUBLIC
+pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+        struct fd_state state;
+        ssize_t ret;
+
+        fsmock_init();
+        probe(pwrite_entry, fd, buf, count, offset);
+
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_pwrite);
+
+                ret = bio_pwrite(state.bfd, buf, count, offset);
+                call_done(pwrite, STATS_MOCKED, start, ret, fd, buf, count,
+                          offset);
+                return probe_return(pwrite_return, ret);
+        }
+        return probe_return(pwrite_return,
+                            do_call(ssize_t, pwrite, fd, buf, count, offset));
+}
+
+ssize_t PUBLIC
+pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+        struct fd_state state;
+        ssize_t ret;
+
+        fsmock_init();
+        probe(pwritev_entry, fd, iov, iovcnt, offset);
+
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_pwritev);
+
+                ret = bio_writev(state.bfd, iov, iovcnt, offset);
+                call_done(pwritev, STATS_MOCKED, start, ret, fd, iov, iovcnt,
+                          offset);
+                return probe_return(pwritev_return, ret);
+        }
+        return probe_return(pwritev_return,
+                            do_call(ssize_t, pwritev, fd, iov, iovcnt,
+                                    offset));
+}
+
+ssize_t PUBLIC
+pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)
+{
+        struct fd_state state;
+        ssize_t ret;
+
+        fsmock_init();
+        probe(pwritev2_entry, fd, iov, iovcnt, offset);
+
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_pwritev2);
+
+                ret = bio_writev2(state.bfd, iov, iovcnt, offset, flags);
+                call_done(pwritev2, STATS_MOCKED, start, ret, fd, iov, iovcnt,
+                          offset, flags);
+                return probe_return(pwritev2_return, ret);
+        }
+        return probe_return(pwritev2_return,
+                            do_call(ssize_t, pwritev2, fd, iov, iovcnt, offset,
+                                    flags));
+}
+
+ssize_t PUBLIC
+read(int fd, void *buf, size_t count)
+{
+        struct fd_state state;
+        ssize_t ret;
+
+        fsmock_init();
+        probe(read_entry, fd, buf, count);
+
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_read);
+
+                ret = bio_read(state.bfd, buf, count);
+                call_done(read, STATS_MOCKED, start, ret, fd, buf, count);
+                return probe_return(read_return, ret);
+        }
+        return probe_return(read_return,
+                            do_call(ssize_t, read, fd, buf, count));
 }
 
 struct dirent PUBLIC *
 readdir(DIR *dirp)
 {
         fsmock_init();
+        probe(readdir_entry, dirp);
 
-        return do_call(struct dirent *, readdir, dirp);
+        return probe_return(readdir_return,
+                            do_call(struct dirent *, readdir, dirp));
 }
 
 ssize_t PUBLIC
 readlink(const char *pathname, char *buf, size_t bufsiz)
 {
         fsmock_init();
+        probe(readlink_entry, pathname, buf, bufsiz);
 
-        return do_call(ssize_t, readlink, pathname, buf, bufsiz);
+        return probe_return(readlink_return,
+                            do_call(ssize_t, readlink, pathname, buf, bufsiz));
 }
 
 ssize_t PUBLIC
 readlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz)
 {
+        uint64_t start;
+
         fsmock_init();
+        probe(readlinkat_entry, dirfd, pathname, buf, bufsiz);
+        start = trace_start(CALL_readlinkat);
 
         errno = ENOSYS;
-        log_call("readlinkat", -1, dirfd, pathname, buf, bufsiz);
-        return -1;
+        call_done(readlinkat, STATS_MOCKED, start, -1, dirfd, pathname, buf,
+                  bufsiz);
+        return probe_return(readlinkat_return, -1);
+}
+
+ssize_t PUBLIC
+readv(int fd, const struct iovec *iov, int iovcnt)
+{
+        struct fd_state state;
+        ssize_t ret;
+
+        fsmock_init();
+        probe(readv_entry, fd, iov, iovcnt);
+
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_readv);
+
+                ret = bio_preadv2(state.bfd, iov, iovcnt, -1, 0);
+                call_done(readv, STATS_MOCKED, start, ret, fd, iov, iovcnt);
+                return probe_return(readv_return, ret);
+        }
+        return probe_return(readv_return,
+                            do_call(ssize_t, readv, fd, iov, iovcnt));
+}
+
+int PUBLIC
+socket(int domain, int type, int protocol)
+{
+        int ret;
+
+        fsmock_init();
+        probe(socket_entry, domain, type, protocol);
+
+        ret = do_call(int, socket, domain, type, protocol);
+        forget_fd(ret);
+        return probe_return(socket_return, ret);
 }
 
 int PUBLIC stat(const char *pathname, struct stat *statbuf)
 {
         fsmock_init();
+        probe(stat_entry, pathname, statbuf);
 
-        return do_call(int, stat, pathname, statbuf);
+        return probe_return(stat_return, do_call(int, stat, pathname, statbuf));
 }
 #pragma weak __xstat = stat
 
-static const char *
-fmt_open(va_list ap0)
+ssize_t PUBLIC
+write(int fd, const void *buf, size_t count)
 {
-        va_list ap1;
-        const char *creat = "\"%s\", 0x%0x, 0o%0o";
-        const char *no_creat = "\"%s\", 0x%0x";
+        struct fd_state state;
+        ssize_t ret;
 
-        int flags;
+        fsmock_init();
+        probe(write_entry, fd, buf, count);
 
-        va_copy(ap1, ap0);
-        va_arg(ap1, const char *);
-        flags = va_arg(ap1, int);
-        va_end(ap1);
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_write);
 
-        if (flags & O_CREAT)
-                return creat;
-        return no_creat;
+                ret = bio_write(state.bfd, buf, count);
+                call_done(write, STATS_MOCKED, start, ret, fd, buf, count);
+                return probe_return(write_return, ret);
+        }
+        return probe_return(write_return,
+                            do_call(ssize_t, write, fd, buf, count));
 }
 
-static const char *
-fmt_openat(va_list ap0)
+ssize_t PUBLIC
+writev(int fd, const struct iovec *iov, int iovcnt)
 {
-        va_list ap1;
-        const char *creat = "%d, \"%s\", 0x%0x, 0o%0o";
-        const char *no_creat = "%d, \"%s\", 0x%0x";
+        struct fd_state state;
+        ssize_t ret;
 
-        int flags;
+        fsmock_init();
+        probe(writev_entry, fd, iov, iovcnt);
 
-        va_copy(ap1, ap0);
-        va_arg(ap1, int);
-        va_arg(ap1, const char *);
-        flags = va_arg(ap1, int);
-        va_end(ap1);
+        if (fd_state_get(fd, &state) && state.bfd >= 0) {
+                uint64_t start = trace_start(CALL_writev);
 
-        if (flags & O_CREAT)
-                return creat;
-        return no_creat;
+                ret = bio_writev2(state.bfd, iov, iovcnt, -1, 0);
+                call_done(writev, STATS_MOCKED, start, ret, fd, iov, iovcnt);
+                return probe_return(writev_return, ret);
+        }
+        return probe_return(writev_return,
+                            do_call(ssize_t, writev, fd, iov, iovcnt));
 }
 
+/*
+ * The other names in calls.h.  off_t is already 64 bits, so the *64
+ * functions are just ours under another name.
+ */
+_Static_assert(sizeof(off_t) == sizeof(off64_t),
+               "the *64 variants assume a 64-bit off_t");
+
+extern __typeof__(lseek) lseek64 PUBLIC ALIAS(lseek);
+extern __typeof__(open) open64 PUBLIC ALIAS(open);
+extern __typeof__(openat) openat64 PUBLIC ALIAS(openat);
+extern __typeof__(pread) pread64 PUBLIC ALIAS(pread);
+extern __typeof__(preadv) preadv64 PUBLIC ALIAS(preadv);
+extern __typeof__(preadv2) preadv64v2 PUBLIC ALIAS(preadv2);
+extern __typeof__(pwrite) pwrite64 PUBLIC ALIAS(pwrite);
+extern __typeof__(pwritev) pwritev64 PUBLIC ALIAS(pwritev);
+extern __typeof__(pwritev2) pwritev64v2 PUBLIC ALIAS(pwritev2);
 
-enum ret_type { VOID, INT, SSIZE_T, OFF_T, FILEP, DIRP, DIRENTP };
-typedef const char *(*format_maker)(va_list ap);
-
-static void
-log_call(const char *name, ...)
-{
-        FILE *f = stdout;
-        struct call {
-                const char *name;
-                enum ret_type ret_type;
-                int nargs;
-                const char *fmt;
-                format_maker mkfmt;
-        } syscalls[] = {
-                {"access", INT, 2, "\"%s\", %d", },
-                {"close", INT, 1, "%d", },
-                {"closedir", INT, 1, "%p", },
-                {"dirfd", INT, 1, "%p", },
-                {"faccessat", INT, 4, "%d, \"%s\", 0o%0o, 0x%0x", },
-                {"fcntl", INT, 3, "%d, %s, 0x%" PRIxPTR, },
-                {"fdopen", FILEP, 2, "%d, \"%s\"", },
-                {"fileno", INT, 1, "%p", },
-                {"fopen", FILEP, 2, "\"%s\", \"%s\"", },
-                {"freopen", FILEP, 3, "\"%s\", \"%s\", %p", },
-                {"getxattr", SSIZE_T, 4, "\"%s\", \"%s\", %p, %zu", },
-                {"ioctl", INT, 3, "%d, %lu, 0x%" PRIxPTR, },
-                {"lseek", OFF_T, 3, "%d, %zd, 0x%0x", },
-                {"open", INT, 3, NULL, (format_maker)fmt_open, },
-                {"openat", INT, 4, NULL, (format_maker)fmt_openat, },
-                {"opendir", DIRP, 1, "\"%s\"", },
-                {"fdopendir", DIRP, 1, "%d", },
-                {"readdir", DIRENTP, 1, "%p", },
-                {"readlink", SSIZE_T, 3, "\"%s\", %p, %zu", },
-                {"readlinkat", SSIZE_T, 4, "%d, \"%s\", %p, %zu", },
-
-                {NULL, }
-        };
-        va_list ap;
-        int error = errno;
-
-        va_start(ap, name);
-
-        for (unsigned int i = 0; syscalls[i].name; i++) {
-                struct call *call = &syscalls[i];
-                va_list ap0;
-
-                bool is_error = false;
-                int d = 0;
-                ssize_t zd = 0;
-                void *p = NULL;
-
-                if (strcmp(name, call->name))
-                        continue;
-
-                fprintf(f, "%s(", name);
-                switch (call->ret_type) {
-                case VOID:
-                        break;
-                case INT:
-                        d = get_ap_arg(ap, int);
-                        break;
-                case SSIZE_T:
-                        zd = get_ap_arg(ap, ssize_t);
-                        break;
-                case OFF_T:
-                        zd = get_ap_arg(ap, off_t);
-                        break;
-                case FILEP:
-                case DIRP:
-                case DIRENTP:
-                        p = get_ap_arg(ap, void *);
-                        break;
-                default:
-                        assert(call->ret_type != call->ret_type);
-                        break;
-                }
-                va_copy(ap0, ap);
-                if (call->fmt) {
-                        vfprintf(f, call->fmt, ap0);
-                } else if (call->mkfmt) {
-                        const char *fmt = call->mkfmt(ap0);
-                        vfprintf(f, fmt, ap0);
-                }
-                va_end(ap0);
-
-                switch (call->ret_type) {
-                case VOID:
-                        fprintf(f, ")");
-                        break;
-                case INT:
-                        fprintf(f, ") = %d", d);
-                        is_error = d < 0;
-                        break;
-                case SSIZE_T:
-                case OFF_T:
-                        fprintf(f, ") = %zd", zd);
-                        is_error = zd < 0;
-                        break;
-                case FILEP:
-                case DIRP:
-                case DIRENTP:
-                        fprintf(f, ") = %p", p);
-                        is_error = p == NULL;
-                        break;
-                default:
-                        assert(call->ret_type != call->ret_type);
-                        break;
-                }
+/*
+ * What _FORTIFY_SOURCE turns calls into when it can check them.  These
+ * fail the same way libc's do, and otherwise are the plain call.
+ */
+extern void __chk_fail(void) NORETURN;
 
-                if (is_error)
-                        fprintf(f, " (%m)");
-                fprintf(f, "\n");
-                fflush(f);
+static inline void
+check_open_mode(int flags)
+{
+        if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+                fprintf(stderr, "*** invalid open call: O_CREAT or O_TMPFILE "
+                        "without mode ***: terminated\n");
+                abort();
         }
-        va_end(ap);
-        errno = error;
 }
 
+int PUBLIC
+__open_2(const char *pathname, int flags)
+{
+        check_open_mode(flags);
+        return open(pathname, flags);
+}
+extern __typeof__(__open_2) __open64_2 PUBLIC ALIAS(__open_2);
+
+int PUBLIC
+__openat_2(int dirfd, const char *pathname, int flags)
+{
+        check_open_mode(flags);
+        return openat(dirfd, pathname, flags);
+}
+extern __typeof__(__openat_2) __openat64_2 PUBLIC ALIAS(__openat_2);
+
+ssize_t PUBLIC
+__pread_chk(int fd, void *buf, size_t count, off_t offset, size_t buflen)
+{
+        if (count > buflen)
+                __chk_fail();
+        return pread(fd, buf, count, offset);
+}
+extern __typeof__(__pread_chk) __pread64_chk PUBLIC ALIAS(__pread_chk);
+
+ssize_t PUBLIC
+__read_chk(int fd, void *buf, size_t count, size_t buflen)
+{
+        if (count > buflen)
+                __chk_fail();
+        return read(fd, buf, count);
+}
 
 // vim:fenc=utf-8:tw=75
@@ -22,75 +22,62 @@
 #define FSMOCK_API_H_
 
 #include "fsmock.h"
+#include "calls.h"
 
 #include <dirent.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC     (1U << 2)
+#endif
+
 /*
  * These are the functions we publish to the world under an assumed name.
  * We have the redundant decls to make a build error occur if they're
  * incorrectly defined.
  */
 #pragma GCC diagnostic ignored "-Wredundant-decls"
-extern int access(const char *pathname, int mode) PUBLIC;
-extern int close(int fd) PUBLIC;
-extern int closedir(DIR *dirp) PUBLIC;
-extern int dirfd(DIR *dirp) PUBLIC;
-extern int faccessat(int dirfd, const char *pathname, int mode, int flags) PUBLIC;
-extern int fcntl(int fd, int cmd, ...) PUBLIC;
-extern FILE *fdopen(int fd, const char *mode) PUBLIC;
-extern DIR *fdopendir(int fd) PUBLIC;
-extern int fileno(FILE *stream) PUBLIC;
-extern FILE *fopen(const char *pathname, const char *mode) PUBLIC;
-extern FILE *freopen(const char *pathname, const char *mode, FILE *stream) PUBLIC;
-extern ssize_t getxattr(const char *path, const char *name, void *value, size_t size) PUBLIC;
-extern int ioctl(int fd, unsigned long request, ...) PUBLIC;
-extern off_t lseek(int fd, off_t offset, int whence) PUBLIC;
-extern int open(const char *pathname, int flags, ...) PUBLIC;
-extern int openat(int dirfd, const char *pathname, int flags, ...) PUBLIC;
-extern DIR *opendir(const char *name) PUBLIC;
-extern struct dirent *readdir(DIR *dirp) PUBLIC;
-extern ssize_t readlink(const char *pathname, char *buf, size_t bufsiz) PUBLIC;
-extern ssize_t readlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz) PUBLIC;
-extern int stat(const char *pathname, struct stat *statbuf) PUBLIC;
+#define FSMOCK_DECLARE(name, sym, ret_type, rtype, params, ...)         \
+        extern rtype name params PUBLIC;
+FSMOCK_CALLS(FSMOCK_DECLARE)
+#undef FSMOCK_DECLARE
 #pragma GCC diagnostic error "-Wredundant-decls"
 
 /*
  * Our constructor will set these up as the calls to libc's functions.
  */
-extern int PRIVATE (*libc_access)(const char *pathname, int mode);
-extern int PRIVATE (*libc_close)(int fd);
-extern int PRIVATE (*libc_closedir)(DIR *dirp);
-extern int PRIVATE (*libc_dirfd)(DIR *dirp);
-extern int PRIVATE (*libc_faccessat)(int dirfd, const char *pathname, int mode, int flags);
-extern int PRIVATE (*libc_fcntl)(int fd, int cmd, ...);
-extern FILE PRIVATE *(*libc_fdopen)(int fd, const char *mode);
-extern DIR PRIVATE *(*libc_fdopendir)(int fd);
-extern int PRIVATE (*libc_fileno)(FILE *stream);
-extern FILE PRIVATE *(*libc_fopen)(const char *pathname, const char *mode);
-extern FILE PRIVATE *(*libc_freopen)(const char *pathname, const char *mode, FILE *stream);
-extern ssize_t PRIVATE (*libc_getxattr)(const char *path, const char *name, void *value, size_t size);
-extern int PRIVATE (*libc_ioctl)(int fd, unsigned long request, ...);
-extern off_t PRIVATE (*libc_lseek)(int fd, off_t offset, int whence);
-extern int PRIVATE (*libc_open)(const char *pathname, int flags, ...);
-extern int PRIVATE (*libc_openat)(int dirfd, const char *pathname, int flags, ...);
-extern DIR PRIVATE *(*libc_opendir)(const char *name);
-extern struct PRIVATE dirent *(*libc_readdir)(DIR *dirp);
-extern ssize_t PRIVATE (*libc_readlink)(const char *pathname, char *buf, size_t bufsiz);
-extern ssize_t PRIVATE (*libc_readlinkat)(int dirfd, const char *pathname, char *buf, size_t bufsiz);
-extern int PRIVATE (*libc_stat)(const char *pathname, struct stat *statbuf);
+#define FSMOCK_DECLARE_LIBC(name, sym, ret_type, rtype, params, ...)    \
+        extern rtype (*libc_ ## name) params PRIVATE;
+FSMOCK_CALLS(FSMOCK_DECLARE_LIBC)
+#undef FSMOCK_DECLARE_LIBC
 
 /*
  * If we need other libc symbols, this is a dlhandle for our private copy of
- * libc
+ * libc, or RTLD_NEXT if we're using the one everybody else is.
  */
 extern void PRIVATE *libc;
 
+/*
+ * How calls we don't handle get passed on, from LIBFSMOCK_PASSTHROUGH:
+ * through a private copy of libc loaded with dlmopen() (the default),
+ * through the next libc in the search order, or straight to the kernel
+ * wherever libc's function is just a syscall.
+ */
+enum passthrough_mode {
+        PASSTHROUGH_DLMOPEN,
+        PASSTHROUGH_NEXT,
+        PASSTHROUGH_SYSCALL,
+};
+
+extern void PRIVATE passthrough_use_syscalls(void);
+extern void PRIVATE passthrough_fill_in(void);
+
 #endif /* !FSMOCK_API_H_ */
 // vim:fenc=utf-8:tw=75
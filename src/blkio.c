@@ -19,86 +19,1390 @@
 
 #include "fsmock.h"
 
+#include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
+
+/*
+ * The bfd table is a two level array so that lookups never have to take
+ * a lock: chunks are allocated on demand and never moved or freed.
+ */
+#define BIO_FILES_PER_CHUNK     256
+#define BIO_FILE_CHUNKS         256
+#define BIO_MAX_FILES           (BIO_FILES_PER_CHUNK * BIO_FILE_CHUNKS)
+
+/*
+ * How many freed handles wait on bio_files_retired for a grace period;
+ * closes are common enough that one each would serialize them.
+ */
+#define BIO_RETIRE_BATCH        64
+
+static struct bio_file **bio_files[BIO_FILE_CHUNKS];
+static pthread_mutex_t bio_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int bio_files_hint;
+static struct bio_file *bio_files_retired;
+static unsigned int bio_files_nretired;
+static pthread_once_t bio_files_once = PTHREAD_ONCE_INIT;
+
+/*
+ * A device only has queues if the config asks for them: "queues" or
+ * "queue-depth", either of which implies the other's default.  Without
+ * them, as many requests are serviced at once as there are threads
+ * submitting them.
+ */
+static int
+blkdev_queues_config(const char *name, uint64_t *nr_queues,
+                     uint64_t *depth)
+{
+        int has_queues, has_depth;
+
+        *nr_queues = 1;
+        *depth = BIO_DEFAULT_QUEUE_DEPTH;
+        has_queues = config_get_size(name, "queues", nr_queues);
+        has_depth = config_get_size(name, "queue-depth", depth);
+        if (has_queues < 0 || has_depth < 0)
+                return -1;
+        if (!has_queues && !has_depth) {
+                *nr_queues = 0;
+                return 0;
+        }
+        if (*nr_queues < 1 || *nr_queues > BIO_MAX_QUEUES ||
+            *depth < 1 || *depth > BIO_MAX_QUEUE_DEPTH) {
+                errno = EINVAL;
+                fsmock_error("[%s] invalid queues %"PRIu64" queue-depth %"PRIu64,
+                             name, *nr_queues, *depth);
+                return -1;
+        }
+        return 0;
+}
+
+static struct blkdev_queue *
+blkdev_queues_new(unsigned int nr_queues, unsigned int depth)
+{
+        struct blkdev_queue *queues;
+
+        queues = aligned_alloc(64, nr_queues * sizeof(*queues));
+        if (!queues)
+                return NULL;
+        for (unsigned int i = 0; i < nr_queues; i++) {
+                pthread_mutex_init(&queues[i].lock, NULL);
+                pthread_cond_init(&queues[i].wait, NULL);
+                queues[i].depth = depth;
+                queues[i].inflight = 0;
+                queues[i].waiters = 0;
+        }
+        return queues;
+}
+
+static void
+blkdev_queues_free(struct blkdev_queue *queues, unsigned int nr_queues)
+{
+        for (unsigned int i = 0; i < nr_queues; i++) {
+                pthread_mutex_destroy(&queues[i].lock);
+                pthread_cond_destroy(&queues[i].wait);
+        }
+        free(queues);
+}
+
+static inline bool
+blkdev_queue_tag(struct blkdev_queue *queue)
+{
+        unsigned int inflight = __atomic_load_n(&queue->inflight,
+                                                __ATOMIC_RELAXED);
+
+        while (inflight < queue->depth)
+                if (__atomic_compare_exchange_n(&queue->inflight, &inflight,
+                                                inflight + 1, true,
+                                                __ATOMIC_SEQ_CST,
+                                                __ATOMIC_RELAXED))
+                        return true;
+        return false;
+}
+
+/*
+ * Take a tag on this CPU's queue, waiting for one if they're all busy.
+ * A waiter counts itself before it looks again, and blkdev_queue_exit()
+ * puts its tag back before it checks for waiters, so one of them always
+ * sees the other.
+ */
+static struct blkdev_queue *
+blkdev_queue_enter(struct blkdev *dev)
+{
+        struct blkdev_queue *queue;
+        int cpu;
+
+        if (!dev->nr_queues)
+                return NULL;
+
+        cpu = sched_getcpu();
+        queue = &dev->queues[(cpu < 0 ? 0 : cpu) % dev->nr_queues];
+        if (blkdev_queue_tag(queue))
+                return queue;
+
+        pthread_mutex_lock(&queue->lock);
+        __atomic_add_fetch(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+        while (!blkdev_queue_tag(queue))
+                pthread_cond_wait(&queue->wait, &queue->lock);
+        __atomic_sub_fetch(&queue->waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&queue->lock);
+
+        return queue;
+}
+
+static void
+blkdev_queue_exit(struct blkdev_queue *queue)
+{
+        if (!queue)
+                return;
+
+        __atomic_sub_fetch(&queue->inflight, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&queue->waiters, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&queue->lock);
+                pthread_cond_signal(&queue->wait);
+                pthread_mutex_unlock(&queue->lock);
+        }
+}
+
+struct blkdev PRIVATE *
+blkdev_new(const char *name)
+{
+        struct blkdev *dev;
+        struct image *image = NULL;
+        const char *path;
+        uint64_t size = BIO_DEFAULT_SIZE;
+        uint64_t sector_size = BIO_DEFAULT_SECTOR_SIZE;
+        uint64_t nr_queues, depth;
+        pthread_rwlockattr_t attr;
+        bool read_only = false;
+        bool overlay = false;
+        int has_size;
+        int error;
+
+        has_size = config_get_size(name, "size", &size);
+        if (has_size < 0 ||
+            config_get_size(name, "sector-size", &sector_size) < 0 ||
+            config_get_bool(name, "read-only", &read_only) < 0 ||
+            blkdev_queues_config(name, &nr_queues, &depth) < 0)
+                return NULL;
+
+        path = config_get(name, "image");
+        if (config_get(name, "overlay")) {
+                if (path) {
+                        errno = EINVAL;
+                        fsmock_error("[%s] can't have both \"image\" and \"overlay\"",
+                                     name);
+                        return NULL;
+                }
+                path = config_get(name, "overlay");
+                overlay = true;
+        }
+        if (path) {
+                image = image_open(path, !read_only && !overlay);
+                if (!image)
+                        return NULL;
+                if (!has_size)
+                        size = image->size;
+                if (size > image->size && !overlay) {
+                        image_put(image);
+                        errno = EINVAL;
+                        fsmock_error("[%s] size %"PRIu64" is larger than \"%s\"",
+                                     name, size, path);
+                        return NULL;
+                }
+        }
+
+        if (sector_size < 512 || sector_size > SPARSE_BLOCK_SIZE ||
+            (sector_size & (sector_size - 1)) || size % sector_size) {
+                image_put(image);
+                errno = EINVAL;
+                fsmock_error("[%s] invalid geometry: size %"PRIu64" sector-size %"PRIu64,
+                             name, size, sector_size);
+                return NULL;
+        }
+
+        dev = calloc(1, sizeof(*dev));
+        if (!dev) {
+                image_put(image);
+                return NULL;
+        }
+
+        dev->size = size;
+        dev->sector_size = sector_size;
+        dev->read_only = read_only;
+        dev->image = image;
+        dev->overlay = overlay;
+        dev->refcnt = 1;
+        if (nr_queues) {
+                dev->queues = blkdev_queues_new(nr_queues, depth);
+                if (!dev->queues) {
+                        image_put(image);
+                        free(dev);
+                        return NULL;
+                }
+                dev->nr_queues = nr_queues;
+        }
+
+        /*
+         * Readers come and go constantly; don't let them keep a write
+         * that needs to allocate waiting forever.
+         */
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr,
+                        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&dev->lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        if (devmodel_new(name, size, &dev->model) < 0 ||
+            sparse_init(&dev->map, size) < 0) {
+                error = errno;
+                image_put(image);
+                pthread_rwlock_destroy(&dev->lock);
+                blkdev_queues_free(dev->queues, dev->nr_queues);
+                devmodel_free(dev->model);
+                free(dev);
+                errno = error;
+                return NULL;
+        }
+        dev->blktrace = blktrace_open(name);
+        dev->metrics = metrics_add_device(name);
+
+        return dev;
+}
+
+struct blkdev PRIVATE *
+blkdev_get(struct blkdev *dev)
+{
+        __atomic_add_fetch(&dev->refcnt, 1, __ATOMIC_RELAXED);
+        return dev;
+}
+
+void PRIVATE
+blkdev_put(struct blkdev *dev)
+{
+        if (!dev)
+                return;
+        if (__atomic_sub_fetch(&dev->refcnt, 1, __ATOMIC_ACQ_REL))
+                return;
+
+        blktrace_close(dev->blktrace);
+        sparse_fini(&dev->map);
+        image_put(dev->image);
+        pthread_rwlock_destroy(&dev->lock);
+        blkdev_queues_free(dev->queues, dev->nr_queues);
+        devmodel_free(dev->model);
+        free(dev);
+}
+
+static inline bool
+is_zero(const uint8_t *buf, size_t count)
+{
+        if (!count)
+                return true;
+        return buf[0] == 0 && !memcmp(buf, buf + 1, count - 1);
+}
+
+/*
+ * Where a request has got to in the caller's buffers.  A request is
+ * never longer than its iovecs, so nothing here checks for running off
+ * the end of them.
+ */
+struct iov_iter {
+        const struct iovec *iov;
+        size_t off;
+};
+
+/*
+ * How much of the current buffer is left, moving on past any that are
+ * used up or empty.  Only call this if there's more to do.
+ */
+static inline size_t
+iter_span(struct iov_iter *it)
+{
+        while (it->off == it->iov->iov_len) {
+                it->iov++;
+                it->off = 0;
+        }
+        return it->iov->iov_len - it->off;
+}
+
+static inline uint8_t *
+iter_ptr(struct iov_iter *it)
+{
+        return (uint8_t *)it->iov->iov_base + it->off;
+}
+
+/*
+ * Fill the next count bytes of the buffers from src, or with zeros if
+ * src is NULL.
+ */
+static inline void
+iter_copy_to(struct iov_iter *it, const uint8_t *src, size_t count)
+{
+        while (count) {
+                size_t len = iter_span(it);
+
+                if (len > count)
+                        len = count;
+                if (src) {
+                        memcpy(iter_ptr(it), src, len);
+                        src += len;
+                } else {
+                        memset(iter_ptr(it), 0, len);
+                }
+                it->off += len;
+                count -= len;
+        }
+}
+
+/*
+ * Copy the next count bytes of the buffers to dst, or just step over
+ * them if dst is NULL.
+ */
+static inline void
+iter_copy_from(struct iov_iter *it, uint8_t *dst, size_t count)
+{
+        while (count) {
+                size_t len = iter_span(it);
+
+                if (len > count)
+                        len = count;
+                if (dst) {
+                        memcpy(dst, iter_ptr(it), len);
+                        dst += len;
+                }
+                it->off += len;
+                count -= len;
+        }
+}
+
+/*
+ * Whether the next count bytes of the buffers are all zeros.  This
+ * looks ahead; it doesn't move the iterator.
+ */
+static inline bool
+iter_is_zero(struct iov_iter it, size_t count)
+{
+        while (count) {
+                size_t len = iter_span(&it);
+
+                if (len > count)
+                        len = count;
+                if (!is_zero(iter_ptr(&it), len))
+                        return false;
+                it.off += len;
+                count -= len;
+        }
+        return true;
+}
+
+/*
+ * Copy from an overlay's base image; anything past the end of the image
+ * reads as zeros.
+ */
+static inline void
+base_read(struct blkdev *dev, uint8_t *dst, size_t count, uint64_t offset)
+{
+        size_t len = 0;
+
+        if (dev->image && offset < dev->image->size) {
+                len = dev->image->size - offset;
+                if (len > count)
+                        len = count;
+                memcpy(dst, dev->image->data + offset, len);
+        }
+        memset(dst + len, 0, count - len);
+}
+
+static inline void
+base_read_iter(struct blkdev *dev, struct iov_iter *it, size_t count,
+               uint64_t offset)
+{
+        size_t len = 0;
+
+        if (dev->image && offset < dev->image->size) {
+                len = dev->image->size - offset;
+                if (len > count)
+                        len = count;
+                iter_copy_to(it, dev->image->data + offset, len);
+        }
+        iter_copy_to(it, NULL, count - len);
+}
+
+/*
+ * Clamp a request to the end of the device.  Returns how many bytes of
+ * it can be serviced.
+ */
+static inline size_t
+blkdev_clamp(struct blkdev *dev, size_t count, uint64_t offset)
+{
+        if (offset >= dev->size)
+                return 0;
+        if (count > dev->size - offset)
+                count = dev->size - offset;
+        return count;
+}
+
+/*
+ * A request walks the map a leaf at a time, so each SPARSE_LEAF_SIZE
+ * stretch of the device costs one lookup however many blocks and
+ * buffers it's split across, and a stretch that's never been written is
+ * one fill.
+ */
+static ssize_t
+dev_read(struct blkdev *dev, struct iov_iter *it, size_t count,
+         uint64_t offset)
+{
+        struct sparse_node *leaf = NULL;
+        uint64_t leafno = UINT64_MAX;
+        size_t left;
+
+        count = blkdev_clamp(dev, count, offset);
+        if (count > SSIZE_MAX)
+                count = SSIZE_MAX;
+
+        /*
+         * Image files are served straight out of the mapping; the only
+         * copy is the one into the caller's buffer.  Overlays that haven't
+         * been written to yet are, too.
+         */
+        if (dev->image && !dev->overlay) {
+                blktrace_event(dev->blktrace, BLK_TA_ISSUE | BLKTRACE_READ,
+                               offset, count, 0);
+                iter_copy_to(it, dev->image->data + offset, count);
+                return count;
+        }
+
+        pthread_rwlock_rdlock(&dev->lock);
+        blktrace_event(dev->blktrace, BLK_TA_ISSUE | BLKTRACE_READ,
+                       offset, count, 0);
+        if (dev->overlay && !dev->map.allocated) {
+                base_read_iter(dev, it, count, offset);
+                pthread_rwlock_unlock(&dev->lock);
+                return count;
+        }
+        for (left = count; left; ) {
+                uint64_t blkno = offset >> SPARSE_BLOCK_SHIFT;
+                uint8_t *block = NULL;
+                size_t len;
+
+                if (offset >> SPARSE_LEAF_SHIFT != leafno) {
+                        leafno = offset >> SPARSE_LEAF_SHIFT;
+                        leaf = sparse_lookup_leaf(&dev->map, blkno);
+                }
+                if (leaf) {
+                        block = sparse_leaf_block(leaf, blkno);
+                        len = SPARSE_BLOCK_SIZE -
+                              (offset & (SPARSE_BLOCK_SIZE - 1));
+                } else {
+                        len = SPARSE_LEAF_SIZE -
+                              (offset & (SPARSE_LEAF_SIZE - 1));
+                }
+                if (len > left)
+                        len = left;
+
+                if (block)
+                        iter_copy_to(it, block +
+                                         (offset & (SPARSE_BLOCK_SIZE - 1)),
+                                     len);
+                else
+                        base_read_iter(dev, it, len, offset);
+
+                offset += len;
+                left -= len;
+        }
+        pthread_rwlock_unlock(&dev->lock);
+
+        return count;
+}
+
+/*
+ * Whether a write can go entirely into blocks the device already has,
+ * without allocating or copying anything.  Call with dev->lock held; a
+ * write can only make more blocks writable, so the answer stays true
+ * until the lock is dropped.
+ */
+static bool
+dev_write_in_place(struct blkdev *dev, struct iov_iter it, size_t count,
+                   uint64_t offset)
+{
+        while (count) {
+                uint64_t blkno = offset >> SPARSE_BLOCK_SHIFT;
+                size_t len = SPARSE_BLOCK_SIZE -
+                             (offset & (SPARSE_BLOCK_SIZE - 1));
+
+                if (len > count)
+                        len = count;
+                if (!sparse_lookup_writable(&dev->map, blkno) &&
+                    (dev->overlay || sparse_lookup(&dev->map, blkno) ||
+                     !iter_is_zero(it, len)))
+                        return false;
+
+                iter_copy_from(&it, NULL, len);
+                offset += len;
+                count -= len;
+        }
+        return true;
+}
+
+/*
+ * Writes share the lock with everything else, unless they'd have to
+ * allocate or copy a block, in which case they take it for themselves
+ * before they write anything, so a checkpoint or rollback never sees
+ * half of one.  A write that spans blocks checks all of them first; one
+ * within a single block finds out when it looks its block up.  Most
+ * writes to a device that's in use land in blocks it already has, so
+ * they never need to.
+ */
+static ssize_t
+dev_write(struct blkdev *dev, struct iov_iter *it, size_t count,
+          uint64_t offset)
+{
+        bool exclusive = false;
+        size_t left;
+
+        if (dev->read_only) {
+                errno = EROFS;
+                return -1;
+        }
+        if (count && offset >= dev->size) {
+                errno = ENOSPC;
+                return -1;
+        }
+        count = blkdev_clamp(dev, count, offset);
+        if (count > SSIZE_MAX)
+                count = SSIZE_MAX;
+
+        if (dev->image && !dev->overlay) {
+                blktrace_event(dev->blktrace, BLK_TA_ISSUE | BLKTRACE_WRITE,
+                               offset, count, 0);
+                iter_copy_from(it, dev->image->data + offset, count);
+                return count;
+        }
+
+        pthread_rwlock_rdlock(&dev->lock);
+        if (count > SPARSE_BLOCK_SIZE - (offset & (SPARSE_BLOCK_SIZE - 1)) &&
+            !dev_write_in_place(dev, *it, count, offset)) {
+                pthread_rwlock_unlock(&dev->lock);
+                pthread_rwlock_wrlock(&dev->lock);
+                exclusive = true;
+        }
+        blktrace_event(dev->blktrace, BLK_TA_ISSUE | BLKTRACE_WRITE,
+                       offset, count, 0);
+        for (left = count; left; ) {
+                uint64_t blkno = offset >> SPARSE_BLOCK_SHIFT;
+                size_t boff = offset & (SPARSE_BLOCK_SIZE - 1);
+                size_t len = SPARSE_BLOCK_SIZE - boff;
+                uint8_t *block;
+                bool created = false;
+
+                if (len > left)
+                        len = left;
+
+                /*
+                 * Writing zeros into a hole doesn't change what it reads
+                 * back as, so don't allocate for it.
+                 */
+                if (!dev->overlay && iter_is_zero(*it, len) &&
+                    !sparse_lookup(&dev->map, blkno)) {
+                        iter_copy_from(it, NULL, len);
+                        goto next;
+                }
+
+                if (exclusive) {
+                        block = sparse_insert(&dev->map, blkno, &created);
+                } else {
+                        block = sparse_lookup_writable(&dev->map, blkno);
+                        /*
+                         * Only a write within one block gets here, and it
+                         * hasn't written anything yet.
+                         */
+                        if (!block) {
+                                pthread_rwlock_unlock(&dev->lock);
+                                pthread_rwlock_wrlock(&dev->lock);
+                                exclusive = true;
+                                continue;
+                        }
+                }
+                if (!block) {
+                        int error = errno;
+
+                        pthread_rwlock_unlock(&dev->lock);
+                        if (count != left)
+                                return count - left;
+                        errno = error;
+                        return -1;
+                }
+                /*
+                 * An overlay's delta starts out as a copy of the base,
+                 * unless we're about to replace all of it.
+                 */
+                if (created && dev->overlay && len < SPARSE_BLOCK_SIZE)
+                        base_read(dev, block, SPARSE_BLOCK_SIZE,
+                                  blkno << SPARSE_BLOCK_SHIFT);
+                iter_copy_from(it, block + boff, len);
+next:
+                offset += len;
+                left -= len;
+        }
+        pthread_rwlock_unlock(&dev->lock);
+
+        return count;
+}
+
+/*
+ * Queue, service and complete one request.  However many buffers it's
+ * spread across, the blktrace log and the device's counters see it as
+ * a single I/O.  The submitting thread services it itself once it has
+ * a tag, so time spent waiting for one shows up between Q and D.  If the
+ * device has a model, the request isn't completed, and its tag stays
+ * taken, until the model says it would be done.
+ */
+static ssize_t
+blkdev_rw(struct blkdev *dev, bool write, struct iov_iter *it, size_t count,
+          uint64_t offset)
+{
+        uint32_t rw = write ? BLKTRACE_WRITE : BLKTRACE_READ;
+        struct blkdev_queue *queue;
+        uint64_t start = 0;
+        ssize_t ret;
+
+        blktrace_event(dev->blktrace, BLK_TA_QUEUE | rw, offset, count, 0);
+        queue = blkdev_queue_enter(dev);
+        if (dev->model)
+                start = trace_clock();
+        if (write)
+                ret = dev_write(dev, it, count, offset);
+        else
+                ret = dev_read(dev, it, count, offset);
+        if (dev->model && ret > 0)
+                devmodel_wait(devmodel_service(dev->model, start, offset,
+                                               ret));
+        blktrace_event(dev->blktrace, BLK_TA_COMPLETE | rw,
+                       offset, ret < 0 ? count : (size_t)ret,
+                       ret < 0 ? errno : 0);
+        blkdev_queue_exit(queue);
+        metrics_io(dev->metrics, write, ret);
+        return ret;
+}
+
+ssize_t PRIVATE
+blkdev_read(struct blkdev *dev, void *buf, size_t count, uint64_t offset)
+{
+        uint64_t start = trace_start(CALL_blkdev_read);
+        struct iovec iov = { buf, count };
+        struct iov_iter it = { &iov, 0 };
+        ssize_t ret;
+
+        ret = blkdev_rw(dev, false, &it, count, offset);
+        stats_add(CALL_blkdev_read, STATS_MOCKED, start, ret < 0);
+        trace_call(blkdev_read, start, ret, dev, buf, count, offset);
+        return ret;
+}
+
+ssize_t PRIVATE
+blkdev_write(struct blkdev *dev, const void *buf, size_t count, uint64_t offset)
+{
+        uint64_t start = trace_start(CALL_blkdev_write);
+        struct iovec iov = { (void *)buf, count };
+        struct iov_iter it = { &iov, 0 };
+        ssize_t ret;
+
+        ret = blkdev_rw(dev, true, &it, count, offset);
+        stats_add(CALL_blkdev_write, STATS_MOCKED, start, ret < 0);
+        trace_call(blkdev_write, start, ret, dev, buf, count, offset);
+        return ret;
+}
+
+static inline size_t
+iov_length(const struct iovec *iov, int iovcnt)
+{
+        size_t count = 0;
+
+        for (int i = 0; i < iovcnt; i++)
+                count += iov[i].iov_len;
+        return count;
+}
+
+/*
+ * Scatter/gather versions.  The caller has to have checked that the
+ * iovecs add up to no more than SSIZE_MAX.
+ */
+ssize_t PRIVATE
+blkdev_readv(struct blkdev *dev, const struct iovec *iov, int iovcnt,
+             uint64_t offset)
+{
+        uint64_t start = trace_start(CALL_blkdev_readv);
+        struct iov_iter it = { iov, 0 };
+        ssize_t ret;
+
+        ret = blkdev_rw(dev, false, &it, iov_length(iov, iovcnt), offset);
+        stats_add(CALL_blkdev_readv, STATS_MOCKED, start, ret < 0);
+        trace_call(blkdev_readv, start, ret, dev, iov, iovcnt, offset);
+        return ret;
+}
+
+ssize_t PRIVATE
+blkdev_writev(struct blkdev *dev, const struct iovec *iov, int iovcnt,
+              uint64_t offset)
+{
+        uint64_t start = trace_start(CALL_blkdev_writev);
+        struct iov_iter it = { iov, 0 };
+        ssize_t ret;
+
+        ret = blkdev_rw(dev, true, &it, iov_length(iov, iovcnt), offset);
+        stats_add(CALL_blkdev_writev, STATS_MOCKED, start, ret < 0);
+        trace_call(blkdev_writev, start, ret, dev, iov, iovcnt, offset);
+        return ret;
+}
+
+/*
+ * Checkpoints only make sense for devices whose contents we own; a plain
+ * image device writes straight through to its file.
+ */
+static inline bool
+blkdev_can_checkpoint(struct blkdev *dev)
+{
+        if (dev->image && !dev->overlay) {
+                errno = EOPNOTSUPP;
+                return false;
+        }
+        return true;
+}
+
+int PRIVATE
+blkdev_checkpoint(struct blkdev *dev)
+{
+        int ret;
+
+        if (!blkdev_can_checkpoint(dev))
+                return -1;
+
+        pthread_rwlock_wrlock(&dev->lock);
+        ret = sparse_snapshot(&dev->map);
+        pthread_rwlock_unlock(&dev->lock);
+
+        return ret;
+}
+
+int PRIVATE
+blkdev_rollback(struct blkdev *dev, int checkpoint)
+{
+        int ret;
+
+        if (!blkdev_can_checkpoint(dev))
+                return -1;
+
+        pthread_rwlock_wrlock(&dev->lock);
+        ret = sparse_rollback(&dev->map, checkpoint);
+        pthread_rwlock_unlock(&dev->lock);
+
+        return ret;
+}
+
+int PRIVATE
+blkdev_release(struct blkdev *dev, int checkpoint)
+{
+        int ret;
+
+        if (!blkdev_can_checkpoint(dev))
+                return -1;
+
+        pthread_rwlock_wrlock(&dev->lock);
+        ret = sparse_release(&dev->map, checkpoint);
+        pthread_rwlock_unlock(&dev->lock);
+
+        return ret;
+}
+
+/*
+ * Look bfd up and take a reference on it, which the caller drops with
+ * bio_file_put().  The table's own reference keeps a file alive while
+ * it's in its slot; after bio_close() takes it out, a lookup that found
+ * it just before can still be on its way to taking a reference, so its
+ * memory isn't freed until a grace period after the last put.
+ */
+struct bio_file PRIVATE *
+bio_file_get(int bfd)
+{
+        struct bio_file **chunk;
+        struct bio_file *file = NULL;
+
+        if (bfd >= 0 && bfd < BIO_MAX_FILES) {
+                rcu_read_lock();
+                chunk = __atomic_load_n(&bio_files[bfd / BIO_FILES_PER_CHUNK],
+                                        __ATOMIC_ACQUIRE);
+                if (chunk)
+                        file = rcu_dereference(chunk[bfd % BIO_FILES_PER_CHUNK]);
+                if (file) {
+                        int refcnt = __atomic_load_n(&file->refcnt,
+                                                     __ATOMIC_RELAXED);
+
+                        do {
+                                if (!refcnt) {
+                                        file = NULL;
+                                        break;
+                                }
+                        } while (!__atomic_compare_exchange_n(&file->refcnt,
+                                                              &refcnt,
+                                                              refcnt + 1, true,
+                                                              __ATOMIC_ACQUIRE,
+                                                              __ATOMIC_RELAXED));
+                }
+                rcu_read_unlock();
+        }
+        if (!file)
+                errno = EBADF;
+        return file;
+}
+
+/*
+ * For a file that never made it into the table.
+ */
+static void
+bio_file_free(struct bio_file *file)
+{
+        blkdev_put(file->dev);
+        pthread_mutex_destroy(&file->lock);
+        free(file);
+}
+
+void PRIVATE
+bio_file_put(struct bio_file *file)
+{
+        struct bio_file *retired = NULL;
+        int error;
+
+        if (__atomic_sub_fetch(&file->refcnt, 1, __ATOMIC_ACQ_REL))
+                return;
+
+        /*
+         * A lookup racing with us only looks at refcnt, so the device
+         * can go now; the memory waits for a grace period, along with
+         * enough others to be worth one.
+         */
+        blkdev_put(file->dev);
+        pthread_mutex_destroy(&file->lock);
+
+        pthread_mutex_lock(&bio_files_lock);
+        file->retired = bio_files_retired;
+        bio_files_retired = file;
+        if (++bio_files_nretired >= BIO_RETIRE_BATCH) {
+                retired = bio_files_retired;
+                bio_files_retired = NULL;
+                bio_files_nretired = 0;
+        }
+        pthread_mutex_unlock(&bio_files_lock);
+
+        if (!retired)
+                return;
+
+        error = errno;
+        synchronize_rcu();
+        while (retired) {
+                file = retired;
+                retired = file->retired;
+                free(file);
+        }
+        errno = error;
+}
+
+/*
+ * Only the thread that forked survives, so nobody's holding the table's
+ * lock or any file's any more, whatever they were doing when we forked.
+ */
+static void
+bio_files_child(void)
+{
+        pthread_mutex_init(&bio_files_lock, NULL);
+        for (unsigned int c = 0; c < BIO_FILE_CHUNKS; c++) {
+                if (!bio_files[c])
+                        continue;
+                for (unsigned int i = 0; i < BIO_FILES_PER_CHUNK; i++)
+                        if (bio_files[c][i])
+                                pthread_mutex_init(&bio_files[c][i]->lock,
+                                                   NULL);
+        }
+}
+
+static void
+bio_files_setup(void)
+{
+        pthread_atfork(NULL, NULL, bio_files_child);
+}
+
+static int
+bio_file_install(struct bio_file *file)
+{
+        int error = EMFILE;
+        int ret = -1;
+
+        pthread_once(&bio_files_once, bio_files_setup);
+        pthread_mutex_lock(&bio_files_lock);
+        for (unsigned int n = 0; n < BIO_MAX_FILES; n++) {
+                unsigned int bfd = (bio_files_hint + n) % BIO_MAX_FILES;
+                struct bio_file ***chunkp = &bio_files[bfd / BIO_FILES_PER_CHUNK];
+                struct bio_file **chunk = *chunkp;
+
+                if (!chunk) {
+                        chunk = calloc(BIO_FILES_PER_CHUNK, sizeof(*chunk));
+                        if (!chunk) {
+                                error = ENOMEM;
+                                break;
+                        }
+                        __atomic_store_n(chunkp, chunk, __ATOMIC_RELEASE);
+                }
+                if (chunk[bfd % BIO_FILES_PER_CHUNK])
+                        continue;
+
+                rcu_assign_pointer(chunk[bfd % BIO_FILES_PER_CHUNK], file);
+                bio_files_hint = bfd + 1;
+                ret = bfd;
+                break;
+        }
+        pthread_mutex_unlock(&bio_files_lock);
+
+        if (ret < 0)
+                errno = error;
+        return ret;
+}
+
+/*
+ * Take file out of slot bfd, if it's still there, and drop the table's
+ * reference on it.
+ */
+static void
+bio_file_uninstall(int bfd, struct bio_file *file)
+{
+        struct bio_file **slot;
+        bool removed = false;
+
+        pthread_mutex_lock(&bio_files_lock);
+        slot = &bio_files[bfd / BIO_FILES_PER_CHUNK][bfd % BIO_FILES_PER_CHUNK];
+        if (*slot == file) {
+                rcu_assign_pointer(*slot, NULL);
+                if ((unsigned int)bfd < bio_files_hint)
+                        bio_files_hint = bfd;
+                removed = true;
+        }
+        pthread_mutex_unlock(&bio_files_lock);
+
+        if (removed)
+                bio_file_put(file);
+}
+
 int
-bio_open(const char *path UNUSED, int flags UNUSED)
+bio_open(uint64_t handle, int flags)
+{
+        struct bio_file *file;
+        struct mount *mount;
+        struct blkdev *dev = NULL;
+        int bfd;
+        int error;
+
+        probe(bio_open_entry, handle, flags);
+        rcu_read_lock();
+        mount = get_mount_by_handle(handle);
+        if (mount && mount->dev)
+                dev = blkdev_get(mount->dev);
+        rcu_read_unlock();
+
+        if (!mount) {
+                errno = ENOENT;
+                return probe_return(bio_open_return, -1);
+        }
+        if (!dev) {
+                errno = ENXIO;
+                return probe_return(bio_open_return, -1);
+        }
+        if (dev->read_only && (flags & O_ACCMODE) != O_RDONLY) {
+                blkdev_put(dev);
+                errno = EROFS;
+                return probe_return(bio_open_return, -1);
+        }
+
+        file = calloc(1, sizeof(*file));
+        if (!file) {
+                blkdev_put(dev);
+                return probe_return(bio_open_return, -1);
+        }
+        file->dev = dev;
+        file->mount = handle;
+        file->flags = flags;
+        file->refcnt = 1;
+        file->opens = 1;
+        pthread_mutex_init(&file->lock, NULL);
+
+        bfd = bio_file_install(file);
+        if (bfd < 0) {
+                error = errno;
+                bio_file_free(file);
+                errno = error;
+        }
+        return probe_return(bio_open_return, bfd);
+}
+
+/*
+ * Drop one open of bfd.  The handle goes away with the last one; anybody
+ * still in the middle of using it keeps the file itself alive until
+ * they're done.
+ */
+int bio_close(int bfd)
 {
-        errno = ENOSYS;
-        return -1;
+        struct bio_file *file;
+        int opens;
+
+        probe(bio_close_entry, bfd);
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_close_return, -1);
+
+        opens = __atomic_load_n(&file->opens, __ATOMIC_RELAXED);
+        do {
+                if (!opens) {
+                        bio_file_put(file);
+                        errno = EBADF;
+                        return probe_return(bio_close_return, -1);
+                }
+        } while (!__atomic_compare_exchange_n(&file->opens, &opens, opens - 1,
+                                              true, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_RELAXED));
+        if (opens == 1)
+                bio_file_uninstall(bfd, file);
+
+        bio_file_put(file);
+        return probe_return(bio_close_return, 0);
 }
 
-int bio_close(int bfd UNUSED)
+/*
+ * Another fd is using bfd, the way dup() shares an open file between
+ * fds: it has the same offset, and stays open until both are closed.
+ */
+int
+bio_dup(int bfd)
 {
-        errno = ENOSYS;
-        return -1;
+        struct bio_file *file;
+        int opens;
+
+        file = bio_file_get(bfd);
+        if (!file)
+                return -1;
+
+        opens = __atomic_load_n(&file->opens, __ATOMIC_RELAXED);
+        do {
+                if (!opens) {
+                        bio_file_put(file);
+                        errno = EBADF;
+                        return -1;
+                }
+        } while (!__atomic_compare_exchange_n(&file->opens, &opens, opens + 1,
+                                              true, __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+
+        bio_file_put(file);
+        return 0;
 }
 
 off_t
-bio_lseek(int bfd UNUSED, off_t offset UNUSED, int whence UNUSED)
+bio_lseek(int bfd, off_t offset, int whence)
+{
+        struct bio_file *file;
+        off_t base;
+
+        probe(bio_lseek_entry, bfd, offset, whence);
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_lseek_return, -1);
+
+        pthread_mutex_lock(&file->lock);
+        switch (whence) {
+        case SEEK_SET:
+                base = 0;
+                break;
+        case SEEK_CUR:
+                base = file->offset;
+                break;
+        case SEEK_END:
+                base = file->dev->size;
+                break;
+        default:
+                errno = EINVAL;
+                base = -1;
+                goto out;
+        }
+
+        if (__builtin_add_overflow(base, offset, &base) || base < 0 ||
+            (uint64_t)base > file->dev->size) {
+                errno = EINVAL;
+                base = -1;
+                goto out;
+        }
+        file->offset = base;
+out:
+        pthread_mutex_unlock(&file->lock);
+        bio_file_put(file);
+
+        return probe_return(bio_lseek_return, base);
+}
+
+static inline bool
+bio_can_read(struct bio_file *file)
 {
-        errno = ENOSYS;
-        return -1;
+        if ((file->flags & O_ACCMODE) == O_WRONLY) {
+                errno = EBADF;
+                return false;
+        }
+        return true;
+}
+
+static inline bool
+bio_can_write(struct bio_file *file)
+{
+        if ((file->flags & O_ACCMODE) == O_RDONLY) {
+                errno = EBADF;
+                return false;
+        }
+        return true;
+}
+
+static inline bool
+offset_valid(off_t offset)
+{
+        if (offset < 0) {
+                errno = EINVAL;
+                return false;
+        }
+        return true;
 }
 
 ssize_t
-bio_read(int bfd UNUSED, void *buf UNUSED, size_t count UNUSED)
+bio_read(int bfd, void *buf, size_t count)
 {
-        errno = ENOSYS;
-        return -1;
+        struct bio_file *file;
+        ssize_t ret = -1;
+
+        probe(bio_read_entry, bfd, buf, count);
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_read_return, -1);
+
+        if (bio_can_read(file)) {
+                pthread_mutex_lock(&file->lock);
+                ret = blkdev_read(file->dev, buf, count, file->offset);
+                if (ret > 0)
+                        file->offset += ret;
+                pthread_mutex_unlock(&file->lock);
+        }
+        bio_file_put(file);
+
+        return probe_return(bio_read_return, ret);
 }
 
 ssize_t
-bio_write(int bfd UNUSED, const void *buf UNUSED, size_t count UNUSED)
+bio_write(int bfd, const void *buf, size_t count)
+{
+        struct bio_file *file;
+        ssize_t ret = -1;
+
+        probe(bio_write_entry, bfd, buf, count);
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_write_return, -1);
+
+        if (bio_can_write(file)) {
+                pthread_mutex_lock(&file->lock);
+                ret = blkdev_write(file->dev, buf, count, file->offset);
+                if (ret > 0)
+                        file->offset += ret;
+                pthread_mutex_unlock(&file->lock);
+        }
+        bio_file_put(file);
+
+        return probe_return(bio_write_return, ret);
+}
+
+/*
+ * The positional calls on a file the caller already has a reference on.
+ */
+ssize_t PRIVATE
+bio_file_pread(struct bio_file *file, void *buf, size_t count, off_t offset)
+{
+        if (!bio_can_read(file) || !offset_valid(offset))
+                return -1;
+        return blkdev_read(file->dev, buf, count, offset);
+}
+
+ssize_t PRIVATE
+bio_file_pwrite(struct bio_file *file, const void *buf, size_t count,
+                off_t offset)
 {
-        errno = ENOSYS;
-        return -1;
+        if (!bio_can_write(file) || !offset_valid(offset))
+                return -1;
+        return blkdev_write(file->dev, buf, count, offset);
 }
 
 ssize_t
-bio_pread(int bfd UNUSED, void *buf UNUSED,
-          size_t count UNUSED, off_t offset UNUSED)
+bio_pread(int bfd, void *buf, size_t count, off_t offset)
 {
-        errno = ENOSYS;
-        return -1;
+        struct bio_file *file;
+        ssize_t ret;
+
+        probe(bio_pread_entry, bfd, buf, count, offset);
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_pread_return, -1);
+
+        ret = bio_file_pread(file, buf, count, offset);
+        bio_file_put(file);
+
+        return probe_return(bio_pread_return, ret);
 }
 
 ssize_t
-bio_pwrite(int bfd UNUSED, const void *buf UNUSED,
-           size_t count UNUSED, off_t offset UNUSED)
+bio_pwrite(int bfd, const void *buf, size_t count, off_t offset)
+{
+        struct bio_file *file;
+        ssize_t ret;
+
+        probe(bio_pwrite_entry, bfd, buf, count, offset);
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_pwrite_return, -1);
+
+        ret = bio_file_pwrite(file, buf, count, offset);
+        bio_file_put(file);
+
+        return probe_return(bio_pwrite_return, ret);
+}
+
+static inline bool
+iov_valid(const struct iovec *iov, int iovcnt)
+{
+        size_t total = 0;
+
+        if (iovcnt < 0 || iovcnt > IOV_MAX)
+                goto err;
+        for (int i = 0; i < iovcnt; i++) {
+                if (iov[i].iov_len > SSIZE_MAX - total)
+                        goto err;
+                total += iov[i].iov_len;
+        }
+        return true;
+err:
+        errno = EINVAL;
+        return false;
+}
+
+ssize_t PRIVATE
+bio_file_preadv(struct bio_file *file, const struct iovec *iov, int iovcnt,
+                off_t offset)
 {
-        errno = ENOSYS;
-        return -1;
+        if (!bio_can_read(file) || !iov_valid(iov, iovcnt) ||
+            !offset_valid(offset))
+                return -1;
+        return blkdev_readv(file->dev, iov, iovcnt, offset);
+}
+
+ssize_t PRIVATE
+bio_file_writev(struct bio_file *file, const struct iovec *iov, int iovcnt,
+                off_t offset)
+{
+        if (!bio_can_write(file) || !iov_valid(iov, iovcnt) ||
+            !offset_valid(offset))
+                return -1;
+        return blkdev_writev(file->dev, iov, iovcnt, offset);
 }
 
 ssize_t
-bio_preadv(int bfd UNUSED, const struct iovec *iov UNUSED,
-           int iovcnt UNUSED, off_t offset UNUSED)
+bio_preadv(int bfd, const struct iovec *iov, int iovcnt, off_t offset)
 {
-        errno = ENOSYS;
-        return -1;
+        struct bio_file *file;
+        ssize_t ret;
+
+        probe(bio_preadv_entry, bfd, iov, iovcnt, offset);
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_preadv_return, -1);
+
+        ret = bio_file_preadv(file, iov, iovcnt, offset);
+        bio_file_put(file);
+
+        return probe_return(bio_preadv_return, ret);
 }
 
 ssize_t
-bio_writev(int bfd UNUSED, const struct iovec *iov UNUSED,
-           int iovcnt UNUSED, off_t offset UNUSED)
+bio_writev(int bfd, const struct iovec *iov, int iovcnt, off_t offset)
 {
-        errno = ENOSYS;
-        return -1;
+        struct bio_file *file;
+        ssize_t ret;
+
+        probe(bio_writev_entry, bfd, iov, iovcnt, offset);
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_writev_return, -1);
+
+        ret = bio_file_writev(file, iov, iovcnt, offset);
+        bio_file_put(file);
+
+        return probe_return(bio_writev_return, ret);
 }
 
+/*
+ * As with preadv2(2), an offset of -1 means "use and update the file
+ * offset".  None of the RWF_* flags change anything for us.
+ */
 ssize_t
-bio_preadv2(int bfd UNUSED, const struct iovec *iov UNUSED,
-            int iovcnt UNUSED, off_t offset UNUSED, int flags UNUSED)
+bio_preadv2(int bfd, const struct iovec *iov, int iovcnt, off_t offset,
+            int flags UNUSED)
 {
-        errno = ENOSYS;
-        return -1;
+        struct bio_file *file;
+        ssize_t ret = -1;
+
+        probe(bio_preadv2_entry, bfd, iov, iovcnt, offset);
+        if (offset != -1)
+                return probe_return(bio_preadv2_return,
+                                    bio_preadv(bfd, iov, iovcnt, offset));
+
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_preadv2_return, -1);
+
+        if (bio_can_read(file) && iov_valid(iov, iovcnt)) {
+                pthread_mutex_lock(&file->lock);
+                ret = blkdev_readv(file->dev, iov, iovcnt, file->offset);
+                if (ret > 0)
+                        file->offset += ret;
+                pthread_mutex_unlock(&file->lock);
+        }
+        bio_file_put(file);
+
+        return probe_return(bio_preadv2_return, ret);
 }
 
 ssize_t
-bio_writev2(int bfd UNUSED, const struct iovec *iov UNUSED,
-            int iovcnt UNUSED, off_t offset UNUSED, int flags UNUSED)
+bio_writev2(int bfd, const struct iovec *iov, int iovcnt, off_t offset,
+            int flags UNUSED)
 {
-        errno = ENOSYS;
-        return -1;
+        struct bio_file *file;
+        ssize_t ret = -1;
+
+        probe(bio_writev2_entry, bfd, iov, iovcnt, offset);
+        if (offset != -1)
+                return probe_return(bio_writev2_return,
+                                    bio_writev(bfd, iov, iovcnt, offset));
+
+        file = bio_file_get(bfd);
+        if (!file)
+                return probe_return(bio_writev2_return, -1);
+
+        if (bio_can_write(file) && iov_valid(iov, iovcnt)) {
+                pthread_mutex_lock(&file->lock);
+                ret = blkdev_writev(file->dev, iov, iovcnt, file->offset);
+                if (ret > 0)
+                        file->offset += ret;
+                pthread_mutex_unlock(&file->lock);
+        }
+        bio_file_put(file);
+
+        return probe_return(bio_writev2_return, ret);
 }
 
 // vim:fenc=utf-8:tw=75:et
@@ -20,8 +20,116 @@
 #ifndef FSMOCK_BLKIO_H_
 #define FSMOCK_BLKIO_H_
 
-extern int bio_open(const char *path, int flags);
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define BIO_DEFAULT_SIZE        (1ULL << 40)
+#define BIO_DEFAULT_SECTOR_SIZE 512
+#define BIO_DEFAULT_QUEUE_DEPTH 64
+#define BIO_MAX_QUEUES          1024
+#define BIO_MAX_QUEUE_DEPTH     65536
+
+/*
+ * One of a device's hardware queues.  It has depth tags; a request
+ * takes one for as long as the device is servicing it, and waits here
+ * if they're all in use.  Taking and putting back a tag are atomic;
+ * the lock is only for sleeping on.  Each queue is on its own cache
+ * line, so submitters on different CPUs don't fight over them.
+ */
+struct blkdev_queue {
+        unsigned int depth;
+        unsigned int inflight;
+        unsigned int waiters;
+        pthread_mutex_t lock;
+        pthread_cond_t wait;
+} __attribute__((__aligned__(64)));
+
+/*
+ * A simulated block device.  Unless it's backed by an image file, its
+ * contents live in a sparse map, so only blocks which have actually been
+ * written cost any memory; everything else reads back as zeros.
+ *
+ * An overlay has both: the image is a read-only base shared with
+ * everything else using it, and the map holds this device's private
+ * delta of written blocks.
+ *
+ * The lock is shared by everything that only reads the map, which
+ * includes writes to blocks this epoch already owns; allocating,
+ * copying and checkpoints take it exclusively.  If the device has
+ * queues, requests are spread across them by the CPU they're submitted
+ * on, like blk-mq.
+ */
+struct blkdev {
+        uint64_t size;
+        unsigned int sector_size;
+        bool read_only;
+        int refcnt;
+        pthread_rwlock_t lock;
+        struct sparse_map map;
+        struct image *image;
+        bool overlay;
+        struct blktrace *blktrace;
+        int metrics;
+        unsigned int nr_queues;
+        struct blkdev_queue *queues;
+        struct devmodel *model;
+};
+
+/*
+ * An open handle on a blkdev; "bfd" is an index into a table of these.
+ * opens counts the fds using it, and the handle stays in the table
+ * until the last of them is closed.  refcnt is the table's reference
+ * plus one for everybody using the file right now, and it's released
+ * when that goes to zero; then it waits on a list, through retired, for
+ * a grace period before it's freed.
+ */
+struct bio_file {
+        struct blkdev *dev;
+        uint64_t mount;
+        int flags;
+        off_t offset;
+        int refcnt;
+        int opens;
+        pthread_mutex_t lock;
+        struct bio_file *retired;
+};
+
+extern struct blkdev PRIVATE *blkdev_new(const char *name);
+extern struct blkdev PRIVATE *blkdev_get(struct blkdev *dev);
+extern void PRIVATE blkdev_put(struct blkdev *dev);
+extern ssize_t PRIVATE blkdev_read(struct blkdev *dev, void *buf,
+                                   size_t count, uint64_t offset);
+extern ssize_t PRIVATE blkdev_write(struct blkdev *dev, const void *buf,
+                                    size_t count, uint64_t offset);
+extern ssize_t PRIVATE blkdev_readv(struct blkdev *dev, const struct iovec *iov,
+                                    int iovcnt, uint64_t offset);
+extern ssize_t PRIVATE blkdev_writev(struct blkdev *dev,
+                                     const struct iovec *iov, int iovcnt,
+                                     uint64_t offset);
+extern int PRIVATE blkdev_checkpoint(struct blkdev *dev);
+extern int PRIVATE blkdev_rollback(struct blkdev *dev, int checkpoint);
+extern int PRIVATE blkdev_release(struct blkdev *dev, int checkpoint);
+
+extern struct bio_file PRIVATE *bio_file_get(int bfd);
+extern void PRIVATE bio_file_put(struct bio_file *file);
+extern ssize_t PRIVATE bio_file_pread(struct bio_file *file, void *buf,
+                                      size_t count, off_t offset);
+extern ssize_t PRIVATE bio_file_pwrite(struct bio_file *file,
+                                       const void *buf, size_t count,
+                                       off_t offset);
+extern ssize_t PRIVATE bio_file_preadv(struct bio_file *file,
+                                       const struct iovec *iov, int iovcnt,
+                                       off_t offset);
+extern ssize_t PRIVATE bio_file_writev(struct bio_file *file,
+                                       const struct iovec *iov, int iovcnt,
+                                       off_t offset);
+
+extern int bio_open(uint64_t mount, int flags);
 extern int bio_close(int bfd);
+extern int bio_dup(int bfd);
 extern off_t bio_lseek(int bfd, off_t offset, int whence);
 extern ssize_t bio_read(int bfd, void *buf, size_t count);
 extern ssize_t bio_write(int bfd, const void *buf, size_t count);
@@ -0,0 +1,243 @@
+/*
+ * blktrace.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <limits.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#define BLKTRACE_BUF_SIZE       32768
+#define BLKTRACE_COMM_LEN       16
+
+struct blktrace {
+        struct list_head list;
+        pthread_mutex_t lock;
+        int fd;
+        unsigned int id;
+        uint32_t device;
+        uint32_t sequence;
+        size_t used;
+        char buf[BLKTRACE_BUF_SIZE];
+};
+
+static LIST_HEAD(blktraces);
+static pthread_mutex_t blktraces_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t blktrace_once = PTHREAD_ONCE_INIT;
+static unsigned int blktrace_ids;
+
+/*
+ * blkparse learns which program a pid belongs to from a BLK_TN_PROCESS
+ * note, so each thread writes one to each device the first time it
+ * touches it.  This is a bit per device id; past 64 devices some threads
+ * will just go unnamed.
+ */
+static __thread uint64_t blktrace_named;
+static __thread pid_t blktrace_tid;
+
+static void
+blktrace_write(struct blktrace *bt)
+{
+        size_t off = 0;
+
+        while (off < bt->used) {
+                ssize_t rc = syscall(SYS_write, bt->fd, bt->buf + off,
+                                     bt->used - off);
+                if (rc < 0 && errno == EINTR)
+                        continue;
+                if (rc <= 0)
+                        break;
+                off += rc;
+        }
+        bt->used = 0;
+}
+
+static void
+blktrace_child(void)
+{
+        struct list_head *this;
+
+        /*
+         * The parent writes out whatever it had buffered; we start over,
+         * and we're a new pid that hasn't been named anywhere.
+         */
+        list_for_each(this, &blktraces) {
+                struct blktrace *bt;
+
+                bt = list_entry(this, struct blktrace, list);
+                pthread_mutex_init(&bt->lock, NULL);
+                bt->used = 0;
+        }
+        pthread_mutex_init(&blktraces_lock, NULL);
+        blktrace_named = 0;
+        blktrace_tid = 0;
+}
+
+static void
+blktrace_setup(void)
+{
+        pthread_atfork(NULL, NULL, blktrace_child);
+}
+
+struct blktrace PRIVATE *
+blktrace_open(const char *name)
+{
+        const char *dir = getenv("LIBFSMOCK_BLKTRACE");
+        const char *base;
+        struct blktrace *bt;
+        char path[PATH_MAX];
+        int rc;
+
+        if (!dir || !dir[0])
+                return NULL;
+
+        pthread_once(&blktrace_once, blktrace_setup);
+
+        bt = calloc(1, sizeof(*bt));
+        if (!bt)
+                return NULL;
+        bt->id = __atomic_fetch_add(&blktrace_ids, 1, __ATOMIC_RELAXED);
+        bt->device = (BLKTRACE_MAJOR << BLKTRACE_MINORBITS) | bt->id;
+
+        base = strrchr(name, '/');
+        base = base ? base + 1 : name;
+        if (base[0])
+                rc = snprintf(path, sizeof(path), "%s/%s.blktrace.0",
+                              dir, base);
+        else
+                rc = snprintf(path, sizeof(path), "%s/fsmock%u.blktrace.0",
+                              dir, bt->id);
+        if (rc < 0 || (size_t)rc >= sizeof(path)) {
+                free(bt);
+                return NULL;
+        }
+
+        /*
+         * Like LIBFSMOCK_TRACE, this is appended to, since every process
+         * we're preloaded into will be writing its part.
+         */
+        bt->fd = syscall(SYS_openat, AT_FDCWD, path,
+                         O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+        if (bt->fd < 0) {
+                free(bt);
+                return NULL;
+        }
+        pthread_mutex_init(&bt->lock, NULL);
+
+        pthread_mutex_lock(&blktraces_lock);
+        list_add_tail(&bt->list, &blktraces);
+        pthread_mutex_unlock(&blktraces_lock);
+
+        return bt;
+}
+
+void PRIVATE
+blktrace_close(struct blktrace *bt)
+{
+        if (!bt)
+                return;
+
+        pthread_mutex_lock(&blktraces_lock);
+        list_del(&bt->list);
+        pthread_mutex_unlock(&blktraces_lock);
+
+        blktrace_write(bt);
+        syscall(SYS_close, bt->fd);
+        pthread_mutex_destroy(&bt->lock);
+        free(bt);
+}
+
+static void
+blktrace_put(struct blktrace *bt, const struct blk_io_trace *t,
+             const void *pdu)
+{
+        if (bt->used + sizeof(*t) + t->pdu_len > sizeof(bt->buf))
+                blktrace_write(bt);
+        memcpy(bt->buf + bt->used, t, sizeof(*t));
+        if (t->pdu_len)
+                memcpy(bt->buf + bt->used + sizeof(*t), pdu, t->pdu_len);
+        bt->used += sizeof(*t) + t->pdu_len;
+}
+
+/*
+ * Log one event.  offset and bytes are in bytes; blktrace's sectors are
+ * always 512 bytes, whatever the device's own sector size is.
+ */
+void PRIVATE
+blktrace_add(struct blktrace *bt, uint32_t action, uint64_t offset,
+             uint64_t bytes, int error)
+{
+        uint64_t bit = 1ULL << (bt->id & 63);
+        struct blk_io_trace t = {
+                .magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION,
+                .time = trace_clock(),
+                .sector = offset >> 9,
+                .bytes = bytes > UINT32_MAX ? UINT32_MAX : bytes,
+                .action = action,
+                .device = bt->device,
+                .error = error,
+        };
+        int saved_errno = errno;
+
+        if (!blktrace_tid)
+                blktrace_tid = syscall(SYS_gettid);
+        t.pid = blktrace_tid;
+
+        pthread_mutex_lock(&bt->lock);
+        if (!(blktrace_named & bit)) {
+                struct blk_io_trace note = {
+                        .magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION,
+                        .sequence = bt->sequence++,
+                        .time = t.time,
+                        .action = BLK_TN_PROCESS,
+                        .pid = t.pid,
+                        .device = bt->device,
+                        .pdu_len = BLKTRACE_COMM_LEN,
+                };
+                char comm[BLKTRACE_COMM_LEN + 1] = "";
+
+                prctl(PR_GET_NAME, comm);
+                blktrace_put(bt, &note, comm);
+                blktrace_named |= bit;
+        }
+        t.sequence = bt->sequence++;
+        blktrace_put(bt, &t, NULL);
+        pthread_mutex_unlock(&bt->lock);
+
+        errno = saved_errno;
+}
+
+static void DESTRUCTOR
+blktrace_fini(void)
+{
+        struct list_head *this;
+
+        pthread_mutex_lock(&blktraces_lock);
+        list_for_each(this, &blktraces) {
+                struct blktrace *bt;
+
+                bt = list_entry(this, struct blktrace, list);
+                pthread_mutex_lock(&bt->lock);
+                blktrace_write(bt);
+                pthread_mutex_unlock(&bt->lock);
+        }
+        pthread_mutex_unlock(&blktraces_lock);
+}
+
+// vim:fenc=utf-8:tw=75:et
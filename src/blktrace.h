@@ -0,0 +1,97 @@
+/*
+ * blktrace.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_BLKTRACE_H_
+#define FSMOCK_BLKTRACE_H_
+
+#include <stdint.h>
+
+/*
+ * If LIBFSMOCK_BLKTRACE names a directory, each simulated device logs
+ * what happens to its requests there, in the same format the kernel's
+ * blktrace uses, so blkparse(1) and btt(1) can read it.  Every request
+ * is queued (Q) when it reaches the device, issued (D) when the device
+ * starts servicing it, and completed (C) when it's done.
+ *
+ * Events are the kernel's struct blk_io_trace, in native byte order,
+ * which is what blkparse expects to find in <name>.blktrace.<cpu>.  We
+ * only write the "cpu 0" file.
+ */
+#define BLK_IO_TRACE_MAGIC      0x65617400
+#define BLK_IO_TRACE_VERSION    0x07
+
+#define BLK_TC_READ             (1 << 0)
+#define BLK_TC_WRITE            (1 << 1)
+#define BLK_TC_QUEUE            (1 << 4)
+#define BLK_TC_ISSUE            (1 << 6)
+#define BLK_TC_COMPLETE         (1 << 7)
+#define BLK_TC_NOTIFY           (1 << 10)
+
+#define BLK_TC_SHIFT            16
+#define BLK_TC_ACT(act)         ((act) << BLK_TC_SHIFT)
+
+#define BLK_TA_QUEUE            (1 | BLK_TC_ACT(BLK_TC_QUEUE))
+#define BLK_TA_ISSUE            (7 | BLK_TC_ACT(BLK_TC_ISSUE))
+#define BLK_TA_COMPLETE         (8 | BLK_TC_ACT(BLK_TC_COMPLETE))
+#define BLK_TN_PROCESS          (0 | BLK_TC_ACT(BLK_TC_NOTIFY))
+
+#define BLKTRACE_READ           BLK_TC_ACT(BLK_TC_READ)
+#define BLKTRACE_WRITE          BLK_TC_ACT(BLK_TC_WRITE)
+
+/*
+ * Devices get numbers from 240, which is set aside for local use, so
+ * they can't be mistaken for a real disk in blkparse's output.
+ */
+#define BLKTRACE_MAJOR          240
+#define BLKTRACE_MINORBITS      20
+
+struct blk_io_trace {
+        uint32_t magic;
+        uint32_t sequence;
+        uint64_t time;
+        uint64_t sector;
+        uint32_t bytes;
+        uint32_t action;
+        uint32_t pid;
+        uint32_t device;
+        uint32_t cpu;
+        uint16_t error;
+        uint16_t pdu_len;
+};
+
+struct blktrace;
+
+extern struct blktrace PRIVATE *blktrace_open(const char *name);
+extern void PRIVATE blktrace_close(struct blktrace *bt);
+extern void PRIVATE blktrace_add(struct blktrace *bt, uint32_t action,
+                                 uint64_t offset, uint64_t bytes, int error);
+
+/*
+ * When blktrace is off, a device's bt is NULL, and this is all it costs.
+ */
+static inline void
+blktrace_event(struct blktrace *bt, uint32_t action, uint64_t offset,
+               uint64_t bytes, int error)
+{
+        if (__builtin_expect(bt != NULL, 0))
+                blktrace_add(bt, action, offset, bytes, error);
+}
+
+#endif /* !FSMOCK_BLKTRACE_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,221 @@
+/*
+ * calls.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef FSMOCK_CALLS_H_
+#define FSMOCK_CALLS_H_
+
+/*
+ * Every libc function we interpose on, in one place.  The declarations
+ * in api.h, the libc_* pointers and the code that resolves them, the
+ * symbol versions in libfsmock.map, and the trace metadata are all
+ * generated from this, so adding a function means adding a line here
+ * and writing the wrapper.
+ *
+ * Each entry is:
+ *
+ *   X(name, libc symbol, ret_type, return type, (parameters),
+ *     trace format, trace format function, trace subject)
+ *
+ * The subject says which argument names the file the call operates on,
+ * which is what the trace mount filter looks at; see trace.h.
+ *
+ * The lists are split up by symbol version, since that's how the map
+ * file needs them.  This file has to stay plain preprocessor macros; the
+ * map file is run through cpp with it.
+ */
+#define FSMOCK_CALLS_GLIBC_2_2_5(X)                                           \
+        X(access, access, INT, int,                                           \
+          (const char *pathname, int mode),                                   \
+          "\"%s\", %d", NULL, TRACE_PATH(0))                                  \
+        X(close, close, INT, int,                                             \
+          (int fd),                                                           \
+          "%d", NULL, TRACE_CLOSE(0))                                         \
+        X(closedir, closedir, INT, int,                                       \
+          (DIR *dirp),                                                        \
+          "%p", NULL, TRACE_NONE)                                             \
+        X(dirfd, dirfd, INT, int,                                             \
+          (DIR *dirp),                                                        \
+          "%p", NULL, TRACE_NONE)                                             \
+        X(dup, dup, INT, int,                                                 \
+          (int oldfd),                                                        \
+          "%d", NULL, TRACE_DUP(0))                                           \
+        X(dup2, dup2, INT, int,                                               \
+          (int oldfd, int newfd),                                             \
+          "%d, %d", NULL, TRACE_DUP(0))                                       \
+        X(fclose, fclose, INT, int,                                           \
+          (FILE *stream),                                                     \
+          "%p", NULL, TRACE_NONE)                                             \
+        X(fcntl, fcntl, INT, int,                                             \
+          (int fd, int cmd, ...),                                             \
+          "%d, %s, 0x%lx", NULL, TRACE_FD(0))                                 \
+        X(fdopen, fdopen, FILEP, FILE *,                                      \
+          (int fd, const char *mode),                                         \
+          "%d, \"%s\"", NULL, TRACE_FD(0))                                    \
+        X(fileno, fileno, INT, int,                                           \
+          (FILE *stream),                                                     \
+          "%p", NULL, TRACE_NONE)                                             \
+        X(fopen, fopen, FILEP, FILE *,                                        \
+          (const char *pathname, const char *mode),                           \
+          "\"%s\", \"%s\"", NULL, TRACE_PATH(0))                              \
+        X(freopen, freopen, FILEP, FILE *,                                    \
+          (const char *pathname, const char *mode, FILE *stream),             \
+          "\"%s\", \"%s\", %p", NULL, TRACE_PATH(0))                          \
+        X(ioctl, ioctl, INT, int,                                             \
+          (int fd, unsigned long request, ...),                               \
+          "%d, %lu, 0x%lx", NULL, TRACE_FD(0))                                \
+        X(lseek, lseek, OFF_T, off_t,                                         \
+          (int fd, off_t offset, int whence),                                 \
+          "%d, %ld, 0x%0x", NULL, TRACE_FD(0))                                \
+        X(open, open, INT, int,                                               \
+          (const char *pathname, int flags, ...),                             \
+          NULL, fmt_open, TRACE_OPEN(0))                                      \
+        X(opendir, opendir, DIRP, DIR *,                                      \
+          (const char *name),                                                 \
+          "\"%s\"", NULL, TRACE_PATH(0))                                      \
+        X(pread, pread, SSIZE_T, ssize_t,                                     \
+          (int fd, void *buf, size_t count, off_t offset),                    \
+          "%d, %p, %zu, %ld", NULL, TRACE_FD(0))                              \
+        X(pwrite, pwrite, SSIZE_T, ssize_t,                                   \
+          (int fd, const void *buf, size_t count, off_t offset),              \
+          "%d, %p, %zu, %ld", NULL, TRACE_FD(0))                              \
+        X(read, read, SSIZE_T, ssize_t,                                       \
+          (int fd, void *buf, size_t count),                                  \
+          "%d, %p, %zu", NULL, TRACE_FD(0))                                   \
+        X(readdir, readdir, DIRENTP, struct dirent *,                         \
+          (DIR *dirp),                                                        \
+          "%p", NULL, TRACE_NONE)                                             \
+        X(readlink, readlink, SSIZE_T, ssize_t,                               \
+          (const char *pathname, char *buf, size_t bufsiz),                   \
+          "\"%s\", %p, %zu", NULL, TRACE_PATH(0))                             \
+        X(readv, readv, SSIZE_T, ssize_t,                                     \
+          (int fd, const struct iovec *iov, int iovcnt),                      \
+          "%d, %p, %d", NULL, TRACE_FD(0))                                    \
+        X(socket, socket, INT, int,                                           \
+          (int domain, int type, int protocol),                               \
+          "%d, %d, %d", NULL, TRACE_NONE)                                     \
+        X(stat, __xstat, INT, int,                                            \
+          (const char *pathname, struct stat *statbuf),                       \
+          "\"%s\", %p", NULL, TRACE_PATH(0))                                  \
+        X(write, write, SSIZE_T, ssize_t,                                     \
+          (int fd, const void *buf, size_t count),                            \
+          "%d, %p, %zu", NULL, TRACE_FD(0))                                   \
+        X(writev, writev, SSIZE_T, ssize_t,                                   \
+          (int fd, const struct iovec *iov, int iovcnt),                      \
+          "%d, %p, %d", NULL, TRACE_FD(0))
+
+#define FSMOCK_CALLS_GLIBC_2_3(X)                                             \
+        X(getxattr, getxattr, SSIZE_T, ssize_t,                               \
+          (const char *path, const char *name, void *value, size_t size),     \
+          "\"%s\", \"%s\", %p, %zu", NULL, TRACE_PATH(0))
+
+#define FSMOCK_CALLS_GLIBC_2_4(X)                                             \
+        X(faccessat, faccessat, INT, int,                                     \
+          (int dirfd, const char *pathname, int mode, int flags),             \
+          "%d, \"%s\", 0o%0o, 0x%0x", NULL, TRACE_PATH(1))                    \
+        X(fdopendir, fdopendir, DIRP, DIR *,                                  \
+          (int fd),                                                           \
+          "%d", NULL, TRACE_FD(0))                                            \
+        X(openat, openat, INT, int,                                           \
+          (int dirfd, const char *pathname, int flags, ...),                  \
+          NULL, fmt_openat, TRACE_OPEN(1))                                    \
+        X(readlinkat, readlinkat, SSIZE_T, ssize_t,                           \
+          (int dirfd, const char *pathname, char *buf, size_t bufsiz),        \
+          "%d, \"%s\", %p, %zu", NULL, TRACE_PATH(1))
+
+#define FSMOCK_CALLS_GLIBC_2_9(X)                                             \
+        X(dup3, dup3, INT, int,                                               \
+          (int oldfd, int newfd, int flags),                                  \
+          "%d, %d, 0x%x", NULL, TRACE_DUP(0))
+
+#define FSMOCK_CALLS_GLIBC_2_10(X)                                            \
+        X(preadv, preadv, SSIZE_T, ssize_t,                                   \
+          (int fd, const struct iovec *iov, int iovcnt, off_t offset),        \
+          "%d, %p, %d, %ld", NULL, TRACE_FD(0))                               \
+        X(pwritev, pwritev, SSIZE_T, ssize_t,                                 \
+          (int fd, const struct iovec *iov, int iovcnt, off_t offset),        \
+          "%d, %p, %d, %ld", NULL, TRACE_FD(0))
+
+#define FSMOCK_CALLS_GLIBC_2_26(X)                                            \
+        X(preadv2, preadv2, SSIZE_T, ssize_t,                                 \
+          (int fd, const struct iovec *iov, int iovcnt, off_t offset,         \
+           int flags),                                                        \
+          "%d, %p, %d, %ld, 0x%x", NULL, TRACE_FD(0))                         \
+        X(pwritev2, pwritev2, SSIZE_T, ssize_t,                               \
+          (int fd, const struct iovec *iov, int iovcnt, off_t offset,         \
+           int flags),                                                        \
+          "%d, %p, %d, %ld, 0x%x", NULL, TRACE_FD(0))
+
+/*
+ * close_range() is newer than some of the libcs we run with, so it's
+ * looked up if it's there, and called with syscall() if it isn't.
+ */
+#define FSMOCK_CALLS_GLIBC_2_34(X)                                            \
+        X(close_range, close_range, INT, int,                                 \
+          (unsigned int first, unsigned int last, int flags),                 \
+          "%u, %u, 0x%x", NULL, TRACE_NONE)
+
+#define FSMOCK_CALLS(X)                                                       \
+        FSMOCK_CALLS_GLIBC_2_2_5(X)                                           \
+        FSMOCK_CALLS_GLIBC_2_3(X)                                             \
+        FSMOCK_CALLS_GLIBC_2_4(X)                                             \
+        FSMOCK_CALLS_GLIBC_2_9(X)                                             \
+        FSMOCK_CALLS_GLIBC_2_10(X)                                            \
+        FSMOCK_CALLS_GLIBC_2_26(X)                                            \
+        FSMOCK_CALLS_GLIBC_2_34(X)
+
+/*
+ * Other names programs reach the calls above by, which we have to
+ * export too or they'd go straight to libc.  The *64 functions are the
+ * same function as their plain counterparts on LP64, so they're aliases
+ * of ours, and get counted and traced under the plain name.  The __*_2
+ * and __*_chk ones are what _FORTIFY_SOURCE turns calls into; ours do
+ * the same checks and then call the plain one.
+ *
+ * Each entry is:
+ *
+ *   X(name, the call it ends up as)
+ */
+#define FSMOCK_VARIANTS_GLIBC_2_2_5(X)                                        \
+        X(lseek64, lseek)                                                     \
+        X(open64, open)                                                       \
+        X(pread64, pread)                                                     \
+        X(pwrite64, pwrite)
+
+#define FSMOCK_VARIANTS_GLIBC_2_4(X)                                          \
+        X(__pread_chk, pread)                                                 \
+        X(__pread64_chk, pread)                                               \
+        X(__read_chk, read)                                                   \
+        X(openat64, openat)
+
+#define FSMOCK_VARIANTS_GLIBC_2_7(X)                                          \
+        X(__open_2, open)                                                     \
+        X(__open64_2, open)                                                   \
+        X(__openat_2, openat)                                                 \
+        X(__openat64_2, openat)
+
+#define FSMOCK_VARIANTS_GLIBC_2_10(X)                                         \
+        X(preadv64, preadv)                                                   \
+        X(pwritev64, pwritev)
+
+#define FSMOCK_VARIANTS_GLIBC_2_26(X)                                         \
+        X(preadv64v2, preadv2)                                                \
+        X(pwritev64v2, pwritev2)
+
+#endif /* !FSMOCK_CALLS_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,383 @@
+/*
+ * config.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <ctype.h>
+
+LIST_HEAD(config_sections);
+
+static bool config_loading;
+static bool config_loaded;
+
+/*
+ * Recursive, because mounting what the config file describes calls
+ * config_load() again from the same thread; config_loading stops that
+ * from going any further.
+ */
+static pthread_mutex_t config_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static char *
+trim(char *s)
+{
+        char *end;
+
+        while (isspace(*s))
+                s++;
+        end = s + strlen(s);
+        while (end > s && isspace(end[-1]))
+                *--end = '\0';
+        return s;
+}
+
+static struct config_section *
+new_section(const char *name)
+{
+        struct config_section *section;
+
+        section = calloc(1, sizeof(*section));
+        if (!section)
+                return NULL;
+
+        section->name = strdup(name);
+        if (!section->name) {
+                free(section);
+                return NULL;
+        }
+        INIT_LIST_HEAD(&section->entries);
+        list_add_tail(&section->list, &config_sections);
+
+        return section;
+}
+
+static int
+new_entry(struct config_section *section, const char *key, const char *value)
+{
+        struct config_entry *entry;
+
+        entry = calloc(1, sizeof(*entry));
+        if (!entry)
+                return -1;
+
+        entry->key = strdup(key);
+        entry->value = strdup(value);
+        if (!entry->key || !entry->value) {
+                free(entry->key);
+                free(entry->value);
+                free(entry);
+                return -1;
+        }
+        list_add_tail(&entry->list, &section->entries);
+
+        return 0;
+}
+
+static int
+parse_config(char *buf, const char *path)
+{
+        struct config_section *section = NULL;
+        char *saveptr = NULL;
+        char *line;
+        int lineno = 0;
+
+        for (line = strtok_r(buf, "\n", &saveptr); line;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                char *key, *value, *eq;
+
+                lineno += 1;
+                line = trim(line);
+                if (line[0] == '\0' || line[0] == '#' || line[0] == ';')
+                        continue;
+
+                if (line[0] == '[') {
+                        char *end = strchr(line, ']');
+
+                        if (!end) {
+                                errno = EINVAL;
+                                fsmock_error("%s:%d: bad section header",
+                                             path, lineno);
+                                return -1;
+                        }
+                        *end = '\0';
+                        section = new_section(trim(line + 1));
+                        if (!section)
+                                return -1;
+                        continue;
+                }
+
+                eq = strchr(line, '=');
+                if (!eq || !section) {
+                        errno = EINVAL;
+                        fsmock_error("%s:%d: expected \"key = value\" in a section",
+                                     path, lineno);
+                        return -1;
+                }
+                *eq = '\0';
+                key = trim(line);
+                value = trim(eq + 1);
+                if (new_entry(section, key, value) < 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+static int
+load_config(void)
+{
+        struct config_section *section;
+        struct list_head *this;
+        const char *path;
+        uint8_t *buf = NULL;
+        ssize_t rc;
+
+        path = getenv("LIBFSMOCK_CONFIG");
+        if (!path || !path[0])
+                return 0;
+
+        rc = get_file(&buf, "%s", path);
+        if (rc < 0)
+                return -1;
+
+        rc = parse_config((char *)buf, path);
+        free(buf);
+        if (rc < 0)
+                return -1;
+
+        config_for_each_section(section, this) {
+                if (section->name[0] != '/')
+                        continue;
+                if (fsmock_mount(section->name, NULL) < 0) {
+                        fsmock_error("could not mount \"%s\"", section->name);
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Read LIBFSMOCK_CONFIG (if it's set) and mount everything it describes.
+ * This is safe to call more than once, from any thread; only the first
+ * call does anything, and the others wait for it to finish.
+ */
+int PRIVATE
+config_load(void)
+{
+        int rc = 0;
+
+        if (__atomic_load_n(&config_loaded, __ATOMIC_ACQUIRE))
+                return 0;
+
+        pthread_mutex_lock(&config_lock);
+        if (!config_loading) {
+                config_loading = true;
+                rc = load_config();
+                if (trace_configure() < 0)
+                        rc = -1;
+                if (stats_configure() < 0)
+                        rc = -1;
+                if (metrics_configure() < 0)
+                        rc = -1;
+                __atomic_store_n(&config_loaded, true, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&config_lock);
+
+        return rc;
+}
+
+struct config_section PRIVATE *
+config_find_section(const char *name)
+{
+        struct config_section *section;
+        struct list_head *this;
+
+        config_for_each_section(section, this) {
+                if (!strcmp(section->name, name))
+                        return section;
+        }
+        return NULL;
+}
+
+const char PRIVATE *
+config_get(const char *name, const char *key)
+{
+        struct config_section *section;
+        struct list_head *this;
+
+        section = config_find_section(name);
+        if (!section)
+                return NULL;
+
+        list_for_each(this, &section->entries) {
+                struct config_entry *entry;
+
+                entry = list_entry(this, struct config_entry, list);
+                if (!strcmp(entry->key, key))
+                        return entry->value;
+        }
+        return NULL;
+}
+
+/*
+ * Returns 1 if the key was found, 0 if it wasn't, and -1 on a bad value.
+ */
+int PRIVATE
+config_get_bool(const char *name, const char *key, bool *val)
+{
+        const char *value;
+
+        value = config_get(name, key);
+        if (!value)
+                return 0;
+
+        if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") ||
+            !strcasecmp(value, "on") || !strcmp(value, "1")) {
+                *val = true;
+        } else if (!strcasecmp(value, "no") || !strcasecmp(value, "false") ||
+                   !strcasecmp(value, "off") || !strcmp(value, "0")) {
+                *val = false;
+        } else {
+                errno = EINVAL;
+                fsmock_error("[%s] %s: invalid boolean \"%s\"", name, key, value);
+                return -1;
+        }
+        return 1;
+}
+
+/*
+ * Parse a size with an optional binary suffix, i.e. "512", "64M", "4TiB".
+ * It's decimal unless it starts with "0x"; a leading 0 doesn't make it
+ * octal.  Returns 1 if the key was found, 0 if it wasn't, and -1 on a
+ * bad value.
+ */
+int PRIVATE
+config_get_size(const char *name, const char *key, uint64_t *val)
+{
+        const char *value, *digits;
+        const char *suffixes = "KMGTPE";
+        unsigned long long ull;
+        char *end = NULL;
+        char *pos;
+
+        value = config_get(name, key);
+        if (!value)
+                return 0;
+
+        errno = 0;
+        if (value[0] == '0' && (value[1] == 'x' || value[1] == 'X')) {
+                digits = value + 2;
+                if (!isxdigit(*digits))
+                        goto err;
+                ull = strtoull(digits, &end, 16);
+        } else {
+                digits = value;
+                if (!isdigit(*digits))
+                        goto err;
+                ull = strtoull(digits, &end, 10);
+        }
+        if (errno)
+                goto err;
+
+        end = trim(end);
+        if (*end) {
+                pos = strchr(suffixes, toupper(*end));
+                if (!pos)
+                        goto err;
+                for (int i = 0; i <= pos - suffixes; i++) {
+                        if (ull > ULLONG_MAX / 1024)
+                                goto err;
+                        ull *= 1024;
+                }
+                end++;
+                if (!strcasecmp(end, "iB") || !strcasecmp(end, "B"))
+                        end += strlen(end);
+                if (*end)
+                        goto err;
+        }
+
+        *val = ull;
+        return 1;
+err:
+        errno = EINVAL;
+        fsmock_error("[%s] %s: invalid size \"%s\"", name, key, value);
+        return -1;
+}
+
+/*
+ * Parse a length of time into nanoseconds, i.e. "250us", "8.5ms", "1s".
+ * A number without a unit is in nanoseconds.
+ */
+int PRIVATE
+config_parse_time(const char *value, uint64_t *val)
+{
+        static const struct {
+                const char *unit;
+                double ns;
+        } units[] = {
+                { "", 1 },
+                { "ns", 1 },
+                { "us", 1e3 },
+                { "ms", 1e6 },
+                { "s", 1e9 },
+        };
+        char *end = NULL;
+        double d;
+
+        errno = 0;
+        d = strtod(value, &end);
+        if (errno || end == value || !(d >= 0))
+                goto err;
+
+        while (isspace(*end))
+                end++;
+        for (unsigned int i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+                if (strcasecmp(end, units[i].unit))
+                        continue;
+                d *= units[i].ns;
+                if (d >= (double)UINT64_MAX)
+                        goto err;
+                *val = d;
+                return 0;
+        }
+err:
+        errno = EINVAL;
+        return -1;
+}
+
+/*
+ * Returns 1 if the key was found, 0 if it wasn't, and -1 on a bad value.
+ */
+int PRIVATE
+config_get_time(const char *name, const char *key, uint64_t *val)
+{
+        const char *value;
+
+        value = config_get(name, key);
+        if (!value)
+                return 0;
+
+        if (config_parse_time(value, val) < 0) {
+                fsmock_error("[%s] %s: invalid time \"%s\"", name, key, value);
+                return -1;
+        }
+        return 1;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,80 @@
+/*
+ * config.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_CONFIG_H_
+#define FSMOCK_CONFIG_H_
+
+#include "fsmock.h"
+
+/*
+ * LIBFSMOCK_CONFIG names an ini-style file:
+ *
+ *   # comment
+ *   [/dev/sda]
+ *   size = 4T
+ *   sector-size = 512
+ *
+ *   [/dev/sdb]
+ *   image = /var/tmp/sdb.img
+ *   read-only = yes
+ *
+ *   [/dev/sdc]
+ *   overlay = /var/tmp/golden.img
+ *   profile = ssd
+ *
+ * Sections whose names start with '/' describe mounts, and are mounted
+ * when the library is initialized.  A [trace] section turns on tracing
+ * and says what to trace; see trace_configure().  A [stats] section
+ * turns on the counters fsmock_stats_get() reports, and a [metrics]
+ * section publishes them for fsmock-top.
+ */
+struct config_entry {
+        struct list_head list;
+        char *key;
+        char *value;
+};
+
+struct config_section {
+        struct list_head list;
+        char *name;
+        struct list_head entries;
+};
+
+extern struct list_head PRIVATE config_sections;
+
+extern int PRIVATE config_load(void);
+extern struct config_section PRIVATE *config_find_section(const char *name);
+extern const char PRIVATE *config_get(const char *section, const char *key);
+extern int PRIVATE config_get_bool(const char *section, const char *key,
+                                   bool *val);
+extern int PRIVATE config_get_size(const char *section, const char *key,
+                                   uint64_t *val);
+extern int PRIVATE config_parse_time(const char *value, uint64_t *val);
+extern int PRIVATE config_get_time(const char *section, const char *key,
+                                   uint64_t *val);
+
+#define config_for_each_section(pos, this)                              \
+        for (this = config_sections.next,                               \
+             pos = list_entry(this, struct config_section, list);       \
+             this != &config_sections;                                  \
+             this = this->next,                                         \
+             pos = list_entry(this, struct config_section, list))
+
+#endif /* !FSMOCK_CONFIG_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,347 @@
+/*
+ * devmodel.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+
+/*
+ * Sleeping overshoots by up to the thread's timer slack, 50us unless
+ * somebody's changed it, so the last stretch of a wait is spun instead.
+ */
+#define DEVMODEL_SPIN_NS        60000
+
+/*
+ * What "profile = ..." starts from.  Anything else in the section
+ * overrides it.
+ */
+static const struct devmodel_profile {
+        const char *name;
+        uint64_t latency;
+        uint64_t seek_time;
+        uint64_t rpm;
+        uint64_t bandwidth;
+        unsigned int nr_tail;
+        struct devmodel_tail tail[DEVMODEL_MAX_TAIL];
+} devmodel_profiles[] = {
+        { .name = "none" },
+        { .name = "hdd",
+          .latency = 100000,
+          .seek_time = 16000000,
+          .rpm = 7200,
+          .bandwidth = 160ULL << 20 },
+        { .name = "ssd",
+          .latency = 80000,
+          .bandwidth = 500ULL << 20,
+          .nr_tail = 3,
+          .tail = { { 99, 400000 }, { 99.9, 2000000 },
+                    { 99.99, 10000000 } } },
+        { .name = "nvme",
+          .latency = 20000,
+          .bandwidth = 3ULL << 30,
+          .nr_tail = 3,
+          .tail = { { 99, 100000 }, { 99.9, 500000 },
+                    { 99.99, 2000000 } } },
+};
+
+static const struct devmodel_profile *
+find_profile(const char *name)
+{
+        for (unsigned int i = 0;
+             i < sizeof(devmodel_profiles) / sizeof(devmodel_profiles[0]);
+             i++)
+                if (!strcasecmp(devmodel_profiles[i].name, name))
+                        return &devmodel_profiles[i];
+        return NULL;
+}
+
+/*
+ * "99:1ms 99.9:10ms ..."
+ */
+static int
+parse_tail(const char *value, struct devmodel_tail *tail,
+           unsigned int *nr_tail)
+{
+        char *points, *point, *saveptr = NULL;
+        unsigned int n = 0;
+        int rc = -1;
+
+        points = strdup(value);
+        if (!points)
+                return -1;
+
+        for (point = strtok_r(points, ", \t", &saveptr); point;
+             point = strtok_r(NULL, ", \t", &saveptr)) {
+                char *end = NULL;
+
+                if (n == DEVMODEL_MAX_TAIL)
+                        goto err;
+                errno = 0;
+                tail[n].percentile = strtod(point, &end);
+                if (errno || end == point || *end != ':' ||
+                    config_parse_time(end + 1, &tail[n].latency) < 0)
+                        goto err;
+                n++;
+        }
+        *nr_tail = n;
+        rc = 0;
+err:
+        free(points);
+        if (rc < 0)
+                errno = EINVAL;
+        return rc;
+}
+
+/*
+ * The tail starts where the median leaves off, and only gets slower.
+ */
+static bool
+tail_valid(const struct devmodel *model)
+{
+        double percentile = 50;
+        uint64_t latency = model->latency;
+
+        for (unsigned int i = 0; i < model->nr_tail; i++) {
+                if (!(model->tail[i].percentile > percentile) ||
+                    model->tail[i].percentile > 100 ||
+                    model->tail[i].latency < latency)
+                        return false;
+                percentile = model->tail[i].percentile;
+                latency = model->tail[i].latency;
+        }
+        return true;
+}
+
+/*
+ * Make the model for device name, or leave *modelp NULL if it doesn't
+ * have one.
+ */
+int PRIVATE
+devmodel_new(const char *name, uint64_t size, struct devmodel **modelp)
+{
+        const struct devmodel_profile *profile = &devmodel_profiles[0];
+        struct devmodel *model;
+        const char *value;
+        uint64_t rpm, seed = 0xcbf29ce484222325ULL;
+        int has_seed;
+
+        *modelp = NULL;
+
+        value = config_get(name, "profile");
+        if (value) {
+                profile = find_profile(value);
+                if (!profile) {
+                        errno = EINVAL;
+                        fsmock_error("[%s] profile: unknown profile \"%s\"",
+                                     name, value);
+                        return -1;
+                }
+        }
+
+        model = calloc(1, sizeof(*model));
+        if (!model)
+                return -1;
+        model->size = size;
+        model->latency = profile->latency;
+        model->seek_time = profile->seek_time;
+        model->bandwidth = profile->bandwidth;
+        model->nr_tail = profile->nr_tail;
+        memcpy(model->tail, profile->tail, sizeof(model->tail));
+        rpm = profile->rpm;
+
+        has_seed = config_get_size(name, "seed", &seed);
+        if (config_get_time(name, "latency", &model->latency) < 0 ||
+            config_get_time(name, "seek-time", &model->seek_time) < 0 ||
+            config_get_size(name, "rpm", &rpm) < 0 ||
+            config_get_size(name, "bandwidth", &model->bandwidth) < 0 ||
+            config_get_size(name, "burst", &model->burst) < 0 ||
+            has_seed < 0)
+                goto err;
+
+        value = config_get(name, "tail-latency");
+        if (value && parse_tail(value, model->tail, &model->nr_tail) < 0) {
+                fsmock_error("[%s] tail-latency: invalid latencies \"%s\"",
+                             name, value);
+                goto err;
+        }
+        if (!tail_valid(model)) {
+                errno = EINVAL;
+                fsmock_error("[%s] tail-latency: percentiles must be over 50 and increasing, and latencies no less than \"latency\"",
+                             name);
+                goto err;
+        }
+        if (rpm)
+                model->rotation = 60000000000ULL / rpm;
+
+        if (!model->latency && !model->seek_time && !model->rotation &&
+            !model->bandwidth && !model->nr_tail) {
+                free(model);
+                return 0;
+        }
+
+        /*
+         * Unless we're told otherwise, every device gets its own
+         * sequence of random numbers, and gets the same one every time.
+         */
+        if (!has_seed)
+                for (const char *c = name; *c; c++)
+                        seed = (seed ^ (uint8_t)*c) * 0x100000001b3ULL;
+        model->rng = seed;
+
+        pthread_mutex_init(&model->lock, NULL);
+        *modelp = model;
+        return 0;
+err:
+        free(model);
+        return -1;
+}
+
+void PRIVATE
+devmodel_free(struct devmodel *model)
+{
+        if (!model)
+                return;
+        pthread_mutex_destroy(&model->lock);
+        free(model);
+}
+
+/*
+ * splitmix64, as a double in [0, 1).
+ */
+static double
+devmodel_random(struct devmodel *model)
+{
+        uint64_t z = (model->rng += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        return (z >> 11) * 0x1.0p-53;
+}
+
+/*
+ * A command's overhead: the median for half of them, and for the rest,
+ * somewhere on the line through the tail-latency points.
+ */
+static uint64_t
+devmodel_latency(struct devmodel *model)
+{
+        double percentile = 50, p;
+        uint64_t latency = model->latency;
+
+        if (!model->nr_tail)
+                return latency;
+
+        p = devmodel_random(model) * 100;
+        for (unsigned int i = 0; i < model->nr_tail; i++) {
+                const struct devmodel_tail *tail = &model->tail[i];
+
+                if (p <= tail->percentile) {
+                        if (p <= percentile)
+                                return latency;
+                        return latency + (tail->latency - latency) *
+                                         ((p - percentile) /
+                                          (tail->percentile - percentile));
+                }
+                percentile = tail->percentile;
+                latency = tail->latency;
+        }
+        return latency;
+}
+
+/*
+ * When a request for count bytes at offset, which reached the device at
+ * start, would be done.
+ */
+uint64_t PRIVATE
+devmodel_service(struct devmodel *model, uint64_t start, uint64_t offset,
+                 uint64_t count)
+{
+        bool rotational = model->seek_time || model->rotation;
+        uint64_t t = start;
+
+        pthread_mutex_lock(&model->lock);
+
+        /*
+         * There's one head, so positioning for one request waits for
+         * the last one to be done with it.
+         */
+        if (rotational) {
+                if (t < model->busy_until)
+                        t = model->busy_until;
+                if (offset != model->head) {
+                        uint64_t distance = offset > model->head ?
+                                            offset - model->head :
+                                            model->head - offset;
+
+                        t += model->seek_time *
+                             sqrt((double)distance / model->size);
+                        t += model->rotation * devmodel_random(model);
+                }
+                model->head = offset + count;
+        }
+
+        /*
+         * The token bucket, as a virtual clock: bucket_tat is when the
+         * bucket will have refilled from everything sent so far, and a
+         * full one holds burst bytes.
+         */
+        if (model->bandwidth) {
+                uint64_t cost = count * 1e9 / model->bandwidth;
+                uint64_t tau = model->burst * 1e9 / model->bandwidth;
+                uint64_t tat = model->bucket_tat;
+
+                tat = (tat > t ? tat : t) + cost;
+                model->bucket_tat = tat;
+                if (tat > t + tau)
+                        t = tat - tau;
+        }
+
+        if (rotational)
+                model->busy_until = t;
+        t += devmodel_latency(model);
+
+        pthread_mutex_unlock(&model->lock);
+
+        return t;
+}
+
+void PRIVATE
+devmodel_wait(uint64_t deadline)
+{
+        uint64_t now = trace_clock();
+
+        if (deadline > now + DEVMODEL_SPIN_NS) {
+                uint64_t wake = deadline - DEVMODEL_SPIN_NS;
+                struct timespec ts = {
+                        .tv_sec = wake / 1000000000ULL,
+                        .tv_nsec = wake % 1000000000ULL,
+                };
+
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                       &ts, NULL) == EINTR)
+                        ;
+        }
+        while (trace_clock() < deadline)
+                sched_yield();
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,83 @@
+/*
+ * devmodel.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_DEVMODEL_H_
+#define FSMOCK_DEVMODEL_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * How long a simulated device takes to service a request.  Without a
+ * model, a request takes as long as copying its data does; with one, it
+ * isn't completed until the time the model says it would be on a real
+ * device:
+ *
+ *  - a rotational device has to move its head and wait for the sector to
+ *    come around before any request that doesn't start where the last
+ *    one ended, and only does one of those at a time;
+ *  - data moves at no more than the device's bandwidth, with a token
+ *    bucket letting up to "burst" bytes through at once after it's been
+ *    idle;
+ *  - every command has a fixed overhead on top of that, which is the
+ *    median; the tail-latency table says how much longer the slowest
+ *    commands take.
+ *
+ * Anything random comes from the model's own generator, which is seeded
+ * from the device's name unless the config gives a seed, so a run that
+ * does the same I/O sees the same latencies.
+ */
+#define DEVMODEL_MAX_TAIL       8
+
+struct devmodel_tail {
+        double percentile;
+        uint64_t latency;
+};
+
+struct devmodel {
+        pthread_mutex_t lock;
+        uint64_t size;
+
+        /* configuration, all times in nanoseconds */
+        uint64_t latency;
+        uint64_t seek_time;
+        uint64_t rotation;
+        uint64_t bandwidth;
+        uint64_t burst;
+        unsigned int nr_tail;
+        struct devmodel_tail tail[DEVMODEL_MAX_TAIL];
+
+        /* state, protected by lock */
+        uint64_t rng;
+        uint64_t head;
+        uint64_t busy_until;
+        uint64_t bucket_tat;
+};
+
+extern int PRIVATE devmodel_new(const char *name, uint64_t size,
+                                struct devmodel **modelp);
+extern void PRIVATE devmodel_free(struct devmodel *model);
+extern uint64_t PRIVATE devmodel_service(struct devmodel *model,
+                                         uint64_t start, uint64_t offset,
+                                         uint64_t count);
+extern void PRIVATE devmodel_wait(uint64_t deadline);
+
+#endif /* !FSMOCK_DEVMODEL_H_ */
+// vim:fenc=utf-8:tw=75:et
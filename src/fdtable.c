@@ -0,0 +1,147 @@
+/*
+ * fdtable.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+/*
+ * Like the bfd table, this is a two level array whose chunks are
+ * allocated on demand and never moved or freed.  The kernel won't hand
+ * the same fd number to two opens at once, so nobody else can be
+ * changing a record while we install or clear it, but chunk allocation
+ * can race.
+ */
+static uint64_t *fd_states[FD_STATE_CHUNKS];
+
+static inline uint64_t *
+fd_state_slot(int fd, bool alloc)
+{
+        uint64_t **chunkp = &fd_states[fd / FD_STATES_PER_CHUNK];
+        uint64_t *chunk, *expected = NULL;
+
+        chunk = __atomic_load_n(chunkp, __ATOMIC_ACQUIRE);
+        if (chunk || !alloc)
+                return chunk ? &chunk[fd % FD_STATES_PER_CHUNK] : NULL;
+
+        chunk = calloc(FD_STATES_PER_CHUNK, sizeof(*chunk));
+        if (!chunk)
+                return NULL;
+        if (!__atomic_compare_exchange_n(chunkp, &expected, chunk, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                free(chunk);
+                chunk = expected;
+        }
+        return &chunk[fd % FD_STATES_PER_CHUNK];
+}
+
+/*
+ * Record that fd is one of ours, with bio handle bfd (or -1).  If the fd
+ * still has a record, it got closed behind our back, and the bio handle
+ * that went with it is closed now.
+ */
+int PRIVATE
+fd_state_install(int fd, int bfd)
+{
+        union fd_state_word u, installed;
+        uint64_t *slot;
+
+        if (fd < 0 || fd >= FD_MAX_STATES) {
+                errno = EMFILE;
+                return -1;
+        }
+        slot = fd_state_slot(fd, true);
+        if (!slot)
+                return -1;
+
+        u.word = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        do {
+                /*
+                 * Skip a generation over a stale record, so it still
+                 * looks reused.
+                 */
+                installed.state.generation = u.state.generation +
+                        ((u.state.generation & 1) ? 2 : 1);
+                installed.state.bfd = bfd;
+        } while (!__atomic_compare_exchange_n(slot, &u.word, installed.word,
+                                              true, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_RELAXED));
+
+        if ((u.state.generation & 1) && u.state.bfd >= 0) {
+                int error = errno;
+
+                bio_close(u.state.bfd);
+                errno = error;
+        }
+        return 0;
+}
+
+/*
+ * Forget about fd.  If it was ours, return true and put what its record
+ * said in *old; when several threads clear the same record, only one of
+ * them gets it.
+ */
+bool PRIVATE
+fd_state_clear(int fd, struct fd_state *old)
+{
+        union fd_state_word u, cleared;
+        uint64_t *slot;
+
+        if (fd < 0 || fd >= FD_MAX_STATES)
+                return false;
+        slot = fd_state_slot(fd, false);
+        if (!slot)
+                return false;
+
+        u.word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        do {
+                if (!(u.state.generation & 1))
+                        return false;
+                cleared.state.generation = u.state.generation + 1;
+                cleared.state.bfd = -1;
+        } while (!__atomic_compare_exchange_n(slot, &u.word, cleared.word,
+                                              true, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_ACQUIRE));
+
+        *old = u.state;
+        return true;
+}
+
+/*
+ * Look fd up without taking any locks.  Returns true and fills in *state
+ * if it's one of ours.
+ */
+bool PRIVATE
+fd_state_get(int fd, struct fd_state *state)
+{
+        union fd_state_word u;
+        uint64_t *slot;
+
+        if (fd < 0 || fd >= FD_MAX_STATES)
+                return false;
+        slot = fd_state_slot(fd, false);
+        if (!slot)
+                return false;
+
+        u.word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (!(u.state.generation & 1))
+                return false;
+        *state = u.state;
+        return true;
+}
+
+// vim:fenc=utf-8:tw=75:et
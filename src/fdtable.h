@@ -0,0 +1,65 @@
+/*
+ * fdtable.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_FDTABLE_H_
+#define FSMOCK_FDTABLE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Every fd we've handed out for one of our paths has a record here,
+ * indexed by the fd number itself, so the fds we return are the real
+ * ones and finding out what one is costs one load.
+ *
+ * A record is small enough to be read and written as a single word.
+ * The generation counter goes up by one when a record is installed and
+ * again when it's cleared, so it's odd while the fd is ours, and a reader
+ * can tell whether a record it looked at earlier has been reused since.
+ * Mocked devices have a bio handle, which is where the offset and the
+ * device live; other paths of ours have a bfd of -1.
+ */
+#define FD_STATES_PER_CHUNK     1024
+#define FD_STATE_CHUNKS         1024
+#define FD_MAX_STATES           (FD_STATES_PER_CHUNK * FD_STATE_CHUNKS)
+
+struct fd_state {
+        uint32_t generation;
+        int32_t bfd;
+};
+
+union fd_state_word {
+        struct fd_state state;
+        uint64_t word;
+};
+
+extern int PRIVATE fd_state_install(int fd, int bfd);
+extern bool PRIVATE fd_state_clear(int fd, struct fd_state *old);
+extern bool PRIVATE fd_state_get(int fd, struct fd_state *state);
+
+static inline bool UNUSED
+is_our_fd(int fd)
+{
+        struct fd_state state;
+
+        return fd_state_get(fd, &state);
+}
+
+#endif /* !FSMOCK_FDTABLE_H_ */
+// vim:fenc=utf-8:tw=75:et
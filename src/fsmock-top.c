@@ -0,0 +1,335 @@
+/*
+ * fsmock-top.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * fsmock-top maps the metrics segment a process running with
+ * LIBFSMOCK_METRICS publishes, and shows how fast each call is being
+ * made and how much I/O each device is doing, until the process exits.
+ * It only ever reads the segment, so watching doesn't change anything
+ * about the process being watched.
+ */
+
+#include "fsmock.h"
+
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * Everything added up across the segment's slots at one moment.
+ */
+struct snapshot {
+        uint64_t when;
+        unsigned int threads;
+        struct metrics_call calls[METRICS_MAX_CALLS];
+        struct metrics_device devices[METRICS_MAX_DEVICES];
+};
+
+struct row {
+        unsigned int call;
+        double rate;
+};
+
+static void NORETURN
+usage(int status)
+{
+        FILE *out = status ? stderr : stdout;
+
+        fprintf(out, "Usage: fsmock-top [OPTION]... PID|FILE\n");
+        fprintf(out, "Show live call rates and device I/O of a process running with\n");
+        fprintf(out, "LIBFSMOCK_METRICS.\n\n");
+        fprintf(out, "  -d, --delay=SECONDS     time between updates (default 1)\n");
+        fprintf(out, "  -n, --iterations=COUNT  stop after COUNT updates\n");
+        fprintf(out, "  -h, --help              print this help\n");
+        exit(status);
+}
+
+static uint64_t
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct metrics_header *
+attach(const char *target)
+{
+        struct metrics_header *header;
+        char path[PATH_MAX];
+        struct stat sb;
+        char *end;
+        int fd;
+
+        strtol(target, &end, 10);
+        if (!*end && *target)
+                snprintf(path, sizeof(path), "/dev/shm/fsmock.%s", target);
+        else
+                snprintf(path, sizeof(path), "%s", target);
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                err(1, "%s", path);
+        if (fstat(fd, &sb) < 0)
+                err(1, "%s", path);
+        if ((size_t)sb.st_size < METRICS_SIZE)
+                errx(1, "%s: not an fsmock metrics segment", path);
+
+        header = mmap(NULL, METRICS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED)
+                err(1, "%s", path);
+        close(fd);
+
+        if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC)
+                errx(1, "%s: not an fsmock metrics segment", path);
+        if (header->version != METRICS_VERSION)
+                errx(1, "%s: unknown metrics version %u", path,
+                     header->version);
+        return header;
+}
+
+static void
+load_words(uint64_t *dst, const uint64_t *src, size_t size)
+{
+        for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+                dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static void
+add_words(uint64_t *dst, const uint64_t *src, size_t size)
+{
+        for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+                dst[i] += src[i];
+}
+
+/*
+ * Copy one slot, retrying until its owner wasn't in the middle of
+ * changing it.
+ */
+static void
+read_slot(struct metrics_slot *copy, struct metrics_slot *slot)
+{
+        uint32_t seq;
+
+        do {
+                while ((seq = __atomic_load_n(&slot->seq,
+                                              __ATOMIC_ACQUIRE)) & 1)
+                        sched_yield();
+                copy->tid = __atomic_load_n(&slot->tid, __ATOMIC_RELAXED);
+                load_words((uint64_t *)copy->calls, (uint64_t *)slot->calls,
+                           sizeof(slot->calls));
+                load_words((uint64_t *)copy->devices, (uint64_t *)slot->devices,
+                           sizeof(slot->devices));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/*
+ * Add up every slot.  If a thread exited while we were at it, its
+ * counts may have moved to slot 0 behind us, so start over.
+ */
+static void
+take_snapshot(struct metrics_header *header, struct snapshot *snap)
+{
+        static struct metrics_slot copy;
+        struct metrics_slot *slots = metrics_slots(header);
+        unsigned int nr_slots;
+        uint32_t seq;
+
+        do {
+                while ((seq = __atomic_load_n(&header->seq,
+                                              __ATOMIC_ACQUIRE)) & 1)
+                        sched_yield();
+
+                memset(snap, 0, sizeof(*snap));
+                snap->when = now();
+                nr_slots = __atomic_load_n(&header->nr_slots, __ATOMIC_ACQUIRE);
+                if (nr_slots > METRICS_MAX_SLOTS)
+                        nr_slots = METRICS_MAX_SLOTS;
+                for (unsigned int i = 0; i < nr_slots; i++) {
+                        read_slot(&copy, &slots[i]);
+                        if (i && copy.tid)
+                                snap->threads++;
+                        add_words((uint64_t *)snap->calls,
+                                  (uint64_t *)copy.calls, sizeof(copy.calls));
+                        add_words((uint64_t *)snap->devices,
+                                  (uint64_t *)copy.devices,
+                                  sizeof(copy.devices));
+                }
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) != seq);
+}
+
+static int
+compare_rows(const void *a, const void *b)
+{
+        const struct row *ra = a, *rb = b;
+
+        if (ra->rate != rb->rate)
+                return ra->rate < rb->rate ? 1 : -1;
+        return (int)ra->call - (int)rb->call;
+}
+
+static void
+show(struct metrics_header *header, const struct snapshot *prev,
+     const struct snapshot *cur, bool alive)
+{
+        double secs = (cur->when - prev->when) / 1e9;
+        unsigned int nr_calls = header->nr_calls;
+        unsigned int nr_devices;
+        struct row rows[METRICS_MAX_CALLS];
+        unsigned int nrows = 0;
+
+        if (nr_calls > METRICS_MAX_CALLS)
+                nr_calls = METRICS_MAX_CALLS;
+        nr_devices = __atomic_load_n(&header->nr_devices, __ATOMIC_ACQUIRE);
+        if (nr_devices > METRICS_MAX_DEVICES)
+                nr_devices = METRICS_MAX_DEVICES;
+        if (secs <= 0)
+                secs = 1e-9;
+
+        if (isatty(STDOUT_FILENO))
+                printf("\033[H\033[J");
+        printf("fsmock-top - pid %u%s, up %.0fs, %u threads\n\n", header->pid,
+               alive ? "" : " (exited)", (cur->when - header->start) / 1e9,
+               cur->threads);
+
+        for (unsigned int call = 0; call < nr_calls; call++) {
+                const struct metrics_call *c = &cur->calls[call];
+
+                if (!c->mocked && !c->passthrough)
+                        continue;
+                rows[nrows].call = call;
+                rows[nrows].rate = (c->mocked + c->passthrough -
+                                    prev->calls[call].mocked -
+                                    prev->calls[call].passthrough) / secs;
+                nrows++;
+        }
+        qsort(rows, nrows, sizeof(rows[0]), compare_rows);
+
+        printf("%-16s %11s %11s %9s %10s %12s\n", "CALL", "MOCKED/s",
+               "PASSED/s", "ERRORS/s", "AVG us", "TOTAL");
+        for (unsigned int i = 0; i < nrows; i++) {
+                unsigned int call = rows[i].call;
+                const struct metrics_call *c = &cur->calls[call];
+                const struct metrics_call *p = &prev->calls[call];
+                uint64_t n = c->mocked + c->passthrough -
+                             p->mocked - p->passthrough;
+                char name[METRICS_CALL_NAME_LEN + 1];
+
+                memcpy(name, header->calls[call], METRICS_CALL_NAME_LEN);
+                name[METRICS_CALL_NAME_LEN] = '\0';
+                printf("%-16s %11.1f %11.1f %9.1f %10.2f %12" PRIu64 "\n",
+                       name, (c->mocked - p->mocked) / secs,
+                       (c->passthrough - p->passthrough) / secs,
+                       (c->errors - p->errors) / secs,
+                       n ? (c->total_ns - p->total_ns) / 1e3 / n : 0.0,
+                       c->mocked + c->passthrough);
+        }
+
+        if (!nr_devices)
+                return;
+        printf("\n%-24s %9s %9s %10s %10s %9s\n", "DEVICE", "READS/s",
+               "WRITES/s", "READ MB/s", "WRITE MB/s", "ERRORS/s");
+        for (unsigned int i = 0; i < nr_devices; i++) {
+                const struct metrics_device *d = &cur->devices[i];
+                const struct metrics_device *p = &prev->devices[i];
+                char name[METRICS_DEVICE_NAME_LEN + 1];
+
+                memcpy(name, header->devices[i], METRICS_DEVICE_NAME_LEN);
+                name[METRICS_DEVICE_NAME_LEN] = '\0';
+                printf("%-24s %9.1f %9.1f %10.2f %10.2f %9.1f\n", name,
+                       (d->reads - p->reads) / secs,
+                       (d->writes - p->writes) / secs,
+                       (d->read_bytes - p->read_bytes) / secs / 1e6,
+                       (d->write_bytes - p->write_bytes) / secs / 1e6,
+                       (d->errors - p->errors) / secs);
+        }
+}
+
+int
+main(int argc, char *argv[])
+{
+        static const struct option options[] = {
+                { "delay", required_argument, NULL, 'd' },
+                { "iterations", required_argument, NULL, 'n' },
+                { "help", no_argument, NULL, 'h' },
+                { NULL, 0, NULL, 0 }
+        };
+        static struct snapshot snaps[2];
+        struct metrics_header *header;
+        struct timespec delay = { 1, 0 };
+        long iterations = -1;
+        double secs;
+        char *end;
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "d:n:h", options, NULL)) != -1) {
+                switch (opt) {
+                case 'd':
+                        secs = strtod(optarg, &end);
+                        if (*end || secs <= 0)
+                                errx(1, "invalid delay \"%s\"", optarg);
+                        delay.tv_sec = secs;
+                        delay.tv_nsec = (secs - delay.tv_sec) * 1e9;
+                        break;
+                case 'n':
+                        iterations = strtol(optarg, &end, 10);
+                        if (*end || iterations <= 0)
+                                errx(1, "invalid count \"%s\"", optarg);
+                        break;
+                case 'h':
+                        usage(0);
+                default:
+                        usage(1);
+                }
+        }
+        if (optind != argc - 1)
+                usage(1);
+
+        header = attach(argv[optind]);
+
+        /*
+         * The first update shows the rates since the process started.
+         */
+        memset(&snaps[0], 0, sizeof(snaps[0]));
+        snaps[0].when = header->start;
+        for (unsigned int i = 1; iterations != 0; i ^= 1) {
+                bool alive = !kill(header->pid, 0) || errno != ESRCH;
+
+                take_snapshot(header, &snaps[i]);
+                show(header, &snaps[i ^ 1], &snaps[i], alive);
+                fflush(stdout);
+                if (!alive)
+                        break;
+                if (iterations > 0)
+                        iterations--;
+                if (iterations != 0)
+                        nanosleep(&delay, NULL);
+        }
+
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,518 @@
+/*
+ * fsmock-trace.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * fsmock-trace reads the binary traces libfsmock writes with
+ * "format = binary", and prints them as text, as CSV, or as a summary of
+ * how many times each call was made and how long it took.
+ */
+
+#include "fsmock.h"
+
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+
+enum output_mode { OUTPUT_TEXT, OUTPUT_CSV, OUTPUT_SUMMARY };
+
+static enum output_mode output_mode = OUTPUT_TEXT;
+
+/*
+ * What we know about each process that wrote to the trace: what its
+ * call ids mean to us, and how to turn its timestamps into wall clock
+ * time.
+ */
+struct process {
+        struct list_head list;
+        uint32_t pid;
+        int64_t realtime_offset;
+        unsigned int ncalls;
+        char **names;
+        int *calls;
+};
+
+static LIST_HEAD(processes);
+
+struct call_stats {
+        struct list_head list;
+        const char *name;
+        uint64_t calls;
+        uint64_t errors;
+        uint64_t total;
+        uint64_t min;
+        uint64_t max;
+};
+
+static LIST_HEAD(stats);
+static uint64_t total_dropped;
+
+static void NORETURN
+usage(int status)
+{
+        FILE *out = status ? stderr : stdout;
+
+        fprintf(out, "Usage: fsmock-trace [OPTION]... [FILE]...\n");
+        fprintf(out, "Print a binary libfsmock trace.  With no FILE, or when FILE is -,\n");
+        fprintf(out, "read standard input.\n\n");
+        fprintf(out, "  -c, --csv       print comma separated values\n");
+        fprintf(out, "  -s, --summary   print a count and timings for each call\n");
+        fprintf(out, "  -h, --help      print this help\n");
+        exit(status);
+}
+
+static struct process *
+find_process(uint32_t pid)
+{
+        struct list_head *this;
+
+        list_for_each(this, &processes) {
+                struct process *proc;
+
+                proc = list_entry(this, struct process, list);
+                if (proc->pid == pid)
+                        return proc;
+        }
+        return NULL;
+}
+
+static void
+free_process(struct process *proc)
+{
+        for (unsigned int i = 0; i < proc->ncalls; i++)
+                free(proc->names[i]);
+        free(proc->names);
+        free(proc->calls);
+        free(proc);
+}
+
+/*
+ * A TRACE_CHUNK_CALLS chunk starts a process.  If the pid was used
+ * before, that process has exec()ed or gone away, so it's replaced.
+ */
+static int
+parse_calls(uint32_t pid, const uint8_t *data, size_t size)
+{
+        struct process *proc, *old;
+        uint64_t clocks[2];
+        uint64_t ncalls;
+        size_t n = sizeof(clocks);
+        ssize_t rc;
+
+        if (size < n)
+                goto err;
+        memcpy(clocks, data, sizeof(clocks));
+        rc = trace_get_varint(data + n, size - n, &ncalls);
+        if (rc < 0 || ncalls > size)
+                goto err;
+        n += rc;
+
+        proc = calloc(1, sizeof(*proc));
+        if (!proc)
+                return -1;
+        proc->pid = pid;
+        proc->realtime_offset = clocks[0] - clocks[1];
+        proc->names = calloc(ncalls, sizeof(*proc->names));
+        proc->calls = calloc(ncalls, sizeof(*proc->calls));
+        if (!proc->names || !proc->calls) {
+                free_process(proc);
+                return -1;
+        }
+
+        for (proc->ncalls = 0; proc->ncalls < ncalls; proc->ncalls++) {
+                unsigned int i = proc->ncalls;
+                uint64_t len;
+
+                rc = trace_get_varint(data + n, size - n, &len);
+                if (rc < 0 || len > size - n - rc) {
+                        free_process(proc);
+                        goto err;
+                }
+                n += rc;
+                proc->names[i] = strndup((const char *)data + n, len);
+                if (!proc->names[i]) {
+                        free_process(proc);
+                        return -1;
+                }
+                n += len;
+
+                proc->calls[i] = -1;
+                for (unsigned int call = 0; call < NR_CALLS; call++) {
+                        if (!strcmp(call_info[call].name, proc->names[i]))
+                                proc->calls[i] = call;
+                }
+        }
+
+        old = find_process(pid);
+        if (old) {
+                list_del(&old->list);
+                free_process(old);
+        }
+        list_add_tail(&proc->list, &processes);
+
+        return 0;
+err:
+        errno = EINVAL;
+        return -1;
+}
+
+static struct call_stats *
+get_stats(const char *name)
+{
+        struct call_stats *st;
+        struct list_head *this;
+
+        list_for_each(this, &stats) {
+                st = list_entry(this, struct call_stats, list);
+                if (!strcmp(st->name, name))
+                        return st;
+        }
+
+        st = calloc(1, sizeof(*st));
+        if (!st)
+                return NULL;
+        st->name = strdup(name);
+        if (!st->name) {
+                free(st);
+                return NULL;
+        }
+        st->min = UINT64_MAX;
+        list_add_tail(&st->list, &stats);
+        return st;
+}
+
+/*
+ * Print a record for a call this build doesn't know how to format.
+ */
+static void
+format_unknown(struct trace_buf *buf, const char *name,
+               const struct trace_record *rec)
+{
+        trace_printf(buf, "%s(", name);
+        for (unsigned int i = 0; i < rec->nargs; i++)
+                trace_printf(buf, "%s0x%" PRIx64, i ? ", " : "", rec->args[i]);
+        trace_printf(buf, ") = %" PRId64, rec->ret);
+}
+
+static void
+print_time(FILE *out, const struct process *proc, uint64_t timestamp)
+{
+        uint64_t ns = timestamp + proc->realtime_offset;
+        time_t secs = ns / 1000000000;
+        struct tm tm;
+        char when[32];
+
+        if (output_mode == OUTPUT_CSV) {
+                fprintf(out, "%" PRIu64 ".%09" PRIu64, ns / 1000000000,
+                        ns % 1000000000);
+                return;
+        }
+        localtime_r(&secs, &tm);
+        strftime(when, sizeof(when), "%H:%M:%S", &tm);
+        fprintf(out, "%s.%06" PRIu64, when, ns % 1000000000 / 1000);
+}
+
+static void
+print_csv_string(FILE *out, const char *s, size_t len)
+{
+        fputc('"', out);
+        for (size_t i = 0; i < len; i++) {
+                if (s[i] == '"')
+                        fputc('"', out);
+                fputc(s[i], out);
+        }
+        fputc('"', out);
+}
+
+static int
+put_record(const struct process *proc, struct trace_record *rec)
+{
+        struct trace_buf *buf;
+        struct call_stats *st;
+        const char *name;
+        bool is_error;
+        int call = -1;
+
+        if (rec->call < proc->ncalls) {
+                call = proc->calls[rec->call];
+                name = proc->names[rec->call];
+        } else {
+                name = "unknown";
+        }
+        if (call >= 0) {
+                rec->call = call;
+                is_error = trace_is_error(rec);
+        } else {
+                is_error = rec->ret < 0;
+        }
+
+        if (output_mode == OUTPUT_SUMMARY) {
+                st = get_stats(name);
+                if (!st)
+                        return -1;
+                st->calls += 1;
+                st->errors += is_error;
+                st->total += rec->latency;
+                if (rec->latency < st->min)
+                        st->min = rec->latency;
+                if (rec->latency > st->max)
+                        st->max = rec->latency;
+                return 0;
+        }
+
+        buf = malloc(sizeof(*buf));
+        if (!buf)
+                return -1;
+        buf->used = 0;
+
+        if (output_mode == OUTPUT_CSV) {
+                if (call >= 0)
+                        trace_format_args(buf, rec);
+                else
+                        format_unknown(buf, name, rec);
+                print_time(stdout, proc, rec->timestamp);
+                printf(",%u,%u,%s,", proc->pid, rec->tid, name);
+                print_csv_string(stdout, buf->data, buf->used);
+                printf(",%" PRId64 ",%d,%" PRIu64 "\n", rec->ret,
+                       is_error ? rec->error : 0, rec->latency);
+        } else {
+                if (call >= 0)
+                        trace_format_record(buf, rec);
+                else
+                        format_unknown(buf, name, rec);
+                print_time(stdout, proc, rec->timestamp);
+                printf(" [%u/%u] %.*s <%" PRIu64 ".%06" PRIu64 ">\n",
+                       proc->pid, rec->tid, (int)buf->used, buf->data,
+                       rec->latency / 1000000000,
+                       rec->latency % 1000000000 / 1000);
+        }
+        free(buf);
+
+        return 0;
+}
+
+static void
+put_dropped(const struct process *proc, uint32_t tid, uint64_t dropped)
+{
+        total_dropped += dropped;
+        if (output_mode == OUTPUT_TEXT)
+                printf("[%u/%u] <%" PRIu64 " calls not traced>\n",
+                       proc->pid, tid, dropped);
+}
+
+static int
+parse_records(uint32_t pid, const uint8_t *data, size_t size)
+{
+        struct process *proc;
+        struct trace_record rec;
+        struct trace_cursor cursor = { 0, 0 };
+        size_t n = 0;
+
+        proc = find_process(pid);
+        if (!proc) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        while (n < size) {
+                uint64_t dropped;
+                ssize_t rc;
+
+                rc = trace_decode(data + n, size - n, &rec, &cursor, &dropped);
+                if (rc < 0)
+                        return -1;
+                n += rc;
+
+                if (dropped)
+                        put_dropped(proc, rec.tid, dropped);
+                else if (put_record(proc, &rec) < 0)
+                        return -1;
+        }
+        return 0;
+}
+
+static int
+decode(FILE *in, const char *path)
+{
+        struct trace_chunk chunk;
+        uint8_t *data = NULL;
+        int ret = -1;
+
+        for (;;) {
+                uint8_t *new_data;
+                size_t rc;
+
+                rc = fread(&chunk, 1, sizeof(chunk), in);
+                if (rc == 0 && feof(in)) {
+                        ret = 0;
+                        break;
+                }
+                if (rc != sizeof(chunk)) {
+                        warnx("%s: truncated chunk header", path);
+                        break;
+                }
+                if (chunk.magic != TRACE_CHUNK_MAGIC ||
+                    chunk.version != TRACE_FORMAT_VERSION) {
+                        warnx("%s: not a libfsmock binary trace", path);
+                        break;
+                }
+
+                new_data = realloc(data, chunk.size ? chunk.size : 1);
+                if (!new_data) {
+                        warn("%s", path);
+                        break;
+                }
+                data = new_data;
+                if (fread(data, 1, chunk.size, in) != chunk.size) {
+                        warnx("%s: truncated chunk", path);
+                        break;
+                }
+
+                if (chunk.type == TRACE_CHUNK_CALLS) {
+                        if (parse_calls(chunk.pid, data, chunk.size) < 0) {
+                                warn("%s: bad call table for pid %u", path,
+                                     chunk.pid);
+                                break;
+                        }
+                } else if (chunk.type == TRACE_CHUNK_RECORDS) {
+                        if (parse_records(chunk.pid, data, chunk.size) < 0) {
+                                warn("%s: bad records for pid %u", path,
+                                     chunk.pid);
+                                break;
+                        }
+                }
+        }
+        free(data);
+
+        return ret;
+}
+
+static int
+compare_stats(const void *a, const void *b)
+{
+        const struct call_stats *x = *(const struct call_stats **)a;
+        const struct call_stats *y = *(const struct call_stats **)b;
+
+        if (x->total != y->total)
+                return x->total < y->total ? 1 : -1;
+        return strcmp(x->name, y->name);
+}
+
+static void
+print_summary(void)
+{
+        struct call_stats **sorted;
+        struct list_head *this;
+        uint64_t calls = 0, errors = 0, total = 0;
+        size_t n = 0;
+
+        list_for_each(this, &stats)
+                n++;
+        sorted = calloc(n ? n : 1, sizeof(*sorted));
+        if (!sorted)
+                err(1, "fsmock-trace");
+        n = 0;
+        list_for_each(this, &stats) {
+                struct call_stats *st;
+
+                st = list_entry(this, struct call_stats, list);
+                sorted[n++] = st;
+                calls += st->calls;
+                errors += st->errors;
+                total += st->total;
+        }
+        qsort(sorted, n, sizeof(*sorted), compare_stats);
+
+        printf("%% time     seconds  usecs/call    min usecs    max usecs     calls    errors call\n");
+        printf("------ ----------- ----------- ------------ ------------ --------- --------- ----------------\n");
+        for (size_t i = 0; i < n; i++) {
+                struct call_stats *st = sorted[i];
+
+                printf("%6.2f %11.6f %11" PRIu64 " %12.3f %12.3f %9" PRIu64 " %9" PRIu64 " %s\n",
+                       total ? 100.0 * st->total / total : 0.0,
+                       st->total / 1e9, st->total / st->calls / 1000,
+                       st->min / 1e3, st->max / 1e3,
+                       st->calls, st->errors, st->name);
+        }
+        printf("------ ----------- ----------- ------------ ------------ --------- --------- ----------------\n");
+        printf("100.00 %11.6f %11s %12s %12s %9" PRIu64 " %9" PRIu64 " total\n",
+               total / 1e9, "", "", "", calls, errors);
+        if (total_dropped)
+                printf("\n%" PRIu64 " calls were not traced\n", total_dropped);
+        free(sorted);
+}
+
+int
+main(int argc, char *argv[])
+{
+        static const struct option options[] = {
+                { "csv", no_argument, NULL, 'c' },
+                { "summary", no_argument, NULL, 's' },
+                { "help", no_argument, NULL, 'h' },
+                { NULL, 0, NULL, 0 }
+        };
+        int status = 0;
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "csh", options, NULL)) != -1) {
+                switch (opt) {
+                case 'c':
+                        output_mode = OUTPUT_CSV;
+                        break;
+                case 's':
+                        output_mode = OUTPUT_SUMMARY;
+                        break;
+                case 'h':
+                        usage(0);
+                default:
+                        usage(1);
+                }
+        }
+
+        if (output_mode == OUTPUT_CSV)
+                printf("time,pid,tid,call,args,ret,errno,latency_ns\n");
+
+        if (optind == argc) {
+                if (decode(stdin, "<stdin>") < 0)
+                        status = 1;
+        }
+        for (int i = optind; i < argc; i++) {
+                FILE *in = stdin;
+
+                if (strcmp(argv[i], "-")) {
+                        in = fopen(argv[i], "r");
+                        if (!in) {
+                                warn("%s", argv[i]);
+                                status = 1;
+                                continue;
+                        }
+                }
+                if (decode(in, argv[i]) < 0)
+                        status = 1;
+                if (in != stdin)
+                        fclose(in);
+        }
+
+        if (output_mode == OUTPUT_SUMMARY)
+                print_summary();
+
+        return status;
+}
+
+// vim:fenc=utf-8:tw=75:et
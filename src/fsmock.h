@@ -21,15 +21,31 @@
 #define CONSTRUCTOR_N(n) __attribute__((constructor(n)))
 #define DESTRUCTOR __attribute__((destructor))
 #define DESTRUCTOR_N(n) __attribute__((destructor(n)))
+#define ALIAS(name) __attribute__((__alias__ (#name)))
 #define VERSION(name, version) __asm__(".symver " name "," name "@@" version)
 #define NORETURN __attribute__((__noreturn__))
+#define NOINLINE __attribute__((__noinline__))
+#define COLD __attribute__((__cold__))
 
 #include "list.h"
+#include "probe.h"
+#include "rcu.h"
 #include "error.h"
 #include "util.h"
 #include "api.h"
+#include "config.h"
+#include "sparse.h"
+#include "image.h"
+#include "blktrace.h"
+#include "devmodel.h"
 #include "blkio.h"
+#include "aio.h"
 #include "mount.h"
+#include "pathcache.h"
+#include "fdtable.h"
+#include "trace.h"
+#include "stats.h"
+#include "metrics.h"
 
 #endif /* !FSMOCK_PRIVATE_H_ */
 // vim:fenc=utf-8:tw=75
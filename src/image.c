@@ -0,0 +1,134 @@
+/*
+ * image.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static LIST_HEAD(images);
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+free_image(struct image *image)
+{
+        if (image->data)
+                munmap(image->data, image->size);
+        free(image->path);
+        free(image);
+}
+
+struct image PRIVATE *
+image_open(const char *path, bool writable)
+{
+        struct image *image = NULL;
+        struct list_head *this;
+        struct stat sb;
+        int error;
+        int fd;
+
+        /*
+         * Not our own open(), which would trace this and might even
+         * think the image is one of our devices.
+         */
+        fd = syscall(SYS_openat, AT_FDCWD, path,
+                     (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0) {
+                fsmock_error("could not open image \"%s\"", path);
+                return NULL;
+        }
+
+        if (fstat(fd, &sb) < 0) {
+                fsmock_error("could not stat image \"%s\"", path);
+                goto err;
+        }
+
+        pthread_mutex_lock(&images_lock);
+        list_for_each(this, &images) {
+                struct image *other = list_entry(this, struct image, list);
+
+                if (other->st_dev == sb.st_dev &&
+                    other->st_ino == sb.st_ino &&
+                    other->writable == writable) {
+                        other->refcnt += 1;
+                        pthread_mutex_unlock(&images_lock);
+                        syscall(SYS_close, fd);
+                        return other;
+                }
+        }
+        pthread_mutex_unlock(&images_lock);
+
+        image = calloc(1, sizeof(*image));
+        if (!image)
+                goto err;
+
+        image->path = strdup(path);
+        if (!image->path)
+                goto err;
+        image->st_dev = sb.st_dev;
+        image->st_ino = sb.st_ino;
+        image->size = sb.st_size;
+        image->writable = writable;
+        image->refcnt = 1;
+
+        if (image->size) {
+                image->data = mmap(NULL, image->size,
+                                   PROT_READ | (writable ? PROT_WRITE : 0),
+                                   MAP_SHARED, fd, 0);
+                if (image->data == MAP_FAILED) {
+                        image->data = NULL;
+                        fsmock_error("could not map image \"%s\"", path);
+                        goto err;
+                }
+        }
+        syscall(SYS_close, fd);
+
+        pthread_mutex_lock(&images_lock);
+        list_add_tail(&image->list, &images);
+        pthread_mutex_unlock(&images_lock);
+
+        return image;
+err:
+        error = errno;
+        if (image)
+                free_image(image);
+        syscall(SYS_close, fd);
+        errno = error;
+        return NULL;
+}
+
+void PRIVATE
+image_put(struct image *image)
+{
+        if (!image)
+                return;
+
+        pthread_mutex_lock(&images_lock);
+        image->refcnt -= 1;
+        if (image->refcnt) {
+                pthread_mutex_unlock(&images_lock);
+                return;
+        }
+        list_del(&image->list);
+        pthread_mutex_unlock(&images_lock);
+
+        free_image(image);
+}
+
+// vim:fenc=utf-8:tw=75:et
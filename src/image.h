@@ -0,0 +1,47 @@
+/*
+ * image.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_IMAGE_H_
+#define FSMOCK_IMAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A raw disk image mapped into memory with MAP_SHARED.  Every device in
+ * the process that uses the same file with the same access mode shares
+ * one mapping, and other processes mapping it share the page cache.
+ */
+struct image {
+        struct list_head list;
+        char *path;
+        dev_t st_dev;
+        ino_t st_ino;
+        uint8_t *data;
+        uint64_t size;
+        bool writable;
+        int refcnt;
+};
+
+extern struct image PRIVATE *image_open(const char *path, bool writable);
+extern void PRIVATE image_put(struct image *image);
+
+#endif /* !FSMOCK_IMAGE_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -21,6 +21,7 @@
 #define FSMOCK_H_
 
 #include <fcntl.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -63,5 +64,92 @@ struct fsmock_io {
 extern int fsmock_mount(const char *mountpoint, struct fsmock_io *io);
 extern int fsmock_umount(const char *mountpoint);
 
+/*
+ * Checkpoints record a mounted device's contents without copying them,
+ * and fsmock_rollback() puts them back.  A checkpoint can be rolled back
+ * to any number of times until it's released.  fsmock_checkpoint()
+ * returns the checkpoint's id, or -1 and sets errno.
+ */
+extern int fsmock_checkpoint(const char *mountpoint);
+extern int fsmock_rollback(const char *mountpoint, int checkpoint);
+extern int fsmock_checkpoint_release(const char *mountpoint, int checkpoint);
+
+/*
+ * What each intercepted call has cost, if LIBFSMOCK_STATS is set or the
+ * config has a [stats] section.  latency[0] counts calls that took no
+ * measurable time, and latency[n] ones that took at least 2^(n-1) and
+ * less than 2^n nanoseconds; the last bucket has everything longer.
+ *
+ * fsmock_stats_get() fills in up to n entries, and returns how many
+ * there are, or -1 and sets errno to ENOTSUP if stats aren't being kept.
+ * fsmock_stats_reset() starts counting again from zero.
+ */
+#define FSMOCK_STATS_BUCKETS 32
+
+struct fsmock_stats {
+        const char *name;
+        uint64_t mocked;
+        uint64_t passthrough;
+        uint64_t errors;
+        uint64_t total_ns;
+        uint64_t latency[FSMOCK_STATS_BUCKETS];
+};
+
+extern int fsmock_stats_get(struct fsmock_stats *stats, unsigned int n);
+extern int fsmock_stats_reset(void);
+
+/*
+ * Asynchronous I/O on simulated devices, along the lines of io_uring.
+ * fsmock_bio_setup() makes a context with room for entries requests at
+ * once and a pool of workers threads to service them, or one per CPU if
+ * workers is 0.  fsmock_bio_submit() queues requests on fds opened on
+ * simulated devices, and returns how many it took, which is fewer than
+ * n if the context fills up; if it can't take any, it returns -1 and
+ * sets errno to EAGAIN.  A request stays in the context until it's
+ * reaped.  fsmock_bio_reap() waits until at least min requests have
+ * completed, or all of them if there are fewer than that, and takes up
+ * to max.  A completion's res is what the synchronous call would have
+ * returned, or -errno; an fd that isn't on a simulated device completes
+ * with -EBADF.
+ *
+ * fsmock_bio_eventfd() is readable whenever there are completions
+ * waiting to be reaped, so a context can go in a poll loop.
+ * fsmock_bio_destroy() waits for whatever's been submitted to finish.
+ * A request keeps the device it was submitted on open, so closing the fd
+ * doesn't affect requests already submitted on it.  A context can't be
+ * used in a child process after fork().
+ */
+#define FSMOCK_BIO_READ         0       /* pread(fd, addr, len, offset) */
+#define FSMOCK_BIO_WRITE        1       /* pwrite(fd, addr, len, offset) */
+#define FSMOCK_BIO_READV        2       /* preadv(fd, addr, len, offset) */
+#define FSMOCK_BIO_WRITEV       3       /* pwritev(fd, addr, len, offset) */
+
+struct fsmock_bio_sqe {
+        uint32_t opcode;
+        int32_t fd;
+        uint64_t offset;
+        void *addr;
+        uint32_t len;
+        uint64_t user_data;
+};
+
+struct fsmock_bio_cqe {
+        uint64_t user_data;
+        int64_t res;
+};
+
+struct fsmock_bio_ctx;
+
+extern struct fsmock_bio_ctx *fsmock_bio_setup(unsigned int entries,
+                                               unsigned int workers);
+extern int fsmock_bio_eventfd(struct fsmock_bio_ctx *ctx);
+extern int fsmock_bio_submit(struct fsmock_bio_ctx *ctx,
+                             const struct fsmock_bio_sqe *sqes,
+                             unsigned int n);
+extern int fsmock_bio_reap(struct fsmock_bio_ctx *ctx,
+                           struct fsmock_bio_cqe *cqes, unsigned int min,
+                           unsigned int max);
+extern void fsmock_bio_destroy(struct fsmock_bio_ctx *ctx);
+
 #endif /* !FSMOCK_H_ */
 // vim:fenc=utf-8:tw=75:et
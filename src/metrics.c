@@ -0,0 +1,365 @@
+/*
+ * metrics.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <ctype.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct metrics_header PRIVATE *metrics;
+
+static __thread struct metrics_slot *metrics_slot;
+static __thread bool metrics_no_slot;
+
+/*
+ * metrics_lock protects handing out slots, moving an exiting thread's
+ * counts to slot 0, and the list of devices.  Devices are numbered as
+ * they're created, whether or not there's a segment yet, since the ones
+ * in the config are mounted before we know if there will be.
+ */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static char metrics_devices[METRICS_MAX_DEVICES][METRICS_DEVICE_NAME_LEN];
+static unsigned int metrics_nr_devices;
+static pthread_key_t metrics_key;
+
+static void
+metrics_path(char *path, size_t size, pid_t pid)
+{
+        snprintf(path, size, "/dev/shm/fsmock.%d", pid);
+}
+
+/*
+ * Our destructor removes the segment, but a process that exits without
+ * running it, with _exit() or a signal, leaves it behind.  So whenever
+ * we make one, we also remove any whose process is gone.
+ */
+static void
+metrics_sweep(void)
+{
+        char buf[4096];
+        long n;
+        int dirfd;
+
+        dirfd = syscall(SYS_openat, AT_FDCWD, "/dev/shm",
+                        O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dirfd < 0)
+                return;
+
+        while ((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+                for (long off = 0; off < n; ) {
+                        struct dirent64 *de = (struct dirent64 *)(buf + off);
+                        char *end = NULL;
+                        long pid;
+
+                        off += de->d_reclen;
+                        if (strncmp(de->d_name, "fsmock.", 7) ||
+                            !isdigit(de->d_name[7]))
+                                continue;
+                        pid = strtol(de->d_name + 7, &end, 10);
+                        if (*end || pid <= 0 || pid == getpid())
+                                continue;
+                        if (kill(pid, 0) < 0 && errno == ESRCH)
+                                syscall(SYS_unlinkat, dirfd, de->d_name, 0);
+                }
+        }
+        syscall(SYS_close, dirfd);
+}
+
+/*
+ * Make a new, empty segment for this process.  It's created with raw
+ * system calls, so none of them show up in our own counts or trace.
+ */
+static struct metrics_header *
+metrics_create(void)
+{
+        struct metrics_header *header;
+        char path[64];
+        int fd;
+
+        metrics_sweep();
+        metrics_path(path, sizeof(path), getpid());
+        fd = syscall(SYS_openat, AT_FDCWD, path,
+                     O_RDWR|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0644);
+        if (fd < 0)
+                return NULL;
+        if (syscall(SYS_ftruncate, fd, METRICS_SIZE) < 0) {
+                int error = errno;
+
+                syscall(SYS_close, fd);
+                syscall(SYS_unlinkat, AT_FDCWD, path, 0);
+                errno = error;
+                return NULL;
+        }
+        header = mmap(NULL, METRICS_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+        syscall(SYS_close, fd);
+        if (header == MAP_FAILED) {
+                syscall(SYS_unlinkat, AT_FDCWD, path, 0);
+                return NULL;
+        }
+
+        header->version = METRICS_VERSION;
+        header->pid = getpid();
+        header->start = trace_clock();
+        header->nr_calls = NR_CALLS;
+        for (unsigned int call = 0; call < NR_CALLS; call++)
+                strncpy(header->calls[call], call_info[call].name,
+                        METRICS_CALL_NAME_LEN - 1);
+        header->nr_devices = metrics_nr_devices;
+        memcpy(header->devices, metrics_devices, sizeof(metrics_devices));
+        header->nr_slots = 1;
+        header->max_slots = METRICS_MAX_SLOTS;
+        __atomic_store_n(&header->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+
+        return header;
+}
+
+static inline void
+metrics_add(uint64_t *counter, uint64_t n)
+{
+        __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Move an exiting thread's counts to slot 0 and give its slot back.
+ * Anything the thread does after this, in other destructors, isn't
+ * counted; it doesn't get another slot.
+ */
+static void
+metrics_thread_exit(void *data)
+{
+        struct metrics_slot *slot = data;
+        struct metrics_slot *dead;
+        struct metrics_header *header = metrics;
+
+        metrics_slot = NULL;
+        metrics_no_slot = true;
+
+        pthread_mutex_lock(&metrics_lock);
+        dead = &metrics_slots(header)[0];
+        metrics_write_begin(&header->seq);
+        for (unsigned int i = 0; i < METRICS_MAX_CALLS; i++) {
+                metrics_add(&dead->calls[i].mocked, slot->calls[i].mocked);
+                metrics_add(&dead->calls[i].passthrough,
+                            slot->calls[i].passthrough);
+                metrics_add(&dead->calls[i].errors, slot->calls[i].errors);
+                metrics_add(&dead->calls[i].total_ns, slot->calls[i].total_ns);
+        }
+        for (unsigned int i = 0; i < METRICS_MAX_DEVICES; i++) {
+                metrics_add(&dead->devices[i].reads, slot->devices[i].reads);
+                metrics_add(&dead->devices[i].writes, slot->devices[i].writes);
+                metrics_add(&dead->devices[i].read_bytes,
+                            slot->devices[i].read_bytes);
+                metrics_add(&dead->devices[i].write_bytes,
+                            slot->devices[i].write_bytes);
+                metrics_add(&dead->devices[i].errors, slot->devices[i].errors);
+        }
+        memset(slot->calls, 0, sizeof(slot->calls));
+        memset(slot->devices, 0, sizeof(slot->devices));
+        __atomic_store_n(&slot->tid, 0, __ATOMIC_RELAXED);
+        metrics_write_end(&header->seq);
+        pthread_mutex_unlock(&metrics_lock);
+}
+
+static struct metrics_slot *
+metrics_slot_get(void)
+{
+        struct metrics_header *header = metrics;
+        struct metrics_slot *slots = metrics_slots(header);
+        unsigned int i;
+
+        if (__builtin_expect(metrics_slot != NULL, 1))
+                return metrics_slot;
+        if (metrics_no_slot)
+                return NULL;
+
+        pthread_mutex_lock(&metrics_lock);
+        for (i = 1; i < header->nr_slots; i++)
+                if (!slots[i].tid)
+                        break;
+        if (i == header->nr_slots) {
+                if (i == header->max_slots) {
+                        pthread_mutex_unlock(&metrics_lock);
+                        metrics_no_slot = true;
+                        return NULL;
+                }
+                __atomic_store_n(&header->nr_slots, i + 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&slots[i].tid, syscall(SYS_gettid), __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&metrics_lock);
+
+        metrics_slot = &slots[i];
+        pthread_setspecific(metrics_key, metrics_slot);
+        return metrics_slot;
+}
+
+void PRIVATE
+metrics_record_call(enum call_id call, enum stats_path path, uint64_t ns,
+                    bool failed)
+{
+        struct metrics_slot *slot = metrics_slot_get();
+        struct metrics_call *c;
+
+        if (!slot)
+                return;
+        c = &slot->calls[call];
+
+        metrics_write_begin(&slot->seq);
+        if (path == STATS_MOCKED)
+                metrics_add(&c->mocked, 1);
+        else
+                metrics_add(&c->passthrough, 1);
+        if (failed)
+                metrics_add(&c->errors, 1);
+        metrics_add(&c->total_ns, ns);
+        metrics_write_end(&slot->seq);
+}
+
+void PRIVATE
+metrics_record_io(int device, bool write, ssize_t ret)
+{
+        struct metrics_slot *slot = metrics_slot_get();
+        struct metrics_device *d;
+
+        if (!slot)
+                return;
+        d = &slot->devices[device];
+
+        metrics_write_begin(&slot->seq);
+        if (ret < 0) {
+                metrics_add(&d->errors, 1);
+        } else if (write) {
+                metrics_add(&d->writes, 1);
+                metrics_add(&d->write_bytes, ret);
+        } else {
+                metrics_add(&d->reads, 1);
+                metrics_add(&d->read_bytes, ret);
+        }
+        metrics_write_end(&slot->seq);
+}
+
+/*
+ * Give a new device a number, which blkdev_read() and blkdev_write()
+ * count its I/O under.  A device with the same name as one we've seen
+ * before, which is usually the same one mounted again, gets its number
+ * back and carries on from its counts.  Returns -1 once we've run out of
+ * them, in which case it just isn't counted.
+ */
+int PRIVATE
+metrics_add_device(const char *name)
+{
+        struct metrics_header *header;
+        int device = -1;
+
+        pthread_mutex_lock(&metrics_lock);
+        for (unsigned int i = 0; i < metrics_nr_devices; i++) {
+                if (!strncmp(metrics_devices[i], name,
+                             METRICS_DEVICE_NAME_LEN - 1)) {
+                        device = i;
+                        break;
+                }
+        }
+        if (device < 0 && metrics_nr_devices < METRICS_MAX_DEVICES) {
+                device = metrics_nr_devices++;
+                strncpy(metrics_devices[device], name,
+                        METRICS_DEVICE_NAME_LEN - 1);
+                header = metrics;
+                if (header) {
+                        memcpy(header->devices[device], metrics_devices[device],
+                               METRICS_DEVICE_NAME_LEN);
+                        __atomic_store_n(&header->nr_devices,
+                                         metrics_nr_devices, __ATOMIC_RELEASE);
+                }
+        }
+        pthread_mutex_unlock(&metrics_lock);
+
+        return device;
+}
+
+/*
+ * A child has to have its own segment, or it would be adding to its
+ * parent's.  It starts from zero, and if we can't make one, it just
+ * doesn't have any.
+ */
+static void
+metrics_child(void)
+{
+        struct metrics_header *old = metrics;
+
+        pthread_mutex_init(&metrics_lock, NULL);
+        metrics_slot = NULL;
+        metrics_no_slot = false;
+        pthread_setspecific(metrics_key, NULL);
+        if (!old)
+                return;
+
+        __atomic_store_n(&metrics, metrics_create(), __ATOMIC_RELEASE);
+        munmap(old, METRICS_SIZE);
+}
+
+/*
+ * The segment is made if LIBFSMOCK_METRICS is set, or there's a
+ * [metrics] section that doesn't say "enabled = no".  Its counts come
+ * from the same places fsmock_stats_get()'s do, so this turns stats on
+ * too.  This is called once, while the config is loaded.
+ */
+int PRIVATE
+metrics_configure(void)
+{
+        const char *value = getenv("LIBFSMOCK_METRICS");
+        struct metrics_header *header;
+        bool enabled;
+
+        enabled = (value && value[0]) || config_find_section("metrics");
+        if (config_get_bool("metrics", "enabled", &enabled) < 0)
+                return -1;
+        if (!enabled)
+                return 0;
+
+        pthread_key_create(&metrics_key, metrics_thread_exit);
+        pthread_atfork(NULL, NULL, metrics_child);
+
+        pthread_mutex_lock(&metrics_lock);
+        header = metrics_create();
+        if (header)
+                __atomic_store_n(&metrics, header, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&metrics_lock);
+        if (!header) {
+                fsmock_error("could not create the metrics segment");
+                return -1;
+        }
+
+        stats_enable();
+        return 0;
+}
+
+static void DESTRUCTOR
+metrics_fini(void)
+{
+        char path[64];
+
+        if (!metrics)
+                return;
+        metrics_path(path, sizeof(path), getpid());
+        syscall(SYS_unlinkat, AT_FDCWD, path, 0);
+}
+
+// vim:fenc=utf-8:tw=75:et
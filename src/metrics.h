@@ -0,0 +1,135 @@
+/*
+ * metrics.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_METRICS_H_
+#define FSMOCK_METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * With LIBFSMOCK_METRICS set, or a [metrics] section, each process keeps
+ * its counters in a file in /dev/shm, fsmock.<pid>, which fsmock-top can
+ * map and watch while the program runs.  Updating them is just stores to
+ * memory; there are no system calls and no locks on the way.
+ *
+ * The file is a struct metrics_header followed by max_slots slots.  Each
+ * thread gets a slot of its own, which only it writes to, guarded by a
+ * seqlock: seq is odd while the thread is changing it, so a reader that
+ * sees it change, or sees it odd, tries again.  Slot 0 holds the counts
+ * of threads that have exited; moving a thread's counts there is done
+ * under the header's seq, so a reader never sees them twice or not at
+ * all.
+ *
+ * Everything is in host byte order, and the layout doesn't depend on
+ * the call table, whose names are in the header.
+ */
+#define METRICS_MAGIC           0x4d4d5346      /* "FSMM" */
+#define METRICS_VERSION         1
+#define METRICS_MAX_CALLS       64
+#define METRICS_MAX_DEVICES     64
+#define METRICS_MAX_SLOTS       256
+#define METRICS_CALL_NAME_LEN   32
+#define METRICS_DEVICE_NAME_LEN 64
+
+struct metrics_call {
+        uint64_t mocked;
+        uint64_t passthrough;
+        uint64_t errors;
+        uint64_t total_ns;
+};
+
+struct metrics_device {
+        uint64_t reads;
+        uint64_t writes;
+        uint64_t read_bytes;
+        uint64_t write_bytes;
+        uint64_t errors;
+};
+
+struct metrics_slot {
+        uint32_t seq;
+        uint32_t tid;
+        struct metrics_call calls[METRICS_MAX_CALLS];
+        struct metrics_device devices[METRICS_MAX_DEVICES];
+} __attribute__((__aligned__(64)));
+
+struct metrics_header {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t reserved;
+        uint32_t pid;
+        uint32_t seq;
+        uint64_t start;
+        uint32_t nr_calls;
+        uint32_t nr_devices;
+        uint32_t nr_slots;
+        uint32_t max_slots;
+        char calls[METRICS_MAX_CALLS][METRICS_CALL_NAME_LEN];
+        char devices[METRICS_MAX_DEVICES][METRICS_DEVICE_NAME_LEN];
+} __attribute__((__aligned__(64)));
+
+#define METRICS_SIZE \
+        (sizeof(struct metrics_header) + \
+         METRICS_MAX_SLOTS * sizeof(struct metrics_slot))
+
+static inline struct metrics_slot *
+metrics_slots(struct metrics_header *header)
+{
+        return (struct metrics_slot *)(header + 1);
+}
+
+static inline void
+metrics_write_begin(uint32_t *seq)
+{
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+metrics_write_end(uint32_t *seq)
+{
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+extern struct metrics_header PRIVATE *metrics;
+
+extern int PRIVATE metrics_configure(void);
+extern int PRIVATE metrics_add_device(const char *name);
+extern void PRIVATE metrics_record_call(enum call_id call,
+                                        enum stats_path path,
+                                        uint64_t ns, bool failed);
+extern void PRIVATE metrics_record_io(int device, bool write, ssize_t ret);
+
+static inline bool
+metrics_enabled(void)
+{
+        return __builtin_expect(__atomic_load_n(&metrics, __ATOMIC_RELAXED) !=
+                                NULL, 0);
+}
+
+static inline void
+metrics_io(int device, bool write, ssize_t ret)
+{
+        if (metrics_enabled() && device >= 0)
+                metrics_record_io(device, write, ret);
+}
+
+#endif /* !FSMOCK_METRICS_H_ */
+// vim:fenc=utf-8:tw=75:et
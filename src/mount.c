@@ -19,12 +19,282 @@
 
 #include "fsmock.h"
 
-#include <sys/random.h>
-
+/*
+ * mounts_lock serializes everything that changes the mount table; lookups
+ * don't take it at all.  The list is only used by writers.
+ */
+static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
 static LIST_HEAD(mounts);
 
-#define CHECK_BYTE_INIT 0x6f
-static uint16_t fd_check_byte = CHECK_BYTE_INIT;
+/*
+ * The handle table is a two level array like the bfd table, so looking a
+ * handle up never takes a lock.  Each slot's generation goes up every
+ * time it's freed; it's only changed under mounts_lock.
+ */
+static struct mount **mount_handles[MOUNT_HANDLE_CHUNKS];
+static uint64_t *mount_generations[MOUNT_HANDLE_CHUNKS];
+static unsigned int mount_handles_hint;
+
+/*
+ * Mountpoints are also kept in a trie of path components, so finding the
+ * mount for a path is one walk down it, and "/dev/sda" can't match
+ * "/dev/sda1".  Each node's children are sorted so they can be binary
+ * searched.  Relative mountpoints get their own root.
+ *
+ * Nodes are never modified once they're reachable from a root.  Changing
+ * the table builds new copies of the nodes on the path to the mountpoint,
+ * sharing everything else, publishes the new root, and then frees the old
+ * path once no reader can still be looking at it.
+ */
+struct mount_node {
+        char *name;
+        size_t namelen;
+        struct mount *mount;
+        struct mount_node **children;
+        unsigned int nchildren;
+        struct mount_node *retired;
+};
+
+static struct mount_node *mount_roots[2];
+
+static inline struct mount_node **
+mount_root(const char *path)
+{
+        return &mount_roots[path[0] == '/'];
+}
+
+static inline int
+cmp_component(const struct mount_node *node, const char *name, size_t len)
+{
+        size_t n = node->namelen < len ? node->namelen : len;
+        int rc;
+
+        rc = memcmp(node->name, name, n);
+        if (rc)
+                return rc;
+        return (node->namelen > len) - (node->namelen < len);
+}
+
+/*
+ * Binary search node's children for name.  Sets *pos to where it is, or
+ * to where it would be inserted, and returns the child or NULL.
+ */
+static struct mount_node *
+find_child(const struct mount_node *node, const char *name, size_t len,
+           unsigned int *pos)
+{
+        unsigned int lo = 0, hi = node->nchildren;
+
+        while (lo < hi) {
+                unsigned int mid = lo + (hi - lo) / 2;
+                int rc = cmp_component(node->children[mid], name, len);
+
+                if (rc == 0) {
+                        lo = mid;
+                        break;
+                }
+                if (rc < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        if (pos)
+                *pos = lo;
+        if (lo < node->nchildren && !cmp_component(node->children[lo], name, len))
+                return node->children[lo];
+        return NULL;
+}
+
+static void
+free_node(struct mount_node *node)
+{
+        if (!node)
+                return;
+        free(node->name);
+        free(node->children);
+        free(node);
+}
+
+/*
+ * Build a copy of old (which may be NULL) with the mount at path relative
+ * to it set to mount (which may also be NULL).  The copy is returned in
+ * *newp, or NULL there if it turned out to be empty.  Every node that's
+ * been replaced goes on *retired.  Nothing can fail once the recursive
+ * call has succeeded, so on error nothing has been retired.
+ */
+static int
+rebuild_node(struct mount_node *old, const char *name, size_t len,
+             const char *path, struct mount *mount, bool root,
+             struct mount_node **newp, struct mount_node **retired)
+{
+        struct mount_node *node;
+        unsigned int n = old ? old->nchildren : 0;
+        const char *cname;
+        size_t clen;
+
+        node = calloc(1, sizeof(*node));
+        if (!node)
+                return -1;
+
+        if (name) {
+                node->name = strndup(name, len);
+                if (!node->name)
+                        goto err;
+                node->namelen = len;
+        }
+        node->children = calloc(n + 1, sizeof(*node->children));
+        if (!node->children)
+                goto err;
+        if (n)
+                memcpy(node->children, old->children, sizeof(*node->children) * n);
+        node->nchildren = n;
+        node->mount = old ? old->mount : NULL;
+
+        cname = next_component(&path, &clen);
+        if (!cname) {
+                node->mount = mount;
+        } else {
+                struct mount_node *child = NULL, *newchild = NULL;
+                unsigned int pos = 0;
+
+                if (old)
+                        child = find_child(old, cname, clen, &pos);
+                if (rebuild_node(child, cname, clen, path, mount, false,
+                                 &newchild, retired) < 0)
+                        goto err;
+
+                if (child && newchild) {
+                        node->children[pos] = newchild;
+                } else if (child) {
+                        memmove(&node->children[pos], &node->children[pos + 1],
+                                sizeof(*node->children) * (n - pos - 1));
+                        node->nchildren -= 1;
+                } else if (newchild) {
+                        memmove(&node->children[pos + 1], &node->children[pos],
+                                sizeof(*node->children) * (n - pos));
+                        node->children[pos] = newchild;
+                        node->nchildren += 1;
+                }
+        }
+
+        if (!root && !node->mount && !node->nchildren) {
+                free_node(node);
+                node = NULL;
+        }
+        if (old) {
+                old->retired = *retired;
+                *retired = old;
+        }
+        *newp = node;
+        return 0;
+err:
+        free_node(node);
+        return -1;
+}
+
+/*
+ * Make mount the one lookups find at mountpoint, or if mount is NULL,
+ * make there be none.  The nodes it replaces go on *retired, for
+ * reclaim_nodes() once the caller has dropped mounts_lock.  Called with
+ * mounts_lock held.
+ */
+static int
+publish_mount(const char *mountpoint, struct mount *mount,
+              struct mount_node **retired)
+{
+        struct mount_node **rootp = mount_root(mountpoint);
+        struct mount_node *root = NULL;
+
+        if (rebuild_node(*rootp, NULL, 0, mountpoint, mount, true,
+                         &root, retired) < 0)
+                return -1;
+
+        rcu_assign_pointer(*rootp, root);
+        pathcache_invalidate();
+
+        return 0;
+}
+
+/*
+ * Free what publish_mount() retired, once no lookup can still be using
+ * it.  This waits for a grace period, so it's called without
+ * mounts_lock, and other changes to the table don't wait too.
+ */
+static void
+reclaim_nodes(struct mount_node *retired)
+{
+        synchronize_rcu();
+
+        while (retired) {
+                struct mount_node *node = retired;
+
+                retired = node->retired;
+                free_node(node);
+        }
+}
+
+/*
+ * Give mount a handle.  Called with mounts_lock held.
+ */
+static int
+alloc_handle(struct mount *mount)
+{
+        errno = ENOMEM;
+        for (unsigned int n = 0; n <= MOUNT_HANDLE_INDEX_MASK; n++) {
+                unsigned int idx = (mount_handles_hint + n) & MOUNT_HANDLE_INDEX_MASK;
+                unsigned int c = idx / MOUNT_HANDLES_PER_CHUNK;
+                struct mount **chunk;
+                uint64_t generation;
+
+                /*
+                 * Slot 0 is never used, so 0 is never a valid handle.
+                 */
+                if (idx == 0)
+                        continue;
+
+                if (!mount_generations[c]) {
+                        mount_generations[c] = calloc(MOUNT_HANDLES_PER_CHUNK,
+                                                      sizeof(uint64_t));
+                        if (!mount_generations[c])
+                                return -1;
+                }
+                chunk = mount_handles[c];
+                if (!chunk) {
+                        chunk = calloc(MOUNT_HANDLES_PER_CHUNK, sizeof(*chunk));
+                        if (!chunk)
+                                return -1;
+                        __atomic_store_n(&mount_handles[c], chunk,
+                                         __ATOMIC_RELEASE);
+                }
+                if (chunk[idx % MOUNT_HANDLES_PER_CHUNK])
+                        continue;
+
+                generation = mount_generations[c][idx % MOUNT_HANDLES_PER_CHUNK];
+                mount->handle = (generation << MOUNT_HANDLE_INDEX_BITS) | idx;
+                __atomic_store_n(&chunk[idx % MOUNT_HANDLES_PER_CHUNK], mount,
+                                 __ATOMIC_RELEASE);
+                mount_handles_hint = idx + 1;
+                return 0;
+        }
+        return -1;
+}
+
+/*
+ * Take mount's handle away.  Readers may still find it until the next
+ * grace period.  Called with mounts_lock held.
+ */
+static void
+free_handle(struct mount *mount)
+{
+        unsigned int idx = mount->handle & MOUNT_HANDLE_INDEX_MASK;
+        unsigned int c = idx / MOUNT_HANDLES_PER_CHUNK;
+
+        __atomic_store_n(&mount_handles[c][idx % MOUNT_HANDLES_PER_CHUNK], NULL,
+                         __ATOMIC_RELEASE);
+        mount_generations[c][idx % MOUNT_HANDLES_PER_CHUNK] += 1;
+        if (idx < mount_handles_hint)
+                mount_handles_hint = idx;
+}
 
 static void
 free_mount(struct mount *mount)
@@ -35,26 +305,26 @@ free_mount(struct mount *mount)
         if (mount->mountpoint)
                 free(mount->mountpoint);
 
-        if (mount->list)
-                list_del(mount->list);
+        blkdev_put(mount->dev);
 
         memset(mount, 0, sizeof(*mount));
 
         free(mount);
-
-        if (list_empty(&mounts))
-                fd_check_byte = CHECK_BYTE_INIT;
 }
 
 int PUBLIC
 fsmock_mount(const char *mountpoint, struct fsmock_io *io)
 {
         struct mount *mount = NULL;
+        struct mount_node *retired = NULL;
         int error;
 
+        config_load();
+
         mount = calloc(1, sizeof (*mount));
         if (!mount)
                 goto err;
+        INIT_LIST_HEAD(&mount->list);
 
         mount->mountpoint = strdup(mountpoint);
         if (!mount->mountpoint)
@@ -62,17 +332,25 @@ fsmock_mount(const char *mountpoint, struct fsmock_io *io)
 
         mount->io = io;
 
-        error = getrandom(&mount->fd_xor_cookie, sizeof(mount->fd_xor_cookie), 0);
-        if (error < 0)
+        mount->dev = blkdev_new(mountpoint);
+        if (!mount->dev)
                 goto err;
 
-        mount->fd_check_byte = ++fd_check_byte;
-        if (fd_check_byte > 0xff) {
-                errno = ENOMEM;
+        pthread_mutex_lock(&mounts_lock);
+        if (alloc_handle(mount) < 0) {
+                pthread_mutex_unlock(&mounts_lock);
+                goto err;
+        }
+
+        if (publish_mount(mountpoint, mount, &retired) < 0) {
+                free_handle(mount);
+                pthread_mutex_unlock(&mounts_lock);
                 goto err;
         }
+        list_add_tail(&mount->list, &mounts);
+        pthread_mutex_unlock(&mounts_lock);
 
-        list_add_tail(mount->list, &mounts);
+        reclaim_nodes(retired);
 
         return 0;
 err:
@@ -82,41 +360,169 @@ err:
         return -1;
 }
 
-int PUBLIC
-fsmock_umount(const char *mountpoint)
+/*
+ * Find the newest mount on exactly mountpoint, skipping "skip".  Called
+ * with mounts_lock held.
+ */
+static struct mount *
+find_mount(const char *mountpoint, struct mount *skip)
 {
         struct list_head *this;
-        struct mount *mount = NULL;
+        struct mount *mount;
 
         list_reverse_for_each(this, &mounts) {
                 mount = list_entry(this, struct mount, list);
-                if (!strcmp(mountpoint, mount->mountpoint))
-                        break;
-                mount = NULL;
+                if (mount != skip && !strcmp(mountpoint, mount->mountpoint))
+                        return mount;
         }
 
+        errno = ENOENT;
+        return NULL;
+}
+
+int PUBLIC
+fsmock_umount(const char *mountpoint)
+{
+        struct mount *mount;
+        struct mount_node *retired = NULL;
+
+        pthread_mutex_lock(&mounts_lock);
+        mount = find_mount(mountpoint, NULL);
         if (!mount) {
-                errno = ENOENT;
+                pthread_mutex_unlock(&mounts_lock);
                 return -1;
         }
 
+        /*
+         * If another mount is stacked on the same mountpoint, the newest
+         * one of those takes this one's place.  The handle goes first, so
+         * the grace period in reclaim_nodes() covers it too.
+         */
+        free_handle(mount);
+        if (publish_mount(mountpoint, find_mount(mountpoint, mount),
+                          &retired) < 0) {
+                alloc_handle(mount);
+                pthread_mutex_unlock(&mounts_lock);
+                return -1;
+        }
+        list_del(&mount->list);
+        pthread_mutex_unlock(&mounts_lock);
+
+        reclaim_nodes(retired);
         free_mount(mount);
 
         return 0;
 }
 
+/*
+ * Get a reference to the device mounted on exactly mountpoint.
+ */
+static struct blkdev *
+get_mount_dev(const char *mountpoint)
+{
+        struct mount *mount;
+        struct blkdev *dev = NULL;
+
+        pthread_mutex_lock(&mounts_lock);
+        mount = find_mount(mountpoint, NULL);
+        if (mount)
+                dev = blkdev_get(mount->dev);
+        pthread_mutex_unlock(&mounts_lock);
+
+        return dev;
+}
+
+int PUBLIC
+fsmock_checkpoint(const char *mountpoint)
+{
+        struct blkdev *dev;
+        int ret;
+
+        dev = get_mount_dev(mountpoint);
+        if (!dev)
+                return -1;
+
+        ret = blkdev_checkpoint(dev);
+        blkdev_put(dev);
+        return ret;
+}
+
+int PUBLIC
+fsmock_rollback(const char *mountpoint, int checkpoint)
+{
+        struct blkdev *dev;
+        int ret;
+
+        dev = get_mount_dev(mountpoint);
+        if (!dev)
+                return -1;
+
+        ret = blkdev_rollback(dev, checkpoint);
+        blkdev_put(dev);
+        return ret;
+}
+
+int PUBLIC
+fsmock_checkpoint_release(const char *mountpoint, int checkpoint)
+{
+        struct blkdev *dev;
+        int ret;
+
+        dev = get_mount_dev(mountpoint);
+        if (!dev)
+                return -1;
+
+        ret = blkdev_release(dev, checkpoint);
+        blkdev_put(dev);
+        return ret;
+}
+
+/*
+ * Find the mount with the longest mountpoint that's a whole-component
+ * prefix of pathname.  This must be called inside rcu_read_lock(), and
+ * the result may only be used until the matching rcu_read_unlock().
+ */
 struct mount PRIVATE *
 get_mount(const char *pathname)
 {
-        struct list_head *this;
-        struct mount *mount = NULL;
+        struct mount_node *node = rcu_dereference(*mount_root(pathname));
+        struct mount *mount;
+        const char *name;
+        size_t len;
 
-        list_reverse_for_each(this, &mounts) {
-                mount = list_entry(this, struct mount, list);
-                if (!strncmp(mount->mountpoint, pathname, strlen(mount->mountpoint)))
-                        return mount;
+        probe(get_mount_entry, pathname);
+        if (!node)
+                return probe_return(get_mount_return, (struct mount *)NULL);
+
+        mount = node->mount;
+        while ((name = next_component(&pathname, &len))) {
+                node = find_child(node, name, len, NULL);
+                if (!node)
+                        break;
+                if (node->mount)
+                        mount = node->mount;
         }
-        return NULL;
+        return probe_return(get_mount_return, mount);
+}
+
+/*
+ * Find the mount with this handle, if it's still mounted.
+ */
+struct mount PRIVATE *
+get_mount_by_handle(uint64_t handle)
+{
+        unsigned int idx = handle & MOUNT_HANDLE_INDEX_MASK;
+        struct mount **chunk;
+        struct mount *mount;
+
+        chunk = __atomic_load_n(&mount_handles[idx / MOUNT_HANDLES_PER_CHUNK],
+                                __ATOMIC_ACQUIRE);
+        if (!chunk)
+                return NULL;
+        mount = rcu_dereference(chunk[idx % MOUNT_HANDLES_PER_CHUNK]);
+        if (!mount || mount->handle != handle)
+                return NULL;
+        return mount;
 }
 
 // vim:fenc=utf-8:tw=75:et
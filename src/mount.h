@@ -22,15 +22,33 @@
 
 #include "fsmock.h"
 
+/*
+ * A mount handle is an index into the handle table in the low bits, and
+ * the generation of that slot in the high ones, so a stale handle for a
+ * slot that's been reused won't find the new mount.  Handles are 64 bits
+ * so the generation doesn't wrap in any realistic number of mounts of
+ * one slot.  Slot 0 is never used, so 0 is never a valid handle.
+ */
+#define MOUNT_HANDLE_INDEX_BITS 20
+#define MOUNT_HANDLE_INDEX_MASK ((1U << MOUNT_HANDLE_INDEX_BITS) - 1)
+#define MOUNT_HANDLES_PER_CHUNK 1024
+#define MOUNT_HANDLE_CHUNKS     ((MOUNT_HANDLE_INDEX_MASK + 1) / MOUNT_HANDLES_PER_CHUNK)
+
 struct mount {
         char *mountpoint;
         struct fsmock_io *io;
-        int fd_xor_cookie;
-        uint16_t fd_check_byte;
-        struct list_head *list;
+        uint64_t handle;
+        struct blkdev *dev;
+        struct list_head list;
 };
 
+/*
+ * get_mount() and get_mount_by_handle() must be called inside
+ * rcu_read_lock(), and what they return is only good until
+ * rcu_read_unlock().
+ */
 struct mount PRIVATE *get_mount(const char *pathname);
+struct mount PRIVATE *get_mount_by_handle(uint64_t handle);
 
 #endif /* !MOUNT_H_ */
 // vim:fenc=utf-8:tw=75:et
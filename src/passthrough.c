@@ -0,0 +1,268 @@
+/*
+ * passthrough.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <stdarg.h>
+#include <sys/syscall.h>
+
+/*
+ * Passing calls straight to the kernel.  These stand in for the libc_*
+ * functions that are thin wrappers around a single syscall, so in this
+ * mode nothing has to be loaded or looked up for them at all, and errno
+ * is ours rather than another libc's.
+ */
+static int
+sys_access(const char *pathname, int mode)
+{
+        return syscall(SYS_faccessat, AT_FDCWD, pathname, mode);
+}
+
+static int
+sys_faccessat(int dirfd, const char *pathname, int mode, int flags)
+{
+        if (!flags)
+                return syscall(SYS_faccessat, dirfd, pathname, mode);
+#ifdef SYS_faccessat2
+        return syscall(SYS_faccessat2, dirfd, pathname, mode, flags);
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+}
+
+static int
+sys_close(int fd)
+{
+        return syscall(SYS_close, fd);
+}
+
+static int
+sys_close_range(unsigned int first, unsigned int last, int flags)
+{
+#ifdef SYS_close_range
+        return syscall(SYS_close_range, first, last, flags);
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+}
+
+static int
+sys_dup(int oldfd)
+{
+        return syscall(SYS_dup, oldfd);
+}
+
+static int
+sys_dup3(int oldfd, int newfd, int flags)
+{
+        return syscall(SYS_dup3, oldfd, newfd, flags);
+}
+
+static int
+sys_fcntl(int fd, int cmd, ...)
+{
+        unsigned long arg = get_arg(cmd, unsigned long);
+
+        return syscall(SYS_fcntl, fd, cmd, arg);
+}
+
+static ssize_t
+sys_getxattr(const char *path, const char *name, void *value, size_t size)
+{
+        return syscall(SYS_getxattr, path, name, value, size);
+}
+
+static int
+sys_ioctl(int fd, unsigned long request, ...)
+{
+        unsigned long arg = get_arg(request, unsigned long);
+
+        return syscall(SYS_ioctl, fd, request, arg);
+}
+
+static off_t
+sys_lseek(int fd, off_t offset, int whence)
+{
+        return syscall(SYS_lseek, fd, offset, whence);
+}
+
+static int
+sys_openat(int dirfd, const char *pathname, int flags, ...)
+{
+        mode_t mode = 0;
+
+        if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+                mode = get_arg(flags, mode_t);
+
+        return syscall(SYS_openat, dirfd, pathname, flags | O_LARGEFILE, mode);
+}
+
+static int
+sys_open(const char *pathname, int flags, ...)
+{
+        mode_t mode = 0;
+
+        if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+                mode = get_arg(flags, mode_t);
+
+        return sys_openat(AT_FDCWD, pathname, flags, mode);
+}
+
+static ssize_t
+sys_pread(int fd, void *buf, size_t count, off_t offset)
+{
+        return syscall(SYS_pread64, fd, buf, count, offset);
+}
+
+static ssize_t
+sys_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+        return syscall(SYS_pwrite64, fd, buf, count, offset);
+}
+
+/*
+ * The vectored ones take the offset split into two longs, low half
+ * first, whatever the word size is.
+ */
+#define sys_pos(offset) \
+        (unsigned long)(offset), (unsigned long)((uint64_t)(offset) >> 32)
+
+static ssize_t
+sys_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+        return syscall(SYS_preadv, fd, iov, iovcnt, sys_pos(offset));
+}
+
+static ssize_t
+sys_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+        return syscall(SYS_pwritev, fd, iov, iovcnt, sys_pos(offset));
+}
+
+static ssize_t
+sys_preadv2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+            int flags)
+{
+        return syscall(SYS_preadv2, fd, iov, iovcnt, sys_pos(offset), flags);
+}
+
+static ssize_t
+sys_pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+             int flags)
+{
+        return syscall(SYS_pwritev2, fd, iov, iovcnt, sys_pos(offset), flags);
+}
+
+static ssize_t
+sys_read(int fd, void *buf, size_t count)
+{
+        return syscall(SYS_read, fd, buf, count);
+}
+
+static ssize_t
+sys_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+        return syscall(SYS_readv, fd, iov, iovcnt);
+}
+
+static ssize_t
+sys_readlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz)
+{
+        return syscall(SYS_readlinkat, dirfd, pathname, buf, bufsiz);
+}
+
+static ssize_t
+sys_readlink(const char *pathname, char *buf, size_t bufsiz)
+{
+        return sys_readlinkat(AT_FDCWD, pathname, buf, bufsiz);
+}
+
+static int
+sys_socket(int domain, int type, int protocol)
+{
+        return syscall(SYS_socket, domain, type, protocol);
+}
+
+static ssize_t
+sys_write(int fd, const void *buf, size_t count)
+{
+        return syscall(SYS_write, fd, buf, count);
+}
+
+static ssize_t
+sys_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+        return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+/*
+ * The kernel's struct stat isn't libc's on every architecture, so this
+ * one goes through fstatat(), which we don't wrap.
+ */
+static int
+sys_stat(const char *pathname, struct stat *statbuf)
+{
+        return fstatat(AT_FDCWD, pathname, statbuf, 0);
+}
+
+void PRIVATE
+passthrough_use_syscalls(void)
+{
+        libc_access = sys_access;
+        libc_close = sys_close;
+        libc_close_range = sys_close_range;
+        libc_dup = sys_dup;
+        libc_dup3 = sys_dup3;
+        libc_faccessat = sys_faccessat;
+        libc_fcntl = sys_fcntl;
+        libc_getxattr = sys_getxattr;
+        libc_ioctl = sys_ioctl;
+        libc_lseek = sys_lseek;
+        libc_open = sys_open;
+        libc_openat = sys_openat;
+        libc_pread = sys_pread;
+        libc_preadv = sys_preadv;
+        libc_preadv2 = sys_preadv2;
+        libc_pwrite = sys_pwrite;
+        libc_pwritev = sys_pwritev;
+        libc_pwritev2 = sys_pwritev2;
+        libc_read = sys_read;
+        libc_readlink = sys_readlink;
+        libc_readlinkat = sys_readlinkat;
+        libc_readv = sys_readv;
+        libc_socket = sys_socket;
+        libc_stat = sys_stat;
+        libc_write = sys_write;
+        libc_writev = sys_writev;
+}
+
+/*
+ * Whatever the libc we're calling is too old to have goes straight to
+ * the kernel.
+ */
+void PRIVATE
+passthrough_fill_in(void)
+{
+        if (!libc_close_range)
+                libc_close_range = sys_close_range;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,399 @@
+/*
+ * pathcache.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static struct pathcache_entry *pathcache[PATHCACHE_SIZE];
+static unsigned long pathcache_generation;
+
+/*
+ * pathcache_lock serializes filling the cache; retired entries wait on
+ * pathcache_retired until there are enough of them to be worth a grace
+ * period.  Whoever retires the last one of a batch takes the batch and
+ * waits out the grace period after dropping the lock, so nobody else
+ * filling the cache waits with it.
+ */
+static pthread_mutex_t pathcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pathcache_entry *pathcache_retired;
+static unsigned int pathcache_nretired;
+
+/*
+ * FNV-1a
+ */
+static inline uint64_t
+hash_path(const char *path, size_t *lenp)
+{
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        const char *s;
+
+        for (s = path; *s; s++) {
+                hash ^= (uint8_t)*s;
+                hash *= 0x100000001b3ULL;
+        }
+        *lenp = s - path;
+        return hash;
+}
+
+static inline struct pathcache_entry **
+pathcache_slot(uint64_t hash)
+{
+        return &pathcache[(hash ^ (hash >> 32)) & (PATHCACHE_SIZE - 1)];
+}
+
+/*
+ * Normalize an absolute path without looking at the filesystem: collapse
+ * repeated slashes and drop "." components and trailing slashes.  ".."
+ * can't be resolved without knowing which components are symlinks, so
+ * paths with it in them fail with EINVAL, as do relative paths.
+ */
+static int
+normalize_path(const char *path, char *buf, size_t size)
+{
+        const char *name;
+        size_t len, pos = 0;
+
+        if (path[0] != '/') {
+                errno = EINVAL;
+                return -1;
+        }
+
+        while ((name = next_component(&path, &len))) {
+                if (len == 1 && name[0] == '.')
+                        continue;
+                if (len == 2 && name[0] == '.' && name[1] == '.') {
+                        errno = EINVAL;
+                        return -1;
+                }
+                if (pos + 1 + len >= size) {
+                        errno = ENAMETOOLONG;
+                        return -1;
+                }
+                buf[pos++] = '/';
+                memcpy(buf + pos, name, len);
+                pos += len;
+        }
+        if (pos == 0)
+                buf[pos++] = '/';
+        buf[pos] = '\0';
+        return 0;
+}
+
+static inline bool
+has_fixed_prefix(const char *path)
+{
+        return startswith(path, "/dev/")
+               || startswith(path, "/sys/")
+               || startswith(path, "/proc/");
+}
+
+/*
+ * Could this normalized path possibly be one of ours?  Anything that
+ * isn't under one of the fixed prefixes or a mountpoint can't be.  The
+ * mount trie is already a prefix automaton over the mountpoints, so this
+ * is one walk down it.
+ */
+static bool
+may_be_ours(const char *normal)
+{
+        bool ret;
+
+        if (has_fixed_prefix(normal))
+                return true;
+
+        rcu_read_lock();
+        ret = get_mount(normal) != NULL;
+        rcu_read_unlock();
+        return ret;
+}
+
+/*
+ * Drop the last component from the path in buf, which is *lenp long.
+ */
+static inline void
+drop_component(char *buf, size_t *lenp)
+{
+        size_t len = *lenp;
+
+        while (len && buf[len - 1] != '/')
+                len--;
+        if (len)
+                len--;
+        buf[len] = '\0';
+        *lenp = len;
+}
+
+/*
+ * Like realpath(), but following the symlinks in our root directory
+ * rather than the host's, with absolute link targets taken relative to
+ * it as well.  Once a component isn't there, the rest of the path is
+ * taken as it is.
+ */
+static int
+resolve_mock_path(const char *path, char *real, size_t size)
+{
+        char rest[PATH_MAX];
+        char link[PATH_MAX];
+        const char *p = rest;
+        const char *name;
+        size_t len = 0, restlen;
+        bool resolving = true;
+        int nlinks = 0;
+
+        restlen = strlen(path);
+        if (restlen >= sizeof(rest)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        memcpy(rest, path, restlen + 1);
+        real[0] = '\0';
+
+        while ((name = next_component(&p, &restlen))) {
+                ssize_t n;
+
+                if (restlen == 1 && name[0] == '.')
+                        continue;
+                if (restlen == 2 && name[0] == '.' && name[1] == '.') {
+                        drop_component(real, &len);
+                        continue;
+                }
+                if (len + 1 + restlen >= size) {
+                        errno = ENAMETOOLONG;
+                        return -1;
+                }
+                real[len++] = '/';
+                memcpy(real + len, name, restlen);
+                len += restlen;
+                real[len] = '\0';
+
+                if (!resolving)
+                        continue;
+                /*
+                 * readlinkat() is one of ours, and libc_readlinkat()
+                 * sets the other libc's errno, so go straight to the
+                 * kernel.
+                 */
+                n = syscall(SYS_readlinkat, rootfd, real + 1, link,
+                            sizeof(link));
+                if (n < 0) {
+                        if (errno != EINVAL)
+                                resolving = false;
+                        continue;
+                }
+                if ((size_t)n >= sizeof(link)) {
+                        errno = ENAMETOOLONG;
+                        return -1;
+                }
+                if (++nlinks > MAXSYMLINKS) {
+                        errno = ELOOP;
+                        return -1;
+                }
+
+                /*
+                 * Splice the link target in front of whatever's left,
+                 * and carry on from there.
+                 */
+                restlen = strlen(p);
+                if ((size_t)n + restlen >= sizeof(rest)) {
+                        errno = ENAMETOOLONG;
+                        return -1;
+                }
+                memmove(rest + n, p, restlen + 1);
+                memcpy(rest, link, n);
+                p = rest;
+
+                if (link[0] == '/') {
+                        len = 0;
+                        real[0] = '\0';
+                } else {
+                        drop_component(real, &len);
+                }
+        }
+
+        if (len == 0) {
+                real[0] = '/';
+                real[1] = '\0';
+        }
+        return 0;
+}
+
+/*
+ * Work out the answer the slow way.  If we've got a root directory, the
+ * path is resolved and looked up in it; otherwise it's the host's.
+ */
+static void
+classify_path_uncached(const char *pathname, struct path_class *pc,
+                       char *real)
+{
+        struct mount *mount;
+        struct stat sb;
+        int rc;
+
+        memset(pc, 0, sizeof(*pc));
+        memset(&sb, 0, sizeof(sb));
+
+        /*
+         * Not stat(), since that's our own wrapper.
+         */
+        if (rootfd >= 0) {
+                if (resolve_mock_path(pathname, real, PATH_MAX) < 0)
+                        return;
+                rc = fstatat(rootfd, real[1] ? real + 1 : ".", &sb,
+                             AT_SYMLINK_NOFOLLOW);
+                pc->exists = rc == 0;
+        } else {
+                if (realpath(pathname, real) == NULL)
+                        return;
+                rc = fstatat(AT_FDCWD, real, &sb, 0);
+                pc->exists = true;
+        }
+        if (rc == 0)
+                pc->st_mode = sb.st_mode;
+
+        pc->ours = has_fixed_prefix(real);
+
+        rcu_read_lock();
+        mount = get_mount(real);
+        if (mount) {
+                pc->mocked = true;
+                pc->mount = mount->handle;
+        }
+        rcu_read_unlock();
+}
+
+/*
+ * Put the answer for pathname in the cache, replacing whatever was in
+ * its slot.  If we can't allocate memory, we just don't cache it.
+ */
+static void
+pathcache_insert(const char *pathname, size_t len, uint64_t hash,
+                 unsigned long generation, const struct path_class *pc,
+                 const char *real)
+{
+        struct pathcache_entry *entry, *old, *retired = NULL;
+        size_t reallen = pc->exists ? strlen(real) : 0;
+
+        entry = malloc(sizeof(*entry) + len + 1 + reallen + 1);
+        if (!entry)
+                return;
+        entry->hash = hash;
+        entry->generation = generation;
+        entry->class = *pc;
+        memcpy(entry->path, pathname, len + 1);
+        entry->canonical = entry->path + len + 1;
+        if (pc->exists)
+                memcpy(entry->canonical, real, reallen + 1);
+        else
+                entry->canonical[0] = '\0';
+
+        pthread_mutex_lock(&pathcache_lock);
+        old = __atomic_exchange_n(pathcache_slot(hash), entry, __ATOMIC_RELEASE);
+        if (old) {
+                old->retired = pathcache_retired;
+                pathcache_retired = old;
+                pathcache_nretired += 1;
+        }
+        if (pathcache_nretired >= PATHCACHE_RETIRE_BATCH) {
+                retired = pathcache_retired;
+                pathcache_retired = NULL;
+                pathcache_nretired = 0;
+        }
+        pthread_mutex_unlock(&pathcache_lock);
+
+        if (retired)
+                synchronize_rcu();
+        while (retired) {
+                old = retired;
+                retired = old->retired;
+                free(old);
+        }
+}
+
+/*
+ * Classify pathname.  Absolute paths are normalized first, and if that
+ * shows they can't be ours, that's the answer, without any syscalls or
+ * even a cache lookup.  Relative paths depend on the working directory,
+ * so they aren't cached.
+ */
+void PRIVATE
+classify_path(const char *pathname, struct path_class *pc)
+{
+        char normal[PATH_MAX];
+        char real[PATH_MAX];
+        struct pathcache_entry *entry;
+        unsigned long generation;
+        uint64_t hash;
+        size_t len;
+        bool hit = false;
+
+        if (pathname[0] != '/') {
+                classify_path_uncached(pathname, pc, real);
+                return;
+        }
+
+        if (normalize_path(pathname, normal, sizeof(normal)) == 0) {
+                if (!may_be_ours(normal)) {
+                        memset(pc, 0, sizeof(*pc));
+                        return;
+                }
+                pathname = normal;
+        }
+
+        hash = hash_path(pathname, &len);
+        generation = __atomic_load_n(&pathcache_generation, __ATOMIC_ACQUIRE);
+
+        rcu_read_lock();
+        entry = rcu_dereference(*pathcache_slot(hash));
+        if (entry && entry->hash == hash && entry->generation == generation
+            && !strcmp(entry->path, pathname)) {
+                *pc = entry->class;
+                hit = true;
+        }
+        rcu_read_unlock();
+        if (hit)
+                return;
+
+        classify_path_uncached(pathname, pc, real);
+        pathcache_insert(pathname, len, hash, generation, pc, real);
+}
+
+bool PRIVATE
+is_our_path(const char *pathname)
+{
+        struct path_class pc;
+
+        probe(is_our_path_entry, pathname);
+        classify_path(pathname, &pc);
+        return probe_return(is_our_path_return, pc.ours);
+}
+
+/*
+ * Called whenever the mount table changes.  Stale entries stay where they
+ * are until something replaces them; they just never match.
+ */
+void PRIVATE
+pathcache_invalidate(void)
+{
+        __atomic_add_fetch(&pathcache_generation, 1, __ATOMIC_RELEASE);
+}
+
+// vim:fenc=utf-8:tw=75:et
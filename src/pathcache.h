@@ -0,0 +1,75 @@
+/*
+ * pathcache.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_PATHCACHE_H_
+#define FSMOCK_PATHCACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Most paths a program opens obviously aren't ours: anything that isn't
+ * under /dev, /sys, /proc, or a mountpoint once it's been normalized is
+ * turned away before we even look in the cache.
+ *
+ * Deciding about the rest means resolving symlinks in our root
+ * directory, which is one syscall per path component, and programs tend
+ * to open the same few paths over and over.  So the answer for each
+ * absolute path we've been asked about is kept in a small direct-mapped
+ * hash table.  Paths that don't resolve are cached too.
+ *
+ * Entries are never modified once they're in the table; lookups only
+ * need rcu_read_lock(), and replaced entries are freed in batches after
+ * a grace period.  Anything cached before the last mount or umount is
+ * treated as a miss.
+ */
+#define PATHCACHE_SHIFT         10
+#define PATHCACHE_SIZE          (1U << PATHCACHE_SHIFT)
+#define PATHCACHE_RETIRE_BATCH  64
+
+/*
+ * Paths that are turned away without any lookups are all false here,
+ * whether they exist or not.  If the path is mocked, mount is the handle
+ * of the mount it resolved to, which is what should be opened; the path
+ * itself may have gone through symlinks or be spelled differently.
+ */
+struct path_class {
+        bool exists;
+        bool ours;
+        bool mocked;
+        mode_t st_mode;
+        uint64_t mount;
+};
+
+struct pathcache_entry {
+        uint64_t hash;
+        unsigned long generation;
+        struct path_class class;
+        struct pathcache_entry *retired;
+        char *canonical;
+        char path[];
+};
+
+extern void PRIVATE classify_path(const char *pathname, struct path_class *pc);
+extern bool PRIVATE is_our_path(const char *pathname);
+extern void PRIVATE pathcache_invalidate(void);
+
+#endif /* !FSMOCK_PATHCACHE_H_ */
+// vim:fenc=utf-8:tw=75:et
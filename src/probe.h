@@ -0,0 +1,128 @@
+/*
+ * probe.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_PROBE_H_
+#define FSMOCK_PROBE_H_
+
+/*
+ * Static probe points, in the same form SystemTap's <sys/sdt.h> makes,
+ * so perf, bpftrace and stap can attach to them as fsmock:<name>.  Each
+ * one is a nop in the code and an entry in the .note.stapsdt section
+ * saying where the nop is and where to find its arguments; a tool that
+ * attaches turns the nop into a breakpoint.  There's nothing to link
+ * against and nothing happens at run time, so we don't need the systemtap
+ * headers to build.
+ *
+ * Build with -DFSMOCK_NO_PROBES to leave them out altogether.
+ */
+#if defined(__ELF__) && !defined(FSMOCK_NO_PROBES)
+
+#if defined(__LP64__)
+#define PROBE_ADDR ".8byte"
+#else
+#define PROBE_ADDR ".4byte"
+#endif
+
+/*
+ * How each argument is described: its size in bytes, negative if it's
+ * signed, and then wherever the compiler put it.  Pointers are unsigned
+ * and word sized.
+ */
+#define probe_argptr(x) (__builtin_classify_type(x) == 5 ||             \
+                         __builtin_classify_type(x) == 14)
+#define probe_argsize(x) (probe_argptr(x) ? sizeof(void *) : sizeof(x))
+#define probe_argsigned(x) (!probe_argptr(x) &&                         \
+                            ((__typeof__(x))-1 < (__typeof__(x))1))
+#define probe_arg(n, x)                                                 \
+        [probe_s ## n] "n" ((probe_argsigned(x) ? 1 : -1) *             \
+                            (int)probe_argsize(x)),                     \
+        [probe_a ## n] "nor" (x)
+#define probe_fmt(n) "%n[probe_s" #n "]@%[probe_a" #n "]"
+
+#define probe_asm(name, args, ...)                                      \
+        __asm__ __volatile__(                                           \
+                "990: nop\n"                                            \
+                ".pushsection .note.stapsdt,\"?\",\"note\"\n"           \
+                ".balign 4\n"                                           \
+                ".4byte 992f-991f, 994f-993f, 3\n"                      \
+                "991: .asciz \"stapsdt\"\n"                             \
+                "992: .balign 4\n"                                      \
+                "993: " PROBE_ADDR " 990b\n"                            \
+                PROBE_ADDR " _.stapsdt.base\n"                          \
+                PROBE_ADDR " 0\n"                                       \
+                ".asciz \"fsmock\"\n"                                   \
+                ".asciz \"" #name "\"\n"                                \
+                ".asciz \"" args "\"\n"                                 \
+                "994: .balign 4\n"                                      \
+                ".popsection\n"                                         \
+                ".ifndef _.stapsdt.base\n"                              \
+                ".pushsection .stapsdt.base,\"aG\",\"progbits\","       \
+                        ".stapsdt.base,comdat\n"                        \
+                ".weak _.stapsdt.base\n"                                \
+                ".hidden _.stapsdt.base\n"                              \
+                "_.stapsdt.base: .space 1\n"                            \
+                ".size _.stapsdt.base, 1\n"                             \
+                ".popsection\n"                                         \
+                ".endif\n"                                              \
+                :: __VA_ARGS__)
+
+#define probe_1(name, a)                                                \
+        probe_asm(name, probe_fmt(1), probe_arg(1, a))
+#define probe_2(name, a, b)                                             \
+        probe_asm(name, probe_fmt(1) " " probe_fmt(2),                  \
+                  probe_arg(1, a), probe_arg(2, b))
+#define probe_3(name, a, b, c)                                          \
+        probe_asm(name, probe_fmt(1) " " probe_fmt(2) " " probe_fmt(3), \
+                  probe_arg(1, a), probe_arg(2, b), probe_arg(3, c))
+#define probe_4(name, a, b, c, d)                                       \
+        probe_asm(name, probe_fmt(1) " " probe_fmt(2) " " probe_fmt(3)  \
+                  " " probe_fmt(4),                                     \
+                  probe_arg(1, a), probe_arg(2, b), probe_arg(3, c),    \
+                  probe_arg(4, d))
+
+#define probe_nargs_(_1, _2, _3, _4, n, ...) n
+#define probe_nargs(...) probe_nargs_(__VA_ARGS__, 4, 3, 2, 1, 0)
+#define probe__(n, name, ...) probe_ ## n(name, __VA_ARGS__)
+#define probe_(n, name, ...) probe__(n, name, __VA_ARGS__)
+
+/*
+ * probe(name, args...) with one to four arguments.
+ */
+#define probe(name, ...) probe_(probe_nargs(__VA_ARGS__), name, __VA_ARGS__)
+
+#else
+
+#define probe(name, ...) ({ })
+
+#endif
+
+/*
+ * Fire name's probe with ret, and evaluate to ret, for
+ * "return probe_return(foo_return, ret);".
+ */
+#define probe_return(name, ret)                                         \
+        ({                                                              \
+                __typeof__(ret) probe_ret_ = (ret);                     \
+                                                                        \
+                probe(name, probe_ret_);                                \
+                probe_ret_;                                             \
+        })
+
+#endif /* !FSMOCK_PROBE_H_ */
+// vim:fenc=utf-8:tw=75:et
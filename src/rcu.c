@@ -0,0 +1,155 @@
+/*
+ * rcu.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <sched.h>
+
+unsigned long PRIVATE rcu_gp_ctr = RCU_GP_COUNT;
+__thread struct rcu_reader rcu_reader PRIVATE;
+
+/*
+ * rcu_gp_lock serializes grace periods and protects the reader registry.
+ */
+static pthread_mutex_t rcu_gp_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(rcu_readers);
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+static __thread bool rcu_thread_exited;
+
+static void
+rcu_unregister_thread(void *data UNUSED)
+{
+        pthread_mutex_lock(&rcu_gp_lock);
+        list_del(&rcu_reader.list);
+        rcu_reader.registered = false;
+        rcu_thread_exited = true;
+        pthread_mutex_unlock(&rcu_gp_lock);
+}
+
+/*
+ * Only the thread that forked survives, and it isn't in a read-side
+ * section, but the others' readers are still on the list, maybe stuck
+ * in one, and any of them might have been holding rcu_gp_lock.
+ */
+static void
+rcu_child(void)
+{
+        pthread_mutex_init(&rcu_gp_lock, NULL);
+        INIT_LIST_HEAD(&rcu_readers);
+        rcu_reader.ctr = 0;
+        if (rcu_reader.registered)
+                list_add(&rcu_reader.list, &rcu_readers);
+}
+
+static void
+rcu_make_key(void)
+{
+        pthread_key_create(&rcu_key, rcu_unregister_thread);
+        pthread_atfork(NULL, NULL, rcu_child);
+}
+
+/*
+ * Called the first time a thread enters a read-side section.  The key's
+ * value only needs to be non-NULL so the destructor gets run.  Once
+ * that's happened, the thread's reader is about to go away, so a
+ * read-side section in some later destructor doesn't register it again;
+ * see rcu_read_lock_exited().
+ */
+void PRIVATE
+rcu_register_thread(void)
+{
+        if (rcu_thread_exited)
+                return;
+
+        pthread_once(&rcu_key_once, rcu_make_key);
+        pthread_setspecific(rcu_key, &rcu_reader);
+
+        pthread_mutex_lock(&rcu_gp_lock);
+        list_add(&rcu_reader.list, &rcu_readers);
+        rcu_reader.registered = true;
+        pthread_mutex_unlock(&rcu_gp_lock);
+}
+
+/*
+ * A thread that's exiting isn't on the list for synchronize_rcu() to wait
+ * for, so instead its read-side sections hold off grace periods entirely.
+ */
+void PRIVATE
+rcu_read_lock_exited(void)
+{
+        if (!(rcu_reader.ctr & RCU_NEST_MASK))
+                pthread_mutex_lock(&rcu_gp_lock);
+        rcu_reader.ctr += RCU_GP_COUNT;
+}
+
+void PRIVATE
+rcu_read_unlock_exited(void)
+{
+        rcu_reader.ctr -= RCU_GP_COUNT;
+        if (!(rcu_reader.ctr & RCU_NEST_MASK))
+                pthread_mutex_unlock(&rcu_gp_lock);
+}
+
+/*
+ * True if reader is inside a read-side section that started before the
+ * current phase.
+ */
+static inline bool
+rcu_reader_old(struct rcu_reader *reader)
+{
+        unsigned long ctr = __atomic_load_n(&reader->ctr, __ATOMIC_RELAXED);
+
+        return (ctr & RCU_NEST_MASK) &&
+               ((ctr ^ __atomic_load_n(&rcu_gp_ctr, __ATOMIC_RELAXED)) &
+                RCU_GP_PHASE);
+}
+
+/*
+ * Wait until every read-side section that might have seen something
+ * we've unpublished has finished.  Flipping the phase twice means a
+ * reader that read rcu_gp_ctr just before the first flip can't be missed.
+ */
+void PRIVATE
+synchronize_rcu(void)
+{
+        struct list_head *this;
+
+        pthread_mutex_lock(&rcu_gp_lock);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        for (int phase = 0; phase < 2; phase++) {
+                __atomic_store_n(&rcu_gp_ctr, rcu_gp_ctr ^ RCU_GP_PHASE,
+                                 __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+                list_for_each(this, &rcu_readers) {
+                        struct rcu_reader *reader;
+
+                        reader = list_entry(this, struct rcu_reader, list);
+                        while (rcu_reader_old(reader))
+                                sched_yield();
+                }
+        }
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&rcu_gp_lock);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,95 @@
+/*
+ * rcu.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_RCU_H_
+#define FSMOCK_RCU_H_
+
+#include <stdbool.h>
+
+/*
+ * A small userspace read-copy-update implementation, along the lines of
+ * liburcu's "mb" flavor.  Readers only ever touch their own thread's
+ * counter, so they never block or bounce a shared cache line; writers
+ * publish new versions of a structure with rcu_assign_pointer() and call
+ * synchronize_rcu() before freeing anything a reader might still see.
+ *
+ * Each thread's counter holds a nesting count in the low bits and a copy
+ * of the grace period phase bit from when its outermost read-side
+ * section started.
+ */
+#define RCU_GP_COUNT    (1UL)
+#define RCU_GP_PHASE    (1UL << (sizeof(unsigned long) * 4))
+#define RCU_NEST_MASK   (RCU_GP_PHASE - 1)
+
+struct rcu_reader {
+        unsigned long ctr;
+        bool registered;
+        struct list_head list;
+};
+
+extern unsigned long PRIVATE rcu_gp_ctr;
+extern __thread struct rcu_reader rcu_reader PRIVATE;
+
+extern void PRIVATE rcu_register_thread(void);
+extern void PRIVATE rcu_read_lock_exited(void);
+extern void PRIVATE rcu_read_unlock_exited(void);
+extern void PRIVATE synchronize_rcu(void);
+
+static inline void
+rcu_read_lock(void)
+{
+        unsigned long ctr;
+
+        if (__builtin_expect(!rcu_reader.registered, 0)) {
+                rcu_register_thread();
+                if (!rcu_reader.registered) {
+                        rcu_read_lock_exited();
+                        return;
+                }
+        }
+
+        ctr = rcu_reader.ctr;
+        if (!(ctr & RCU_NEST_MASK)) {
+                __atomic_store_n(&rcu_reader.ctr,
+                                 __atomic_load_n(&rcu_gp_ctr, __ATOMIC_RELAXED),
+                                 __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        } else {
+                __atomic_store_n(&rcu_reader.ctr, ctr + RCU_GP_COUNT,
+                                 __ATOMIC_RELAXED);
+        }
+}
+
+static inline void
+rcu_read_unlock(void)
+{
+        if (__builtin_expect(!rcu_reader.registered, 0)) {
+                rcu_read_unlock_exited();
+                return;
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        __atomic_store_n(&rcu_reader.ctr, rcu_reader.ctr - RCU_GP_COUNT,
+                         __ATOMIC_RELAXED);
+}
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+#endif /* !FSMOCK_RCU_H_ */
+// vim:fenc=utf-8:tw=75:et
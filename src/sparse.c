@@ -0,0 +1,359 @@
+/*
+ * sparse.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+static inline unsigned int
+slot_index(uint64_t blkno, unsigned int level)
+{
+        return (blkno >> (level * SPARSE_FANOUT_SHIFT)) & (SPARSE_FANOUT - 1);
+}
+
+int PRIVATE
+sparse_init(struct sparse_map *map, uint64_t size)
+{
+        uint64_t span = SPARSE_FANOUT;
+
+        memset(map, 0, sizeof(*map));
+        INIT_LIST_HEAD(&map->snapshots);
+
+        map->nblocks = (size + SPARSE_BLOCK_SIZE - 1) >> SPARSE_BLOCK_SHIFT;
+        map->height = 1;
+        while (span < map->nblocks) {
+                if (map->height * SPARSE_FANOUT_SHIFT >= 64) {
+                        errno = EFBIG;
+                        return -1;
+                }
+                span <<= SPARSE_FANOUT_SHIFT;
+                map->height += 1;
+        }
+
+        return 0;
+}
+
+static void
+put_block(struct sparse_block *block)
+{
+        if (block && --block->refcnt == 0)
+                free(block);
+}
+
+/*
+ * Drop a reference to a node at the given level, and if it was the last
+ * one, everything under it.
+ */
+static void
+put_node(struct sparse_node *node, unsigned int level)
+{
+        if (!node || --node->refcnt)
+                return;
+
+        for (unsigned int i = 0; i < SPARSE_FANOUT; i++) {
+                if (!node->slots[i])
+                        continue;
+                if (level == 0)
+                        put_block(node->slots[i]);
+                else
+                        put_node(node->slots[i], level - 1);
+        }
+        free(node);
+}
+
+static inline void
+get_node(struct sparse_node *node)
+{
+        if (node)
+                node->refcnt += 1;
+}
+
+void PRIVATE
+sparse_fini(struct sparse_map *map)
+{
+        struct list_head *this, *n;
+
+        list_for_each_safe(this, n, &map->snapshots) {
+                struct sparse_snapshot *snap;
+
+                snap = list_entry(this, struct sparse_snapshot, list);
+                put_node(snap->root, map->height - 1);
+                list_del(&snap->list);
+                free(snap);
+        }
+
+        put_node(map->root, map->height - 1);
+        map->root = NULL;
+        map->allocated = 0;
+}
+
+/*
+ * Find the data block for blkno, or NULL if it has never been written.
+ * The result must not be written to; use sparse_insert() for that.
+ */
+uint8_t PRIVATE *
+sparse_lookup(struct sparse_map *map, uint64_t blkno)
+{
+        struct sparse_node *leaf = sparse_lookup_leaf(map, blkno);
+
+        return leaf ? sparse_leaf_block(leaf, blkno) : NULL;
+}
+
+/*
+ * Find the bottom level node holding blkno's slot, or NULL if there
+ * isn't one, in which case none of the SPARSE_FANOUT blocks it would
+ * hold have been written.  Walking a run of blocks this way costs one
+ * trip down the tree per node instead of one per block.
+ */
+struct sparse_node PRIVATE *
+sparse_lookup_leaf(struct sparse_map *map, uint64_t blkno)
+{
+        struct sparse_node *node = map->root;
+        unsigned int level;
+
+        if (blkno >= map->nblocks)
+                return NULL;
+
+        for (level = map->height - 1; node && level > 0; level--)
+                node = node->slots[slot_index(blkno, level)];
+
+        return node;
+}
+
+/*
+ * Make *nodep safe to modify in the current epoch.  If it's from an older
+ * one and a snapshot still refers to it, that means making our own copy.
+ */
+static struct sparse_node *
+writable_node(struct sparse_map *map, struct sparse_node **nodep,
+              unsigned int level)
+{
+        struct sparse_node *old = *nodep;
+        struct sparse_node *node;
+
+        if (!old) {
+                node = calloc(1, sizeof(*node));
+                if (!node)
+                        return NULL;
+                node->refcnt = 1;
+                node->epoch = map->epoch;
+                *nodep = node;
+                return node;
+        }
+
+        if (old->epoch == map->epoch)
+                return old;
+        if (old->refcnt == 1) {
+                old->epoch = map->epoch;
+                return old;
+        }
+
+        node = malloc(sizeof(*node));
+        if (!node)
+                return NULL;
+        memcpy(node->slots, old->slots, sizeof(node->slots));
+        node->refcnt = 1;
+        node->epoch = map->epoch;
+        for (unsigned int i = 0; i < SPARSE_FANOUT; i++) {
+                if (!node->slots[i])
+                        continue;
+                if (level == 0)
+                        ((struct sparse_block *)node->slots[i])->refcnt += 1;
+                else
+                        get_node(node->slots[i]);
+        }
+        put_node(old, level);
+        *nodep = node;
+
+        return node;
+}
+
+/*
+ * Find the data block for blkno so that it can be written, allocating it
+ * (and any interior nodes on the way down) if it isn't there yet, and
+ * copying anything a snapshot still shares.  New blocks are zero filled,
+ * and *created is set if there is one.
+ */
+uint8_t PRIVATE *
+sparse_insert(struct sparse_map *map, uint64_t blkno, bool *created)
+{
+        struct sparse_node **nodep = &map->root;
+        struct sparse_node *node;
+        struct sparse_block **blockp;
+        struct sparse_block *block;
+        unsigned int level;
+
+        *created = false;
+        if (blkno >= map->nblocks) {
+                errno = ENOSPC;
+                return NULL;
+        }
+
+        for (level = map->height - 1; ; level--) {
+                node = writable_node(map, nodep, level);
+                if (!node)
+                        return NULL;
+                if (level == 0)
+                        break;
+                nodep = (struct sparse_node **)
+                        &node->slots[slot_index(blkno, level)];
+        }
+
+        blockp = (struct sparse_block **)&node->slots[slot_index(blkno, 0)];
+        block = *blockp;
+        if (block && (block->epoch == map->epoch || block->refcnt == 1)) {
+                block->epoch = map->epoch;
+                return block->data;
+        }
+
+        if (block) {
+                struct sparse_block *old = block;
+
+                block = malloc(sizeof(*block));
+                if (!block)
+                        return NULL;
+                memcpy(block->data, old->data, SPARSE_BLOCK_SIZE);
+                put_block(old);
+        } else {
+                block = calloc(1, sizeof(*block));
+                if (!block)
+                        return NULL;
+                map->allocated += 1;
+                *created = true;
+        }
+        block->refcnt = 1;
+        block->epoch = map->epoch;
+        *blockp = block;
+
+        return block->data;
+}
+
+/*
+ * Find the data block for blkno if it can be written where it is: it and
+ * every node above it already belong to the current epoch, so there's
+ * nothing to allocate or copy.  Otherwise return NULL, and it needs
+ * sparse_insert().  This doesn't change the map, so it can be used while
+ * other threads are reading it.
+ */
+uint8_t PRIVATE *
+sparse_lookup_writable(struct sparse_map *map, uint64_t blkno)
+{
+        struct sparse_node *node = map->root;
+        struct sparse_block *block;
+        unsigned int level;
+
+        if (blkno >= map->nblocks)
+                return NULL;
+
+        for (level = map->height - 1; ; level--) {
+                if (!node || node->epoch != map->epoch)
+                        return NULL;
+                if (level == 0)
+                        break;
+                node = node->slots[slot_index(blkno, level)];
+        }
+
+        block = node->slots[slot_index(blkno, 0)];
+        if (!block || block->epoch != map->epoch)
+                return NULL;
+        return block->data;
+}
+
+static struct sparse_snapshot *
+find_snapshot(struct sparse_map *map, int id)
+{
+        struct list_head *this;
+
+        list_for_each(this, &map->snapshots) {
+                struct sparse_snapshot *snap;
+
+                snap = list_entry(this, struct sparse_snapshot, list);
+                if (snap->id == id)
+                        return snap;
+        }
+        errno = ENOENT;
+        return NULL;
+}
+
+/*
+ * Take a snapshot of the map's current contents.  This doesn't copy
+ * anything; it just shares the current tree and starts a new epoch.
+ * Returns the snapshot's id.
+ */
+int PRIVATE
+sparse_snapshot(struct sparse_map *map)
+{
+        struct sparse_snapshot *snap;
+
+        if (map->next_snapshot == INT_MAX) {
+                errno = ENOSPC;
+                return -1;
+        }
+
+        snap = calloc(1, sizeof(*snap));
+        if (!snap)
+                return -1;
+
+        snap->id = map->next_snapshot++;
+        snap->root = map->root;
+        snap->allocated = map->allocated;
+        get_node(snap->root);
+        list_add_tail(&snap->list, &map->snapshots);
+        map->epoch += 1;
+
+        return snap->id;
+}
+
+/*
+ * Put the map back the way it was when snapshot "id" was taken.  The
+ * snapshot is kept, so this can be done again later.
+ */
+int PRIVATE
+sparse_rollback(struct sparse_map *map, int id)
+{
+        struct sparse_snapshot *snap;
+
+        snap = find_snapshot(map, id);
+        if (!snap)
+                return -1;
+
+        get_node(snap->root);
+        put_node(map->root, map->height - 1);
+        map->root = snap->root;
+        map->allocated = snap->allocated;
+        map->epoch += 1;
+
+        return 0;
+}
+
+int PRIVATE
+sparse_release(struct sparse_map *map, int id)
+{
+        struct sparse_snapshot *snap;
+
+        snap = find_snapshot(map, id);
+        if (!snap)
+                return -1;
+
+        put_node(snap->root, map->height - 1);
+        list_del(&snap->list);
+        free(snap);
+
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,101 @@
+/*
+ * sparse.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_SPARSE_H_
+#define FSMOCK_SPARSE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A sparse map is a radix tree keyed by block number.  Interior nodes
+ * have SPARSE_FANOUT slots; the bottom level of slots points at
+ * SPARSE_BLOCK_SIZE byte data blocks.  Nothing is allocated for a block
+ * until somebody writes non-zero data to it, so a huge device costs one
+ * root node until it's used.
+ *
+ * Nodes and blocks are reference counted and tagged with the epoch they
+ * were created in.  Taking a snapshot just takes a reference on the root
+ * and starts a new epoch; anything from an older epoch that's still
+ * shared gets copied before it's written.  Rolling back puts the
+ * snapshot's root back.
+ */
+#define SPARSE_BLOCK_SHIFT      12
+#define SPARSE_BLOCK_SIZE       (1UL << SPARSE_BLOCK_SHIFT)
+#define SPARSE_FANOUT_SHIFT     6
+#define SPARSE_FANOUT           (1U << SPARSE_FANOUT_SHIFT)
+#define SPARSE_LEAF_SHIFT       (SPARSE_BLOCK_SHIFT + SPARSE_FANOUT_SHIFT)
+#define SPARSE_LEAF_SIZE        (1UL << SPARSE_LEAF_SHIFT)
+
+struct sparse_node {
+        unsigned int refcnt;
+        unsigned int epoch;
+        void *slots[SPARSE_FANOUT];
+};
+
+struct sparse_block {
+        unsigned int refcnt;
+        unsigned int epoch;
+        uint8_t data[SPARSE_BLOCK_SIZE];
+};
+
+struct sparse_snapshot {
+        struct list_head list;
+        int id;
+        struct sparse_node *root;
+        uint64_t allocated;
+};
+
+struct sparse_map {
+        struct sparse_node *root;
+        unsigned int height;
+        unsigned int epoch;
+        uint64_t nblocks;
+        uint64_t allocated;
+        struct list_head snapshots;
+        int next_snapshot;
+};
+
+extern int PRIVATE sparse_init(struct sparse_map *map, uint64_t size);
+extern void PRIVATE sparse_fini(struct sparse_map *map);
+extern uint8_t PRIVATE *sparse_lookup(struct sparse_map *map, uint64_t blkno);
+extern struct sparse_node PRIVATE *sparse_lookup_leaf(struct sparse_map *map,
+                                                     uint64_t blkno);
+extern uint8_t PRIVATE *sparse_lookup_writable(struct sparse_map *map,
+                                               uint64_t blkno);
+extern uint8_t PRIVATE *sparse_insert(struct sparse_map *map, uint64_t blkno,
+                                      bool *created);
+extern int PRIVATE sparse_snapshot(struct sparse_map *map);
+extern int PRIVATE sparse_rollback(struct sparse_map *map, int id);
+extern int PRIVATE sparse_release(struct sparse_map *map, int id);
+
+/*
+ * The data block for blkno in the leaf sparse_lookup_leaf() found, or
+ * NULL if it has never been written.
+ */
+static inline uint8_t *
+sparse_leaf_block(struct sparse_node *leaf, uint64_t blkno)
+{
+        struct sparse_block *block = leaf->slots[blkno & (SPARSE_FANOUT - 1)];
+
+        return block ? block->data : NULL;
+}
+
+#endif /* !FSMOCK_SPARSE_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,273 @@
+/*
+ * stats.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+uint64_t PRIVATE stats_calls;
+
+struct stats_thread {
+        struct list_head list;
+        struct stats_counters calls[NR_CALLS];
+};
+
+static __thread struct stats_thread *stats_thread;
+static __thread bool stats_thread_exited;
+
+/*
+ * stats_lock protects the list of threads and the totals below.
+ * stats_dead has what threads that have exited counted, and stats_base
+ * is what everything added up to at the last fsmock_stats_reset(); we
+ * can't zero another thread's counters out from under it.
+ */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(stats_threads);
+static struct stats_counters stats_dead[NR_CALLS];
+static struct stats_counters stats_base[NR_CALLS];
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void
+stats_sum(struct stats_counters *total, const struct stats_counters *c)
+{
+        total->calls[STATS_MOCKED] +=
+                __atomic_load_n(&c->calls[STATS_MOCKED], __ATOMIC_RELAXED);
+        total->calls[STATS_PASSTHROUGH] +=
+                __atomic_load_n(&c->calls[STATS_PASSTHROUGH], __ATOMIC_RELAXED);
+        total->errors += __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+        total->total_ns += __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+        for (unsigned int i = 0; i < FSMOCK_STATS_BUCKETS; i++)
+                total->latency[i] += __atomic_load_n(&c->latency[i],
+                                                     __ATOMIC_RELAXED);
+}
+
+/*
+ * Add up every thread's counters into totals.  Call with stats_lock held.
+ */
+static void
+stats_collect(struct stats_counters *totals)
+{
+        struct list_head *this;
+
+        memcpy(totals, stats_dead, sizeof(stats_dead));
+        list_for_each(this, &stats_threads) {
+                struct stats_thread *thread;
+
+                thread = list_entry(this, struct stats_thread, list);
+                for (unsigned int call = 0; call < NR_CALLS; call++)
+                        stats_sum(&totals[call], &thread->calls[call]);
+        }
+}
+
+/*
+ * Other destructors can still make calls after this one runs, and those
+ * just don't get counted; a thread that's exiting doesn't get its
+ * counters back.
+ */
+static void
+stats_thread_exit(void *data)
+{
+        struct stats_thread *thread = data;
+
+        stats_thread = NULL;
+        stats_thread_exited = true;
+
+        pthread_mutex_lock(&stats_lock);
+        for (unsigned int call = 0; call < NR_CALLS; call++)
+                stats_sum(&stats_dead[call], &thread->calls[call]);
+        list_del(&thread->list);
+        pthread_mutex_unlock(&stats_lock);
+
+        free(thread);
+}
+
+/*
+ * Only the thread that forked survives, but everyone's counts so far are
+ * still in the list, and stay there.
+ */
+static void
+stats_child(void)
+{
+        pthread_mutex_init(&stats_lock, NULL);
+}
+
+static void
+stats_setup(void)
+{
+        pthread_key_create(&stats_key, stats_thread_exit);
+        pthread_atfork(NULL, NULL, stats_child);
+}
+
+static struct stats_thread *
+stats_thread_get(void)
+{
+        struct stats_thread *thread = stats_thread;
+
+        if (__builtin_expect(thread != NULL, 1))
+                return thread;
+        if (stats_thread_exited)
+                return NULL;
+
+        pthread_once(&stats_once, stats_setup);
+
+        thread = aligned_alloc(64, sizeof(*thread));
+        if (!thread)
+                return NULL;
+        memset(thread, 0, sizeof(*thread));
+        pthread_setspecific(stats_key, thread);
+
+        pthread_mutex_lock(&stats_lock);
+        list_add_tail(&thread->list, &stats_threads);
+        pthread_mutex_unlock(&stats_lock);
+        stats_thread = thread;
+
+        return thread;
+}
+
+static inline void
+stats_inc(uint64_t *counter, uint64_t n)
+{
+        __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count a call that started at start.  Only this thread writes to its
+ * counters, so they don't need to be locked or read-modify-written; the
+ * atomic stores are just so a reader never sees one half updated.
+ */
+void PRIVATE
+stats_record(enum call_id call, enum stats_path path, uint64_t start,
+             bool failed)
+{
+        struct stats_thread *thread;
+        struct stats_counters *c;
+        uint64_t ns = 0;
+        unsigned int bucket = 0;
+        int error = errno;
+
+        thread = stats_thread_get();
+        if (!thread) {
+                errno = error;
+                return;
+        }
+        c = &thread->calls[call];
+
+        if (start)
+                ns = trace_clock() - start;
+        if (ns) {
+                bucket = 64 - __builtin_clzll(ns);
+                if (bucket >= FSMOCK_STATS_BUCKETS)
+                        bucket = FSMOCK_STATS_BUCKETS - 1;
+        }
+
+        stats_inc(&c->calls[path], 1);
+        if (failed)
+                stats_inc(&c->errors, 1);
+        stats_inc(&c->total_ns, ns);
+        stats_inc(&c->latency[bucket], 1);
+
+        if (metrics_enabled())
+                metrics_record_call(call, path, ns, failed);
+
+        errno = error;
+}
+
+int PUBLIC
+fsmock_stats_get(struct fsmock_stats *stats, unsigned int n)
+{
+        struct stats_counters *totals;
+
+        config_load();
+        if (!__atomic_load_n(&stats_calls, __ATOMIC_RELAXED)) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        totals = calloc(NR_CALLS, sizeof(*totals));
+        if (!totals)
+                return -1;
+
+        pthread_mutex_lock(&stats_lock);
+        stats_collect(totals);
+        for (unsigned int call = 0; call < NR_CALLS && call < n; call++) {
+                struct stats_counters *total = &totals[call];
+                struct stats_counters *base = &stats_base[call];
+
+                stats[call].name = call_info[call].name;
+                stats[call].mocked = total->calls[STATS_MOCKED] -
+                                     base->calls[STATS_MOCKED];
+                stats[call].passthrough = total->calls[STATS_PASSTHROUGH] -
+                                          base->calls[STATS_PASSTHROUGH];
+                stats[call].errors = total->errors - base->errors;
+                stats[call].total_ns = total->total_ns - base->total_ns;
+                for (unsigned int i = 0; i < FSMOCK_STATS_BUCKETS; i++)
+                        stats[call].latency[i] = total->latency[i] -
+                                                 base->latency[i];
+        }
+        pthread_mutex_unlock(&stats_lock);
+
+        free(totals);
+        return NR_CALLS;
+}
+
+int PUBLIC
+fsmock_stats_reset(void)
+{
+        config_load();
+        if (!__atomic_load_n(&stats_calls, __ATOMIC_RELAXED)) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        pthread_mutex_lock(&stats_lock);
+        stats_collect(stats_base);
+        pthread_mutex_unlock(&stats_lock);
+
+        return 0;
+}
+
+/*
+ * Stats are kept if LIBFSMOCK_STATS is set, or there's a [stats] section
+ * that doesn't say "enabled = no".  This is called once, while the
+ * config is loaded.
+ */
+int PRIVATE
+stats_configure(void)
+{
+        const char *value = getenv("LIBFSMOCK_STATS");
+        bool enabled;
+
+        enabled = (value && value[0]) || config_find_section("stats");
+        if (config_get_bool("stats", "enabled", &enabled) < 0)
+                return -1;
+        if (enabled)
+                stats_enable();
+
+        return 0;
+}
+
+void PRIVATE
+stats_enable(void)
+{
+        __atomic_store_n(&stats_calls, ~0ULL >> (64 - NR_CALLS),
+                         __ATOMIC_RELAXED);
+        __atomic_or_fetch(&trace_timed, stats_calls, __ATOMIC_RELAXED);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,88 @@
+/*
+ * stats.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_STATS_H_
+#define FSMOCK_STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Per-call counters for fsmock_stats_get().  Each thread has its own
+ * block of them, one cache line aligned entry per call id, which only it
+ * writes to, so counting a call is a few stores to memory nobody else is
+ * using.  Reading them adds up every thread's block; a thread's counts
+ * are folded into stats_dead when it exits.
+ *
+ * Like tracing, stats are off unless they're asked for, and then a call
+ * costs one load and a branch.
+ */
+enum stats_path {
+        STATS_MOCKED,
+        STATS_PASSTHROUGH,
+};
+
+struct stats_counters {
+        uint64_t calls[2];
+        uint64_t errors;
+        uint64_t total_ns;
+        uint64_t latency[FSMOCK_STATS_BUCKETS];
+} __attribute__((__aligned__(64)));
+
+extern uint64_t PRIVATE stats_calls;
+
+extern int PRIVATE stats_configure(void);
+extern void PRIVATE stats_enable(void);
+extern void PRIVATE stats_record(enum call_id call, enum stats_path path,
+                                 uint64_t start, bool failed);
+
+static inline void
+stats_add(enum call_id call, enum stats_path path, uint64_t start,
+          bool failed)
+{
+        if (__builtin_expect(__atomic_load_n(&stats_calls, __ATOMIC_RELAXED) &
+                             (1ULL << call), 0))
+                stats_record(call, path, start, failed);
+}
+
+static inline bool
+stats_failed_int(int64_t ret)
+{
+        return ret < 0;
+}
+
+static inline bool
+stats_failed_ptr(const void *ret)
+{
+        return ret == NULL;
+}
+
+/*
+ * Whether ret is a failure, the same way trace_is_error() decides.
+ */
+#define stats_failed(x)                                                 \
+        _Generic((x),                                                   \
+                 void *: stats_failed_ptr,                              \
+                 FILE *: stats_failed_ptr,                              \
+                 DIR *: stats_failed_ptr,                               \
+                 struct dirent *: stats_failed_ptr,                     \
+                 default: stats_failed_int)(x)
+
+#endif /* !FSMOCK_STATS_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,747 @@
+/*
+ * trace.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "fsmock.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+uint64_t PRIVATE trace_calls;
+uint64_t PRIVATE trace_timed;
+
+static __thread struct trace_ring *trace_ring;
+static __thread bool trace_thread_exited;
+
+/*
+ * trace_rings_lock protects the list of rings; trace_drain_lock makes
+ * sure only one thread at a time is draining them.  New rings are only
+ * ever added at the tail, and only the drainer takes them off, so it can
+ * walk the ones that were there when it started without the lock.
+ */
+static pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(trace_rings);
+static pthread_mutex_t trace_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static bool trace_drainer_started;
+static int trace_fd = -1;
+static bool trace_binary;
+static bool trace_calls_written;
+
+static pthread_mutex_t trace_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_wake = PTHREAD_COND_INITIALIZER;
+
+#define TRACE_DRAIN_INTERVAL_NS 10000000
+
+/*
+ * The filters from the [trace] section.  They're only set by
+ * trace_configure(), before anything is traced.  When there's a mount
+ * filter, trace_calls also has every call that opens or closes an fd in
+ * it, so we can keep track of which fds are on the mounts in trace_fds;
+ * trace_wanted is what actually gets written out.
+ */
+static uint64_t trace_wanted;
+static unsigned long trace_sample = 1;
+static __thread unsigned long trace_sample_count;
+static char **trace_mounts;
+static unsigned int trace_nmounts;
+static uint64_t *trace_fds;
+
+static void trace_start_drainer(void);
+
+/*
+ * The ring outlives its thread until the drainer has emptied it, and
+ * then the drainer frees it, so the thread mustn't touch it again.
+ * Calls from destructors that run after this one aren't traced.
+ */
+static void
+trace_thread_exit(void *data)
+{
+        struct trace_ring *ring = data;
+
+        trace_ring = NULL;
+        trace_thread_exited = true;
+        __atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+}
+
+static void
+trace_child(void)
+{
+        struct list_head *this;
+
+        struct list_head *n;
+
+        /*
+         * The parent will write out everything that's already queued,
+         * and our drainer thread didn't survive the fork.  Nor did any
+         * thread but this one, so theirs are no use to us.
+         */
+        list_for_each_safe(this, n, &trace_rings) {
+                struct trace_ring *ring;
+
+                ring = list_entry(this, struct trace_ring, list);
+                if (ring != trace_ring) {
+                        list_del(&ring->list);
+                        free(ring);
+                        continue;
+                }
+                ring->tail = ring->head;
+                ring->reported = ring->dropped;
+        }
+        pthread_mutex_init(&trace_rings_lock, NULL);
+        pthread_mutex_init(&trace_drain_lock, NULL);
+        trace_drainer_started = false;
+        trace_calls_written = false;
+}
+
+static void
+trace_setup(void)
+{
+        pthread_key_create(&trace_key, trace_thread_exit);
+        pthread_atfork(NULL, NULL, trace_child);
+}
+
+static struct trace_ring *
+trace_ring_get(void)
+{
+        struct trace_ring *ring = trace_ring;
+
+        if (__builtin_expect(ring != NULL, 1))
+                return ring;
+        if (trace_thread_exited)
+                return NULL;
+
+        pthread_once(&trace_once, trace_setup);
+
+        ring = calloc(1, sizeof(*ring));
+        if (!ring)
+                return NULL;
+        ring->tid = syscall(SYS_gettid);
+        pthread_setspecific(trace_key, ring);
+
+        pthread_mutex_lock(&trace_rings_lock);
+        list_add_tail(&ring->list, &trace_rings);
+        pthread_mutex_unlock(&trace_rings_lock);
+        trace_ring = ring;
+
+        return ring;
+}
+
+/*
+ * With "sample = N", each thread keeps one in every N calls that get
+ * past the other filters.
+ */
+static inline bool
+trace_sampled(void)
+{
+        if (trace_sample == 1)
+                return true;
+        if (++trace_sample_count < trace_sample)
+                return false;
+        trace_sample_count = 0;
+        return true;
+}
+
+static bool
+on_traced_mount(const char *path)
+{
+        struct mount *mount;
+        bool ret = false;
+
+        rcu_read_lock();
+        mount = get_mount(path);
+        for (unsigned int i = 0; mount && !ret && i < trace_nmounts; i++)
+                ret = !strcmp(mount->mountpoint, trace_mounts[i]);
+        rcu_read_unlock();
+
+        return ret;
+}
+
+static void
+trace_fd_mark(int64_t fd, bool on)
+{
+        uint64_t bit;
+
+        if (fd < 0 || fd >= FD_MAX_STATES)
+                return;
+        bit = 1ULL << (fd % 64);
+        if (on)
+                __atomic_or_fetch(&trace_fds[fd / 64], bit, __ATOMIC_RELAXED);
+        else
+                __atomic_and_fetch(&trace_fds[fd / 64], ~bit, __ATOMIC_RELAXED);
+}
+
+static bool
+trace_fd_marked(int64_t fd)
+{
+        if (fd < 0 || fd >= FD_MAX_STATES)
+                return false;
+        return __atomic_load_n(&trace_fds[fd / 64], __ATOMIC_RELAXED) &
+               (1ULL << (fd % 64));
+}
+
+/*
+ * Does a record pass the mount filter?  Calls that open an fd on one of
+ * the mounts mark it, so that later calls on the fd match too.
+ */
+static bool
+trace_filter(const struct trace_record *rec)
+{
+        const struct trace_subject *subject = &call_info[rec->call].subject;
+        uint64_t arg;
+        bool match;
+
+        if (subject->type == SUBJECT_NONE || subject->arg >= rec->nargs)
+                return false;
+        arg = rec->args[subject->arg];
+
+        switch (subject->type) {
+        case SUBJECT_PATH:
+                return on_traced_mount(rec->strings + arg);
+        case SUBJECT_OPEN:
+                match = on_traced_mount(rec->strings + arg);
+                trace_fd_mark(rec->ret, match);
+                return match;
+        case SUBJECT_FD:
+                return trace_fd_marked((int)arg);
+        case SUBJECT_DUP:
+                match = trace_fd_marked((int)arg);
+                trace_fd_mark(rec->ret, match);
+                return match;
+        case SUBJECT_CLOSE:
+                match = trace_fd_marked((int)arg);
+                trace_fd_mark((int)arg, false);
+                return match;
+        default:
+                return false;
+        }
+}
+
+/*
+ * Start a record of a call in this thread's ring.  Returns NULL if
+ * there's no room, in which case the call is just counted, or if it
+ * isn't sampled.  errno is left alone, and the error that goes with ret
+ * is taken from it.
+ */
+struct trace_record PRIVATE *
+trace_begin(enum call_id call, uint64_t start, int64_t ret)
+{
+        struct trace_ring *ring;
+        struct trace_record *rec;
+        uint64_t head, tail;
+        int error = errno;
+
+        /*
+         * The mount filter needs the arguments, so with one of those
+         * sampling waits until trace_commit().
+         */
+        if (!trace_nmounts && !trace_sampled())
+                return NULL;
+
+        ring = trace_ring_get();
+        if (!ring) {
+                errno = error;
+                return NULL;
+        }
+
+        head = ring->head;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - tail >= TRACE_RING_SIZE) {
+                __atomic_store_n(&ring->dropped, ring->dropped + 1,
+                                 __ATOMIC_RELAXED);
+                errno = error;
+                return NULL;
+        }
+
+        rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+        rec->timestamp = trace_clock();
+        rec->latency = start ? rec->timestamp - start : 0;
+        rec->ret = ret;
+        rec->tid = ring->tid;
+        rec->error = error;
+        rec->call = call;
+        rec->nargs = 0;
+        rec->strings_used = 0;
+
+        errno = error;
+        return rec;
+}
+
+/*
+ * Hand a record from trace_begin() over to the drainer, unless it's
+ * filtered out.
+ */
+void PRIVATE
+trace_commit(struct trace_record *rec)
+{
+        struct trace_ring *ring = trace_ring;
+        uint64_t head = ring->head;
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        int error = errno;
+
+        if (trace_nmounts && (!trace_filter(rec) ||
+                              !(trace_wanted & (1ULL << rec->call)) ||
+                              !trace_sampled())) {
+                errno = error;
+                return;
+        }
+
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+        /*
+         * Don't wait for the drainer's next tick if we're filling up.
+         */
+        if (head - tail == TRACE_RING_SIZE / 2)
+                pthread_cond_signal(&trace_wake);
+
+        if (__builtin_expect(!__atomic_load_n(&trace_drainer_started,
+                                              __ATOMIC_RELAXED), 0))
+                trace_start_drainer();
+        errno = error;
+}
+
+static void
+trace_write(const void *data, size_t size)
+{
+        size_t off = 0;
+
+        /*
+         * Straight to the kernel, so we never trace our own writes.
+         */
+        while (off < size) {
+                ssize_t rc = syscall(SYS_write, trace_fd,
+                                     (const char *)data + off, size - off);
+                if (rc < 0 && errno == EINTR)
+                        continue;
+                if (rc <= 0)
+                        break;
+                off += rc;
+        }
+}
+
+static void
+trace_chunk_header(void *data, enum trace_chunk_type type, size_t size)
+{
+        struct trace_chunk chunk = {
+                .magic = TRACE_CHUNK_MAGIC,
+                .type = type,
+                .version = TRACE_FORMAT_VERSION,
+                .pid = getpid(),
+                .size = size - sizeof(chunk),
+        };
+
+        memcpy(data, &chunk, sizeof(chunk));
+}
+
+/*
+ * Every process starts its part of a binary trace by saying what its
+ * call ids are, and what time it is, so fsmock-trace doesn't have to be
+ * built from the same source and can print wall clock times.
+ */
+static void
+trace_write_calls(void)
+{
+        struct trace_buf *buf;
+        struct timespec ts;
+        uint64_t clocks[2];
+        uint8_t *out;
+
+        buf = malloc(sizeof(*buf));
+        if (!buf)
+                return;
+
+        out = (uint8_t *)buf->data + sizeof(struct trace_chunk);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        clocks[0] = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        clocks[1] = trace_clock();
+        memcpy(out, clocks, sizeof(clocks));
+        out += sizeof(clocks);
+
+        out += trace_put_varint(out, NR_CALLS);
+        for (unsigned int call = 0; call < NR_CALLS; call++) {
+                size_t len = strlen(call_info[call].name);
+
+                out += trace_put_varint(out, len);
+                memcpy(out, call_info[call].name, len);
+                out += len;
+        }
+
+        buf->used = out - (uint8_t *)buf->data;
+        trace_chunk_header(buf->data, TRACE_CHUNK_CALLS, buf->used);
+        trace_write(buf->data, buf->used);
+        free(buf);
+}
+
+/*
+ * In binary mode, the start of the buffer is kept for a chunk header.
+ */
+static void
+trace_buf_reset(struct trace_buf *buf)
+{
+        buf->used = trace_binary ? sizeof(struct trace_chunk) : 0;
+        memset(&buf->cursor, 0, sizeof(buf->cursor));
+}
+
+static void
+trace_flush(struct trace_buf *buf)
+{
+        if (!trace_binary) {
+                trace_write(buf->data, buf->used);
+        } else if (buf->used > sizeof(struct trace_chunk)) {
+                if (!trace_calls_written) {
+                        trace_write_calls();
+                        trace_calls_written = true;
+                }
+                trace_chunk_header(buf->data, TRACE_CHUNK_RECORDS, buf->used);
+                trace_write(buf->data, buf->used);
+        }
+        trace_buf_reset(buf);
+}
+
+static void
+trace_put_record(struct trace_buf *buf, const struct trace_record *rec)
+{
+        if (trace_binary) {
+                if (sizeof(buf->data) - buf->used < TRACE_ENCODED_MAX)
+                        trace_flush(buf);
+                buf->used += trace_encode((uint8_t *)buf->data + buf->used,
+                                          rec, &buf->cursor);
+        } else {
+                if (sizeof(buf->data) - buf->used < 1024)
+                        trace_flush(buf);
+                trace_format_record(buf, rec);
+                trace_printf(buf, "\n");
+        }
+}
+
+static void
+trace_put_dropped(struct trace_buf *buf, uint32_t tid, uint64_t dropped)
+{
+        if (trace_binary) {
+                if (sizeof(buf->data) - buf->used < TRACE_ENCODED_MAX)
+                        trace_flush(buf);
+                buf->used += trace_encode_dropped((uint8_t *)buf->data +
+                                                  buf->used, tid, dropped);
+        } else {
+                trace_printf(buf, "<%" PRIu64 " calls by thread %u not traced>\n",
+                             dropped, tid);
+        }
+}
+
+/*
+ * Write out everything that's queued, and free the rings of threads that
+ * have exited once they're empty.  Formatting and writing happen without
+ * trace_rings_lock, so a thread making its first traced call never waits
+ * on our I/O.
+ */
+static void
+trace_drain(void)
+{
+        struct trace_buf *buf;
+        struct list_head *this, *n, *first, *last;
+
+        buf = malloc(sizeof(*buf));
+        if (!buf)
+                return;
+        trace_buf_reset(buf);
+
+        pthread_mutex_lock(&trace_drain_lock);
+        pthread_mutex_lock(&trace_rings_lock);
+        first = trace_rings.next;
+        last = trace_rings.prev;
+        pthread_mutex_unlock(&trace_rings_lock);
+
+        for (this = first; this != &trace_rings; this = this->next) {
+                struct trace_ring *ring;
+                uint64_t head, tail, dropped;
+
+                ring = list_entry(this, struct trace_ring, list);
+                head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+                for (tail = ring->tail; tail != head; tail++)
+                        trace_put_record(buf, &ring->records[tail & (TRACE_RING_SIZE - 1)]);
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+                dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+                if (dropped != ring->reported) {
+                        trace_put_dropped(buf, ring->tid,
+                                          dropped - ring->reported);
+                        ring->reported = dropped;
+                }
+
+                /*
+                 * Anything after last was added after we started, and
+                 * its next pointer may be changing under us.
+                 */
+                if (this == last)
+                        break;
+        }
+        trace_flush(buf);
+
+        /*
+         * A ring is only finished with once its thread has gone and
+         * we've written out everything it did before then.
+         */
+        pthread_mutex_lock(&trace_rings_lock);
+        list_for_each_safe(this, n, &trace_rings) {
+                struct trace_ring *ring;
+
+                ring = list_entry(this, struct trace_ring, list);
+                if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+                    ring->tail == __atomic_load_n(&ring->head,
+                                                  __ATOMIC_RELAXED) &&
+                    ring->reported == __atomic_load_n(&ring->dropped,
+                                                      __ATOMIC_RELAXED)) {
+                        list_del(&ring->list);
+                        free(ring);
+                }
+        }
+        pthread_mutex_unlock(&trace_rings_lock);
+        pthread_mutex_unlock(&trace_drain_lock);
+
+        free(buf);
+}
+
+static void *
+trace_drainer(void *data UNUSED)
+{
+        for (;;) {
+                struct timespec ts;
+
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += TRACE_DRAIN_INTERVAL_NS;
+                if (ts.tv_nsec >= 1000000000) {
+                        ts.tv_sec += 1;
+                        ts.tv_nsec -= 1000000000;
+                }
+                pthread_mutex_lock(&trace_wake_lock);
+                pthread_cond_timedwait(&trace_wake, &trace_wake_lock, &ts);
+                pthread_mutex_unlock(&trace_wake_lock);
+
+                trace_drain();
+        }
+        return NULL;
+}
+
+static void
+trace_open(void)
+{
+        const char *path = getenv("LIBFSMOCK_TRACE");
+        const char *fd = getenv("LIBFSMOCK_TRACE_FD");
+
+        if (trace_fd >= 0)
+                return;
+
+        trace_fd = STDOUT_FILENO;
+        if (path && path[0]) {
+                int rc = syscall(SYS_openat, AT_FDCWD, path,
+                                 O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+                if (rc >= 0)
+                        trace_fd = rc;
+        } else if (fd && fd[0]) {
+                trace_fd = atoi(fd);
+        }
+}
+
+/*
+ * Start the drainer the first time anything is traced, and again in a
+ * child after fork().  It blocks every signal, so it never takes one
+ * that was meant for the program.
+ */
+static void
+trace_start_drainer(void)
+{
+        sigset_t all, old;
+        pthread_t thread;
+
+        pthread_mutex_lock(&trace_rings_lock);
+        if (trace_drainer_started) {
+                pthread_mutex_unlock(&trace_rings_lock);
+                return;
+        }
+        __atomic_store_n(&trace_drainer_started, true, __ATOMIC_RELAXED);
+        trace_open();
+
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        if (pthread_create(&thread, NULL, trace_drainer, NULL) == 0)
+                pthread_detach(thread);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        pthread_mutex_unlock(&trace_rings_lock);
+}
+
+static int
+parse_calls(const char *value, uint64_t *calls)
+{
+        char *names, *name, *saveptr = NULL;
+        int ret = 0;
+
+        names = strdup(value);
+        if (!names)
+                return -1;
+
+        *calls = 0;
+        for (name = strtok_r(names, ", \t", &saveptr); name;
+             name = strtok_r(NULL, ", \t", &saveptr)) {
+                unsigned int call;
+
+                for (call = 0; call < NR_CALLS; call++) {
+                        if (!strcmp(call_info[call].name, name))
+                                break;
+                }
+                if (call == NR_CALLS) {
+                        errno = EINVAL;
+                        fsmock_error("[trace] calls: unknown call \"%s\"",
+                                     name);
+                        ret = -1;
+                        break;
+                }
+                *calls |= 1ULL << call;
+        }
+        free(names);
+
+        return ret;
+}
+
+static int
+parse_mounts(const char *value)
+{
+        char *names, *name, *saveptr = NULL;
+        int ret = 0;
+
+        names = strdup(value);
+        if (!names)
+                return -1;
+
+        for (name = strtok_r(names, ", \t", &saveptr); name;
+             name = strtok_r(NULL, ", \t", &saveptr)) {
+                char **mounts;
+
+                mounts = reallocarray(trace_mounts, trace_nmounts + 1,
+                                      sizeof(*mounts));
+                if (!mounts) {
+                        ret = -1;
+                        break;
+                }
+                trace_mounts = mounts;
+                trace_mounts[trace_nmounts] = strdup(name);
+                if (!trace_mounts[trace_nmounts]) {
+                        ret = -1;
+                        break;
+                }
+                trace_nmounts += 1;
+        }
+        free(names);
+
+        return ret;
+}
+
+/*
+ * Work out what to trace.  Nothing is, unless LIBFSMOCK_TRACE or
+ * LIBFSMOCK_TRACE_FD is set or the config file has a [trace] section:
+ *
+ *   [trace]
+ *   enabled = yes
+ *   format = binary
+ *   calls = open openat ioctl
+ *   mount = /dev/sda
+ *   sample = 100
+ *
+ * "format" is "text" or "binary", and LIBFSMOCK_TRACE_FORMAT overrides
+ * it.  "calls" limits it to those calls, "mount" to calls on paths under
+ * those mountpoints or fds opened on them, and "sample = N" keeps one in
+ * every N calls that get past the rest.  This is called once, while the
+ * config is loaded, before anything can be traced.
+ */
+int PRIVATE
+trace_configure(void)
+{
+        const char *path = getenv("LIBFSMOCK_TRACE");
+        const char *fd = getenv("LIBFSMOCK_TRACE_FD");
+        uint64_t calls = ~0ULL >> (64 - NR_CALLS);
+        uint64_t sample = 1;
+        bool enabled;
+        const char *value;
+
+        enabled = (path && path[0]) || (fd && fd[0]) ||
+                  config_find_section("trace");
+        if (config_get_bool("trace", "enabled", &enabled) < 0)
+                return -1;
+        if (!enabled)
+                return 0;
+
+        value = getenv("LIBFSMOCK_TRACE_FORMAT");
+        if (!value || !value[0])
+                value = config_get("trace", "format");
+        if (value && !strcmp(value, "binary")) {
+                trace_binary = true;
+        } else if (value && strcmp(value, "text")) {
+                errno = EINVAL;
+                fsmock_error("[trace] format: invalid format \"%s\"", value);
+                return -1;
+        }
+
+        value = config_get("trace", "calls");
+        if (value && parse_calls(value, &calls) < 0)
+                return -1;
+
+        value = config_get("trace", "mount");
+        if (value && parse_mounts(value) < 0)
+                return -1;
+
+        if (config_get_size("trace", "sample", &sample) < 0)
+                return -1;
+        if (sample == 0 || sample > ULONG_MAX) {
+                errno = EINVAL;
+                fsmock_error("[trace] sample: must be at least 1");
+                return -1;
+        }
+        trace_sample = sample;
+
+        trace_wanted = calls;
+        if (trace_nmounts) {
+                trace_fds = calloc(FD_MAX_STATES / 64, sizeof(*trace_fds));
+                if (!trace_fds) {
+                        trace_nmounts = 0;
+                        return -1;
+                }
+                for (unsigned int call = 0; call < NR_CALLS; call++) {
+                        enum trace_subject_type type;
+
+                        type = call_info[call].subject.type;
+                        if (type == SUBJECT_OPEN || type == SUBJECT_DUP ||
+                            type == SUBJECT_CLOSE)
+                                calls |= 1ULL << call;
+                }
+        }
+        __atomic_store_n(&trace_calls, calls, __ATOMIC_RELAXED);
+        __atomic_or_fetch(&trace_timed, calls, __ATOMIC_RELAXED);
+
+        return 0;
+}
+
+static void DESTRUCTOR
+trace_fini(void)
+{
+        trace_drain();
+}
+
+// vim:fenc=utf-8:tw=75:et
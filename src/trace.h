@@ -0,0 +1,383 @@
+/*
+ * trace.h
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FSMOCK_TRACE_H_
+#define FSMOCK_TRACE_H_
+
+#include "calls.h"
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Each thread that makes a traced call gets its own ring of fixed-size
+ * binary records.  Only that thread ever writes to it and only the
+ * drainer thread reads from it, so putting a record in is a few stores
+ * and no locks or syscalls.  The drainer formats what it finds and writes
+ * it to LIBFSMOCK_TRACE (a file, which is appended to, since every
+ * process we're preloaded into will be writing to it) or
+ * LIBFSMOCK_TRACE_FD, or stdout if neither is set.  If a ring fills up,
+ * records are dropped and counted rather than making the caller wait.
+ *
+ * The drainer can write either strace-ish text or a compact binary
+ * stream, which fsmock-trace turns back into text, CSV, or a summary.
+ *
+ * Which calls get traced is a bitmask indexed by call id that's set up
+ * once, while the library is initialized, so a call that isn't being
+ * traced costs one load and a branch that's predicted not taken.  The
+ * [trace] config section's mount and sample filters are applied after
+ * that, out of line.
+ */
+#define TRACE_RING_SHIFT        10
+#define TRACE_RING_SIZE         (1U << TRACE_RING_SHIFT)
+#define TRACE_MAX_ARGS          8
+#define TRACE_STRINGS           160
+
+enum ret_type { VOID, INT, SSIZE_T, OFF_T, FILEP, DIRP, DIRENTP };
+
+/*
+ * Things we trace that aren't interposed calls: the simulated devices'
+ * own reads and writes.  The entries look just like the ones in calls.h.
+ */
+#define FSMOCK_TRACE_EVENTS(X)                                                \
+        X(blkdev_read, blkdev_read, SSIZE_T, ssize_t,                         \
+          (struct blkdev *dev, void *buf, size_t count, uint64_t offset),     \
+          "%p, %p, %zu, %lu", NULL, TRACE_NONE)                               \
+        X(blkdev_write, blkdev_write, SSIZE_T, ssize_t,                       \
+          (struct blkdev *dev, const void *buf, size_t count,                 \
+           uint64_t offset),                                                  \
+          "%p, %p, %zu, %lu", NULL, TRACE_NONE)                               \
+        X(blkdev_readv, blkdev_readv, SSIZE_T, ssize_t,                       \
+          (struct blkdev *dev, const struct iovec *iov, int iovcnt,           \
+           uint64_t offset),                                                  \
+          "%p, %p, %d, %lu", NULL, TRACE_NONE)                                \
+        X(blkdev_writev, blkdev_writev, SSIZE_T, ssize_t,                     \
+          (struct blkdev *dev, const struct iovec *iov, int iovcnt,           \
+           uint64_t offset),                                                  \
+          "%p, %p, %d, %lu", NULL, TRACE_NONE)
+
+#define FSMOCK_CALL_ID(name, ...) CALL_ ## name,
+enum call_id {
+        FSMOCK_CALLS(FSMOCK_CALL_ID)
+        FSMOCK_TRACE_EVENTS(FSMOCK_CALL_ID)
+        NR_CALLS
+};
+#undef FSMOCK_CALL_ID
+
+_Static_assert(NR_CALLS <= 64, "trace_calls needs more than 64 bits");
+
+/*
+ * Arguments are stored as words in the order the call's format uses
+ * them; a string argument's word is its offset in strings[].
+ */
+struct trace_record {
+        uint64_t timestamp;
+        uint64_t latency;
+        int64_t ret;
+        uint64_t args[TRACE_MAX_ARGS];
+        uint32_t tid;
+        int32_t error;
+        uint16_t call;
+        uint8_t nargs;
+        uint8_t strings_used;
+        char strings[TRACE_STRINGS];
+};
+
+struct trace_ring {
+        struct list_head list;
+        uint32_t tid;
+        bool dead;
+        uint64_t head __attribute__((__aligned__(64)));
+        uint64_t dropped;
+        uint64_t tail __attribute__((__aligned__(64)));
+        uint64_t reported;
+        struct trace_record records[TRACE_RING_SIZE];
+};
+
+/*
+ * What a call operates on, for the mount filter: a path, an fd, or
+ * nothing we can tell.  TRACE_OPEN is a path that the call returns an fd
+ * for, TRACE_DUP is an fd that it returns a copy of, and TRACE_CLOSE is
+ * an fd that's gone afterwards, so that calls on an fd can be matched to
+ * the path it was opened with.
+ */
+enum trace_subject_type {
+        SUBJECT_NONE,
+        SUBJECT_PATH,
+        SUBJECT_FD,
+        SUBJECT_OPEN,
+        SUBJECT_DUP,
+        SUBJECT_CLOSE,
+};
+
+struct trace_subject {
+        enum trace_subject_type type;
+        uint8_t arg;
+};
+
+#define TRACE_NONE      { SUBJECT_NONE, 0 }
+#define TRACE_PATH(n)   { SUBJECT_PATH, (n) }
+#define TRACE_FD(n)     { SUBJECT_FD, (n) }
+#define TRACE_OPEN(n)   { SUBJECT_OPEN, (n) }
+#define TRACE_DUP(n)    { SUBJECT_DUP, (n) }
+#define TRACE_CLOSE(n)  { SUBJECT_CLOSE, (n) }
+
+/*
+ * What the drainer needs to know to print a call.  If fmt is NULL,
+ * mkfmt picks one based on the arguments.
+ */
+struct call_info {
+        const char *name;
+        enum ret_type ret_type;
+        const char *fmt;
+        const char *(*mkfmt)(const struct trace_record *rec);
+        struct trace_subject subject;
+};
+
+extern const struct call_info PRIVATE call_info[NR_CALLS];
+extern uint64_t PRIVATE trace_calls;
+extern uint64_t PRIVATE trace_timed;
+
+/*
+ * The binary format is a series of chunks, each written with one
+ * write(), so that several processes can append to the same file.  Every
+ * process starts with a TRACE_CHUNK_CALLS chunk naming its call ids:
+ *
+ *   u64 CLOCK_REALTIME ns, u64 CLOCK_MONOTONIC ns, varint ncalls,
+ *   ncalls * (varint length, name)
+ *
+ * and then writes TRACE_CHUNK_RECORDS chunks, each of which is a run of
+ * records encoded by trace_encode().  Integers in the chunk header and
+ * the clocks are in host byte order; everything else is a LEB128
+ * varint, zigzagged if it can be negative.
+ */
+#define TRACE_CHUNK_MAGIC       0x544d5346      /* "FSMT" */
+#define TRACE_FORMAT_VERSION    1
+
+enum trace_chunk_type {
+        TRACE_CHUNK_CALLS = 1,
+        TRACE_CHUNK_RECORDS = 2,
+};
+
+struct trace_chunk {
+        uint32_t magic;
+        uint8_t type;
+        uint8_t version;
+        uint16_t reserved;
+        uint32_t pid;
+        uint32_t size;
+};
+
+/*
+ * The most trace_encode() can produce for one record.
+ */
+#define TRACE_ENCODED_MAX       (10 * (8 + TRACE_MAX_ARGS) + TRACE_STRINGS)
+
+/*
+ * Encoded records store their timestamp and thread id relative to the
+ * previous record's, since the drainer writes out each thread's records
+ * together.
+ */
+struct trace_cursor {
+        uint64_t timestamp;
+        uint32_t tid;
+};
+
+/*
+ * Where the drainer, or fsmock-trace, builds up output.
+ */
+struct trace_buf {
+        char data[16384];
+        size_t used;
+        struct trace_cursor cursor;
+};
+
+extern void PRIVATE __attribute__((__format__ (printf, 2, 3)))
+trace_printf(struct trace_buf *buf, const char *fmt, ...);
+extern void PRIVATE trace_format_args(struct trace_buf *buf,
+                                      const struct trace_record *rec);
+extern bool PRIVATE trace_is_error(const struct trace_record *rec);
+extern void PRIVATE trace_format_record(struct trace_buf *buf,
+                                        const struct trace_record *rec);
+extern size_t PRIVATE trace_encode(uint8_t *out, const struct trace_record *rec,
+                                   struct trace_cursor *cursor);
+extern size_t PRIVATE trace_encode_dropped(uint8_t *out, uint32_t tid,
+                                           uint64_t dropped);
+extern ssize_t PRIVATE trace_decode(const uint8_t *in, size_t size,
+                                    struct trace_record *rec,
+                                    struct trace_cursor *cursor,
+                                    uint64_t *dropped);
+extern size_t PRIVATE trace_put_varint(uint8_t *out, uint64_t val);
+extern ssize_t PRIVATE trace_get_varint(const uint8_t *in, size_t size,
+                                        uint64_t *val);
+
+extern int PRIVATE trace_configure(void);
+
+extern struct trace_record PRIVATE *trace_begin(enum call_id call,
+                                                uint64_t start, int64_t ret);
+extern void PRIVATE trace_commit(struct trace_record *rec);
+
+static inline void
+trace_arg_int(struct trace_record *rec, int64_t arg)
+{
+        if (rec->nargs < TRACE_MAX_ARGS)
+                rec->args[rec->nargs++] = arg;
+}
+
+static inline void
+trace_arg_uint(struct trace_record *rec, uint64_t arg)
+{
+        if (rec->nargs < TRACE_MAX_ARGS)
+                rec->args[rec->nargs++] = arg;
+}
+
+static inline void
+trace_arg_ptr(struct trace_record *rec, const void *arg)
+{
+        if (rec->nargs < TRACE_MAX_ARGS)
+                rec->args[rec->nargs++] = (uintptr_t)arg;
+}
+
+static inline void
+trace_arg_str(struct trace_record *rec, const char *arg)
+{
+        size_t len;
+
+        if (rec->nargs >= TRACE_MAX_ARGS)
+                return;
+        if (!arg)
+                arg = "(null)";
+        len = strnlen(arg, TRACE_STRINGS - 1 - rec->strings_used);
+        rec->args[rec->nargs++] = rec->strings_used;
+        memcpy(rec->strings + rec->strings_used, arg, len);
+        rec->strings[rec->strings_used + len] = '\0';
+        rec->strings_used += len;
+        if (rec->strings_used < TRACE_STRINGS - 1)
+                rec->strings_used += 1;
+}
+
+static inline int64_t
+trace_ret_int(int64_t ret)
+{
+        return ret;
+}
+
+static inline int64_t
+trace_ret_ptr(const void *ret)
+{
+        return (uintptr_t)ret;
+}
+
+/*
+ * Only const char * is taken to be a string; a plain char * is always
+ * somebody's buffer.
+ */
+#define trace_arg(rec, x)                                               \
+        _Generic((x),                                                   \
+                 const char *: trace_arg_str,                           \
+                 char *: trace_arg_ptr,                                 \
+                 char: trace_arg_int,                                   \
+                 short: trace_arg_int,                                  \
+                 int: trace_arg_int,                                    \
+                 long: trace_arg_int,                                   \
+                 long long: trace_arg_int,                              \
+                 unsigned char: trace_arg_uint,                         \
+                 unsigned short: trace_arg_uint,                        \
+                 unsigned int: trace_arg_uint,                          \
+                 unsigned long: trace_arg_uint,                         \
+                 unsigned long long: trace_arg_uint,                    \
+                 default: trace_arg_ptr)((rec), (x))
+
+#define trace_ret(x)                                                    \
+        _Generic((x),                                                   \
+                 void *: trace_ret_ptr,                                 \
+                 FILE *: trace_ret_ptr,                                 \
+                 DIR *: trace_ret_ptr,                                  \
+                 struct dirent *: trace_ret_ptr,                        \
+                 default: trace_ret_int)(x)
+
+#define trace_args_1(rec, a) trace_arg(rec, a)
+#define trace_args_2(rec, a, ...) trace_arg(rec, a); trace_args_1(rec, __VA_ARGS__)
+#define trace_args_3(rec, a, ...) trace_arg(rec, a); trace_args_2(rec, __VA_ARGS__)
+#define trace_args_4(rec, a, ...) trace_arg(rec, a); trace_args_3(rec, __VA_ARGS__)
+#define trace_args_5(rec, a, ...) trace_arg(rec, a); trace_args_4(rec, __VA_ARGS__)
+#define trace_args_6(rec, a, ...) trace_arg(rec, a); trace_args_5(rec, __VA_ARGS__)
+#define trace_nargs_(_1, _2, _3, _4, _5, _6, n, ...) n
+#define trace_nargs(...) trace_nargs_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define trace_args__(n, rec, ...) trace_args_ ## n(rec, __VA_ARGS__)
+#define trace_args_(n, rec, ...) trace_args__(n, rec, __VA_ARGS__)
+#define trace_args(rec, ...)                                            \
+        trace_args_(trace_nargs(__VA_ARGS__), rec, __VA_ARGS__)
+
+static inline bool
+trace_enabled(enum call_id call)
+{
+        return __builtin_expect(__atomic_load_n(&trace_calls, __ATOMIC_RELAXED) &
+                                (1ULL << call), 0);
+}
+
+static inline uint64_t
+trace_clock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * When a call started, so its trace record and its stats can say how
+ * long it took; 0 if nothing wants to know.  trace_timed is every call
+ * that's being either traced or counted.
+ */
+static inline uint64_t
+trace_start(enum call_id call)
+{
+        if (__builtin_expect(__atomic_load_n(&trace_timed, __ATOMIC_RELAXED) &
+                             (1ULL << call), 0))
+                return trace_clock();
+        return 0;
+}
+
+/*
+ * Record a call to name, which started at start and returned ret, with
+ * the rest of the arguments as it should be printed.  Each argument is
+ * stored according to its C type, so nothing is parsed or looked up
+ * here, and nothing at all is done unless the call is being traced.
+ */
+#define trace_call(name, start, ret, ...)                               \
+        ({                                                              \
+                struct trace_record *rec_;                              \
+                                                                        \
+                if (trace_enabled(CALL_ ## name)) {                     \
+                        rec_ = trace_begin(CALL_ ## name, (start),      \
+                                           trace_ret(ret));             \
+                        if (rec_) {                                     \
+                                trace_args(rec_, __VA_ARGS__);          \
+                                trace_commit(rec_);                     \
+                        }                                               \
+                }                                                       \
+        })
+
+#endif /* !FSMOCK_TRACE_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,391 @@
+/*
+ * tracefmt.c
+ * Copyright 2018 Peter Jones <pjones@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Everything about trace records that both the library's drainer and
+ * fsmock-trace need: the call table, formatting a record as text, and
+ * the binary encoding.
+ */
+
+#include "fsmock.h"
+
+#include <inttypes.h>
+
+static const char *
+fmt_open(const struct trace_record *rec)
+{
+        if (rec->nargs > 1 && (rec->args[1] & O_CREAT))
+                return "\"%s\", 0x%0x, 0o%0o";
+        return "\"%s\", 0x%0x";
+}
+
+static const char *
+fmt_openat(const struct trace_record *rec)
+{
+        if (rec->nargs > 2 && (rec->args[2] & O_CREAT))
+                return "%d, \"%s\", 0x%0x, 0o%0o";
+        return "%d, \"%s\", 0x%0x";
+}
+
+#define FSMOCK_CALL_INFO(name, sym, ret_type, rtype, params, fmt, mkfmt, \
+                         subject)                                       \
+        [CALL_ ## name] = { #name, ret_type, fmt, mkfmt, subject },
+const struct call_info PRIVATE call_info[NR_CALLS] = {
+        FSMOCK_CALLS(FSMOCK_CALL_INFO)
+        FSMOCK_TRACE_EVENTS(FSMOCK_CALL_INFO)
+};
+#undef FSMOCK_CALL_INFO
+
+enum arg_size { ARG_NONE, ARG_INT, ARG_LONG, ARG_PTR, ARG_STR };
+
+/*
+ * Parse the conversion at fmt, which points at a '%'.  Returns how long
+ * it is, and what kind of argument it takes in *sizep.
+ */
+static size_t
+parse_conversion(const char *fmt, enum arg_size *sizep)
+{
+        const char *s = fmt + 1;
+        bool is_long = false;
+
+        *sizep = ARG_NONE;
+        if (*s == '%')
+                return 2;
+
+        s += strspn(s, "#0- +'0123456789.");
+        while (strchr("hlqjzt", *s) && *s) {
+                if (*s != 'h')
+                        is_long = true;
+                s++;
+        }
+        switch (*s) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+                *sizep = is_long ? ARG_LONG : ARG_INT;
+                break;
+        case 'p':
+                *sizep = ARG_PTR;
+                break;
+        case 's':
+                *sizep = ARG_STR;
+                break;
+        case '\0':
+                return s - fmt;
+        default:
+                break;
+        }
+        return s - fmt + 1;
+}
+
+void PRIVATE __attribute__((__format__ (printf, 2, 3)))
+trace_printf(struct trace_buf *buf, const char *fmt, ...)
+{
+        va_list ap;
+        int rc;
+
+        va_start(ap, fmt);
+        rc = vsnprintf(buf->data + buf->used, sizeof(buf->data) - buf->used,
+                       fmt, ap);
+        va_end(ap);
+        if (rc < 0)
+                return;
+        if ((size_t)rc >= sizeof(buf->data) - buf->used)
+                rc = sizeof(buf->data) - buf->used - 1;
+        buf->used += rc;
+}
+
+/*
+ * Print one conversion from a record's format with its argument.
+ */
+static void
+format_arg(struct trace_buf *buf, const struct trace_record *rec,
+           const char *conv, size_t len, enum arg_size size, uint64_t arg)
+{
+        char spec[32];
+        char c = conv[len - 1];
+
+        if (len >= sizeof(spec))
+                return;
+        memcpy(spec, conv, len);
+        spec[len] = '\0';
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+        switch (size) {
+        case ARG_INT:
+                if (c == 'd' || c == 'i')
+                        trace_printf(buf, spec, (int)arg);
+                else
+                        trace_printf(buf, spec, (unsigned int)arg);
+                break;
+        case ARG_LONG:
+                trace_printf(buf, spec, (unsigned long)arg);
+                break;
+        case ARG_PTR:
+                trace_printf(buf, spec, (void *)(uintptr_t)arg);
+                break;
+        case ARG_STR:
+                if (arg < TRACE_STRINGS)
+                        trace_printf(buf, spec, rec->strings + arg);
+                break;
+        case ARG_NONE:
+                trace_printf(buf, "%%");
+                break;
+        }
+#pragma GCC diagnostic pop
+}
+
+/*
+ * Print a record's arguments, the way its call's format says to.
+ */
+void PRIVATE
+trace_format_args(struct trace_buf *buf, const struct trace_record *rec)
+{
+        const struct call_info *info = &call_info[rec->call];
+        const char *s = info->fmt ? info->fmt : info->mkfmt(rec);
+        unsigned int n = 0;
+
+        while (*s) {
+                const char *conv = strchr(s, '%');
+                enum arg_size size;
+                size_t len;
+
+                if (!conv) {
+                        trace_printf(buf, "%s", s);
+                        break;
+                }
+                trace_printf(buf, "%.*s", (int)(conv - s), s);
+                len = parse_conversion(conv, &size);
+                if (size == ARG_NONE || n < rec->nargs)
+                        format_arg(buf, rec, conv, len, size,
+                                   size == ARG_NONE ? 0 : rec->args[n++]);
+                s = conv + len;
+        }
+}
+
+bool PRIVATE
+trace_is_error(const struct trace_record *rec)
+{
+        switch (call_info[rec->call].ret_type) {
+        case INT:
+        case SSIZE_T:
+        case OFF_T:
+                return rec->ret < 0;
+        case FILEP:
+        case DIRP:
+        case DIRENTP:
+                return rec->ret == 0;
+        default:
+                return false;
+        }
+}
+
+/*
+ * Turn a record into the same strace-ish line we've always printed,
+ * without the newline.
+ */
+void PRIVATE
+trace_format_record(struct trace_buf *buf, const struct trace_record *rec)
+{
+        const struct call_info *info = &call_info[rec->call];
+        char errbuf[64];
+
+        trace_printf(buf, "%s(", info->name);
+        trace_format_args(buf, rec);
+
+        switch (info->ret_type) {
+        case VOID:
+                trace_printf(buf, ")");
+                break;
+        case INT:
+                trace_printf(buf, ") = %d", (int)rec->ret);
+                break;
+        case SSIZE_T:
+        case OFF_T:
+                trace_printf(buf, ") = %" PRId64, rec->ret);
+                break;
+        case FILEP:
+        case DIRP:
+        case DIRENTP:
+                trace_printf(buf, ") = %p", (void *)(uintptr_t)rec->ret);
+                break;
+        }
+        if (trace_is_error(rec))
+                trace_printf(buf, " (%s)",
+                             strerror_r(rec->error, errbuf, sizeof(errbuf)));
+}
+
+size_t PRIVATE
+trace_put_varint(uint8_t *out, uint64_t val)
+{
+        size_t n = 0;
+
+        while (val >= 0x80) {
+                out[n++] = (val & 0x7f) | 0x80;
+                val >>= 7;
+        }
+        out[n++] = val;
+        return n;
+}
+
+/*
+ * Returns how many bytes the varint took, or -1 if it runs off the end.
+ */
+ssize_t PRIVATE
+trace_get_varint(const uint8_t *in, size_t size, uint64_t *val)
+{
+        uint64_t ret = 0;
+
+        for (size_t n = 0; n < size && n < 10; n++) {
+                ret |= (uint64_t)(in[n] & 0x7f) << (7 * n);
+                if (!(in[n] & 0x80)) {
+                        *val = ret;
+                        return n + 1;
+                }
+        }
+        errno = EINVAL;
+        return -1;
+}
+
+static inline uint64_t
+zigzag(int64_t val)
+{
+        return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t val)
+{
+        return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+/*
+ * Encode a record into out, which must have room for TRACE_ENCODED_MAX
+ * bytes.  The call id is stored plus one; a 0 there is a marker from
+ * trace_encode_dropped().
+ */
+size_t PRIVATE
+trace_encode(uint8_t *out, const struct trace_record *rec,
+             struct trace_cursor *cursor)
+{
+        size_t n = 0;
+
+        n += trace_put_varint(out + n, rec->call + 1);
+        n += trace_put_varint(out + n, zigzag((int64_t)rec->tid - cursor->tid));
+        n += trace_put_varint(out + n, zigzag(rec->timestamp - cursor->timestamp));
+        n += trace_put_varint(out + n, rec->latency);
+        n += trace_put_varint(out + n, zigzag(rec->ret));
+        n += trace_put_varint(out + n, rec->error);
+        n += trace_put_varint(out + n, rec->nargs);
+        for (unsigned int i = 0; i < rec->nargs; i++)
+                n += trace_put_varint(out + n, zigzag(rec->args[i]));
+        n += trace_put_varint(out + n, rec->strings_used);
+        memcpy(out + n, rec->strings, rec->strings_used);
+        n += rec->strings_used;
+
+        cursor->timestamp = rec->timestamp;
+        cursor->tid = rec->tid;
+        return n;
+}
+
+/*
+ * Encode a note that thread tid couldn't trace some of its calls.
+ */
+size_t PRIVATE
+trace_encode_dropped(uint8_t *out, uint32_t tid, uint64_t dropped)
+{
+        size_t n = 0;
+
+        n += trace_put_varint(out + n, 0);
+        n += trace_put_varint(out + n, tid);
+        n += trace_put_varint(out + n, dropped);
+        return n;
+}
+
+#define get_varint(valp)                                                \
+        ({                                                              \
+                ssize_t rc_ = trace_get_varint(in + n, size - n, (valp)); \
+                if (rc_ < 0)                                            \
+                        return -1;                                      \
+                n += rc_;                                               \
+        })
+
+/*
+ * Decode one record from in.  Returns how many bytes it took, or -1 if
+ * it's truncated or corrupt.  If it's a dropped calls marker, *dropped is
+ * set to the count and only rec->tid is filled in; otherwise *dropped is
+ * 0.  rec->call is whatever id the writer used, which is only meaningful
+ * with the writer's TRACE_CHUNK_CALLS table.
+ */
+ssize_t PRIVATE
+trace_decode(const uint8_t *in, size_t size, struct trace_record *rec,
+             struct trace_cursor *cursor, uint64_t *dropped)
+{
+        uint64_t val;
+        size_t n = 0;
+
+        memset(rec, 0, sizeof(*rec));
+        *dropped = 0;
+
+        get_varint(&val);
+        if (val == 0) {
+                get_varint(&val);
+                rec->tid = val;
+                get_varint(dropped);
+                return n;
+        }
+        if (val - 1 > UINT16_MAX)
+                goto err;
+        rec->call = val - 1;
+
+        get_varint(&val);
+        rec->tid = cursor->tid + unzigzag(val);
+        get_varint(&val);
+        rec->timestamp = cursor->timestamp + unzigzag(val);
+        get_varint(&rec->latency);
+        get_varint(&val);
+        rec->ret = unzigzag(val);
+        get_varint(&val);
+        rec->error = val;
+
+        get_varint(&val);
+        if (val > TRACE_MAX_ARGS)
+                goto err;
+        rec->nargs = val;
+        for (unsigned int i = 0; i < rec->nargs; i++) {
+                get_varint(&val);
+                rec->args[i] = unzigzag(val);
+        }
+
+        get_varint(&val);
+        if (val > TRACE_STRINGS || val > size - n)
+                goto err;
+        rec->strings_used = val;
+        memcpy(rec->strings, in + n, val);
+        rec->strings[TRACE_STRINGS - 1] = '\0';
+        n += val;
+
+        cursor->timestamp = rec->timestamp;
+        cursor->tid = rec->tid;
+        return n;
+err:
+        errno = EINVAL;
+        return -1;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -138,6 +138,27 @@
 
 #define startswith(str, prefix) ({!strncmp(str, prefix, strlen(prefix));})
 
+/*
+ * Return the next component of *pathp and its length in *lenp, and
+ * advance *pathp past it, or return NULL if there aren't any left.
+ */
+static inline UNUSED const char *
+next_component(const char **pathp, size_t *lenp)
+{
+        const char *path = *pathp;
+        const char *end;
+
+        while (*path == '/')
+                path++;
+        if (!*path)
+                return NULL;
+
+        end = strchrnul(path, '/');
+        *lenp = end - path;
+        *pathp = end;
+        return path;
+}
+
 static inline int UNUSED
 read_file(int fd, uint8_t **buf, size_t *bufsize)
 {
@@ -631,32 +652,6 @@ find_path_segment(const char *path, int segment, const char **pos, size_t *len)
 extern DIR PRIVATE *rootdir;
 extern int PRIVATE rootfd;
 
-static inline bool
-is_blkdev_fd(int fd)
-{
-        return ((((unsigned long long)fd >> ((sizeof(fd) * 8) - 8)) & 0xffULL) == 0xbbULL);
-}
-
-static inline int
-demangle_fd(int fd)
-{
-        if (is_blkdev_fd(fd)) {
-                unsigned int mask = ~(0x0ffU << ((sizeof(fd) * 8U) - 8U));
-
-                fd &= mask;
-        }
-        return fd;
-}
-
-static inline int
-mangle_fd(int fd)
-{
-        unsigned int mask = ~(0x0ffU << ((sizeof(fd) * 8U) - 8U));
-        unsigned int marker = 0x0bbU << ((sizeof(fd) * 8U) - 8U);
-
-        return ((fd & mask) | marker);
-}
-
 static inline bool UNUSED
 is_blkdev_at(int dirfd, const char *pathname)
 {
@@ -683,21 +678,6 @@ is_blkdev(const char *pathname)
         return S_ISBLK(sb.st_mode);
 }
 
-static inline bool UNUSED
-is_our_path(const char *pathname)
-{
-        char real[PATH_MAX];
-        char *ret;
-
-        ret = realpath(pathname, real);
-        if (ret == NULL)
-                return false;
-        return (startswith(real, "/dev/")
-                || startswith(real, "/sys/")
-                || startswith(real, "/proc/")
-                || is_blkdev(real));
-}
-
 #define debug_(file, line, func, level, fmt, args...)                   \
         ({                                                              \
                 if (efi_get_verbose() >= level) {                       \